@@ -0,0 +1,222 @@
+#include <algorithm>
+#include <atomic>
+#include <cctype>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "batch.hpp"
+#include "common.hpp"
+#include "output.hpp"
+#include "parse.hpp"
+#include "raytracer.hpp"
+#include "scene.hpp"
+#include "thread_pool.hpp"
+#include "timeline.hpp"
+
+using std::string;
+
+
+struct batch_env {
+  parse_env penv;
+  uint32_t object_count;
+  scene_camera camera;
+  transform3f transform;
+  std::vector<batch_move> moves;
+  std::vector<batch_frame> *frames;
+};
+
+
+static void exec_command(batch_env *env, string line) {
+  string cmd = parse_cmd(&env->penv, &line);
+
+  if (cmd == "frame") {
+    string filename = parse_string(&env->penv, &line);
+    env->frames->push_back({ filename, image_format_for(filename),
+                             env->camera, env->moves });
+    env->moves.clear();
+
+  } else if (cmd == "cam") {
+    env->camera.eye = parse_vec3f(&env->penv, &line);
+    env->camera.lower_left = parse_vec3f(&env->penv, &line);
+    env->camera.lower_right = parse_vec3f(&env->penv, &line);
+    env->camera.upper_left = parse_vec3f(&env->penv, &line);
+    env->camera.upper_right = parse_vec3f(&env->penv, &line);
+
+  } else if (cmd == "xfz") {
+    env->transform = trans3_identity();
+
+  } else if (cmd == "xft") {
+    vec3f t = parse_vec3f(&env->penv, &line);
+    env->transform *= trans3_translate(t);
+
+  } else if (cmd == "xfs") {
+    vec3f s = parse_vec3f(&env->penv, &line);
+    if (s.x == 0 || s.y == 0 || s.z == 0)
+      parse_error(&env->penv, "Scaling factors should be finite and nonzero");
+    env->transform *= trans3_scale(s.x, s.y, s.z);
+
+  } else if (cmd == "xfr") {
+    vec3f r = parse_vec3f(&env->penv, &line);
+    rtfloat a = magnitude(r) * 3.14159265358979 / 180;
+    r = normalize(r);
+    env->transform *= trans3_rotate(r, a);
+
+  } else if (cmd == "move") {
+    long int id = parse_int(&env->penv, &line);
+    if (id < 1 || id > (long int) env->object_count)
+      parse_error(&env->penv, "No object %ld", id);
+    else
+      env->moves.push_back({ (uint32_t) id, env->transform });
+
+  } else {
+    parse_warning(&env->penv, "Unsupported command '%s'", cmd.c_str());
+    return;
+  }
+
+  while (isspace(line[0])) line.erase(0, 1);
+  if (line.size() > 0)
+    parse_warning(&env->penv, "Extraneous arguments '%s'", line.c_str());
+}
+
+
+bool batch_read(FILE *input, const string &filename, const scene &s,
+                std::vector<batch_frame> *frames) {
+  batch_env env;
+  env.penv = parse_env_create(filename);
+  env.object_count = 0;
+  for (scene_object *obj : s.objects)
+    env.object_count = std::max(env.object_count, obj->id);
+  env.camera = s.camera;
+  env.transform = trans3_identity();
+  env.frames = frames;
+
+  string line;
+  while ((line = read_line(&env.penv, input)) != "")
+    exec_command(&env, line);
+
+  if (!env.moves.empty())
+    fprintf(stderr, "Warning: %s: Moves after the last frame\n",
+            filename.c_str());
+  return !env.penv.error;
+}
+
+bool batch_read_file(const string &filename, const scene &s,
+                     std::vector<batch_frame> *frames) {
+  FILE *input = fopen(filename.c_str(), "r");
+  if (input == nullptr) {
+    fprintf(stderr, "Error: Failed to open %s\n", filename.c_str());
+    return false;
+  }
+  bool ok = batch_read(input, filename, s, frames);
+  fclose(input);
+  return ok;
+}
+
+
+
+batch_objects batch_objects_create(scene *s) {
+  batch_objects b;
+  for (scene_object *obj : s->objects)
+    b.objects[obj->id].push_back(obj);
+  return b;
+}
+
+structure_update batch_place(scene *s, batch_objects *b,
+                             const std::vector<batch_move> &moves) {
+  structure_update total = { 0, 0, 0 };
+  for (const batch_move &m : moves) {
+    // Undo the last placement, if there was one, on the way to the new one
+    auto last = b->placements.find(m.id);
+    transform3f delta = m.placement;
+    if (last != b->placements.end())
+      delta = m.placement * inv(last->second);
+    b->placements[m.id] = m.placement;
+
+    structure_update u = scene_transform_objects(s, b->objects[m.id], delta);
+    total.nodes_refit += u.nodes_refit;
+    total.subtrees_rebuilt += u.subtrees_rebuilt;
+    total.objects_rebuilt += u.objects_rebuilt;
+  }
+  return total;
+}
+
+
+
+static const size_t batch_group_frames = 16;  // Image files open at once
+
+bool batch_render(scene *s, const std::vector<batch_frame> &frames,
+                  size_t frame_width, size_t frame_height,
+                  render_region region, const tonemap_options &tonemap,
+                  const render_options &options, render_stats *stats,
+                  batch_stats *bstats) {
+  size_t width = region.x1 - region.x0;
+  size_t height = region.y1 - region.y0;
+  batch_objects objects = batch_objects_create(s);
+  *bstats = { frames.size(), 0, { 0, 0, 0 } };
+  *stats = { 0, 0, 1, 0 };
+
+  render_options opts = options;
+  opts.pool = thread_pool_create(opts.num_threads);
+  std::atomic<bool> ok(true);
+
+  for (size_t first = 0; first < frames.size() && ok; ) {
+    const std::vector<batch_move> &moved = frames[first].moves;
+    if (!moved.empty()) {
+      structure_update u = batch_place(s, &objects, moved);
+      bstats->updates.nodes_refit += u.nodes_refit;
+      bstats->updates.subtrees_rebuilt += u.subtrees_rebuilt;
+      bstats->updates.objects_rebuilt += u.objects_rebuilt;
+      bstats->moves += moved.size();
+    }
+
+    size_t end = first + 1;
+    while (end < frames.size() && end - first < batch_group_frames &&
+           frames[end].moves.empty())
+      end++;
+
+    std::vector<render_frame> group;
+    for (size_t f = first; f < end; f++) {
+      const std::string &filename = frames[f].filename;
+      image_file *image = open_image_file(filename, width, height,
+                                          frames[f].format, tonemap);
+      if (image == nullptr) {
+        fprintf(stderr, "Error: Failed to open %s\n", filename.c_str());
+        ok = false;
+        break;
+      }
+
+      render_frame frame;
+      frame.width = frame_width;
+      frame.height = frame_height;
+      frame.region = region;
+      frame.camera = frames[f].camera;
+      frame.tile_done = [image, region](render_region tile,
+                                        const color3f *pixels) {
+        size_t tile_width = tile.x1 - tile.x0;
+        for (size_t y = tile.y0; y < tile.y1; y++)
+          write_pixels(image, tile.x0 - region.x0, y - region.y0, tile_width,
+                       &pixels[(y - tile.y0) * tile_width]);
+      };
+      frame.frame_done = [image, filename, &ok]() {
+        timeline_scope scope("flush output", "output");
+        if (!close_image(image, filename))
+          ok = false;
+      };
+      group.push_back(frame);
+    }
+
+    // Frames already open still render, so none is left unfinished
+    render_stats group_stats = { 0, 0, 1, 0 };
+    if (!group.empty())
+      scene_render_frames(s, group, opts, &group_stats);
+    stats->pixels += group_stats.pixels;
+    stats->samples += group_stats.samples;
+    stats->buffer_bytes = std::max(stats->buffer_bytes,
+                                   group_stats.buffer_bytes);
+    first = end;
+  }
+
+  thread_pool_destroy(opts.pool);
+  return ok;
+}
@@ -0,0 +1,84 @@
+#ifndef _RAYTRACER_BATCH_HPP
+#define _RAYTRACER_BATCH_HPP
+
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#include "common.hpp"
+#include "image.hpp"
+#include "object_structure.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "tonemap.hpp"
+
+
+/* Batch files list frames to render from one scene, in the scene file
+ * format:
+ *
+ *   frame FILE            Render a frame to FILE (in quotes)
+ *   cam EYE LL LR UL UR   Camera of this and later frames
+ *   xfz, xft, xfs, xfr    Transform, as in scene files
+ *   move ID               Place object ID at the transform, relative to
+ *                         where the scene file put it
+ *
+ * Objects are numbered from 1 in scene file order, and the triangles of an
+ * obj line are one object. An object stays where it was placed until it
+ * is moved again */
+
+struct batch_move {
+  uint32_t id;
+  transform3f placement;
+};
+
+struct batch_frame {
+  std::string filename;
+  image_format format;            // From the extension of filename
+  scene_camera camera;
+  std::vector<batch_move> moves;  // Since the previous frame
+};
+
+// Frames start with the scene's camera. Returns false after reporting
+// errors, such as moves of objects the scene does not have
+bool batch_read(FILE *, const std::string &filename, const scene &,
+                std::vector<batch_frame> *frames);
+bool batch_read_file(const std::string &filename, const scene &,
+                     std::vector<batch_frame> *frames);
+
+
+/* Objects of a scene by id, and where each was last placed */
+struct batch_objects {
+  std::unordered_map<uint32_t, std::vector<scene_object *>> objects;
+  std::unordered_map<uint32_t, transform3f> placements;
+};
+
+batch_objects batch_objects_create(scene *);
+
+// Moves the objects to their new placements and updates the structure
+structure_update batch_place(scene *, batch_objects *,
+                             const std::vector<batch_move> &);
+
+
+/* Rendering. Frames between which nothing moves render as one queue of
+ * tiles, so no thread waits for the end of a frame. Moves wait for the
+ * frames before them to finish, since those frames share the scene */
+
+struct batch_stats {
+  size_t frames;
+  size_t moves;
+  structure_update updates;
+};
+
+// Renders the region of each frame_width x frame_height frame to its file,
+// moving objects as the frames go. Returns false after reporting a file
+// that could not be opened or written
+bool batch_render(scene *, const std::vector<batch_frame> &,
+                  size_t frame_width, size_t frame_height, render_region,
+                  const tonemap_options &, const render_options &,
+                  render_stats *, batch_stats *);
+
+
+#endif
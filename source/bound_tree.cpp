@@ -1,8 +1,12 @@
+#include <algorithm>
 #include <cstdio>
+#include <unordered_map>
 #include <vector>
 
 #include "common.hpp"
 #include "scene.hpp"
+#include "stats.hpp"
+#include "timeline.hpp"
 
 
 struct bound_tree_node {
@@ -11,6 +15,9 @@ struct bound_tree_node {
   
   aa_box3f bounding_box;
   std::vector<scene_object *> objects;
+
+  rtfloat cost;         // SAH cost of a ray that reaches the node
+  rtfloat built_cost;   // The same when the subtree was last built
 };
 
 
@@ -110,19 +117,160 @@ static void distribute(bound_tree_node *node) {
 }
 
 
+/* Surface area heuristic. A ray that reaches a node costs a step for the
+ * node, one for each of its objects, and the costs of its children times
+ * the chance the ray hits their boxes given it hit the node's, which is
+ * the ratio of their surface areas. Steps are counted as the traversal
+ * counters count them */
+
+static rtfloat surface_area(const aa_box3f &box) {
+  vec3f d = box.high_v - box.low_v;
+  if (d.x < 0 || d.y < 0 || d.z < 0) return 0;
+  return 2 * (d.x*d.y + d.y*d.z + d.z*d.x);
+}
+
+static rtfloat node_cost(const bound_tree_node *node) {
+  rtfloat area = surface_area(node->bounding_box);
+  rtfloat cost = 1 + (rtfloat) node->objects.size();
+  for (int k = 0; k < 2; k++) {
+    const bound_tree_node *child = node->children[k];
+    if (child == nullptr) continue;
+    rtfloat p = area > 0 ? surface_area(child->bounding_box) / area : 1;
+    cost += p * child->cost;
+  }
+  return cost;
+}
+
+// Costs of a subtree just built
+static void init_costs(bound_tree_node *node) {
+  for (int k = 0; k < 2; k++)
+    if (node->children[k] != nullptr)
+      init_costs(node->children[k]);
+  node->cost = node->built_cost = node_cost(node);
+}
+
+
 static void get_candidates(flat_list<scene_object *> *list,
                             bound_tree_node *node, ray3f ray) {
-  if (node == nullptr || !intersect(ray, node->bounding_box)) return;
+  if (node == nullptr) return;
+  trace_counters &counters = thread_counters();
+  counters.nodes_visited += 1;
+  if (!intersect(ray, node->bounding_box)) return;
 
-  if (!node->objects.empty()) list->extend(&node->objects);
+  if (!node->objects.empty()) {
+    counters.leaf_visits[leaf_bucket(node->objects.size())] += 1;
+    list->extend(&node->objects);
+  }
   get_candidates(list, node->children[0], ray);
   get_candidates(list, node->children[1], ray);
 }
 
 
+static void count_node_leaves(const bound_tree_node *node,
+                              uint64_t *histogram) {
+  if (node == nullptr) return;
+  if (!node->objects.empty())
+    histogram[leaf_bucket(node->objects.size())] += 1;
+  count_node_leaves(node->children[0], histogram);
+  count_node_leaves(node->children[1], histogram);
+}
+
+
+static size_t node_memory(const bound_tree_node *node) {
+  if (node == nullptr) return 0;
+  return sizeof(bound_tree_node) +
+         node->objects.capacity() * sizeof(scene_object *) +
+         node_memory(node->children[0]) + node_memory(node->children[1]);
+}
+
+
+
+/* Updates. Moved objects have their leaves' bounds refit, and then those
+ * of every ancestor, along the parent pointers. Refitting keeps the tree
+ * correct but not good, as boxes that grew apart start to overlap, so a
+ * subtree whose cost has grown to rebuild_ratio times what it was when it
+ * was built is built again from its objects. Only the nodes above moved
+ * objects are visited, so a frame in which a few objects move costs far
+ * less than building the tree */
+
+static const rtfloat rebuild_ratio = 1.5;
+
+typedef std::unordered_map<scene_object *, bound_tree_node *> leaf_map;
+
+static void map_leaves(bound_tree_node *node, leaf_map *leaves) {
+  for (scene_object *obj : node->objects)
+    (*leaves)[obj] = node;
+  for (int k = 0; k < 2; k++)
+    if (node->children[k] != nullptr)
+      map_leaves(node->children[k], leaves);
+}
+
+static void collect_objects(const bound_tree_node *node,
+                            std::vector<scene_object *> *objects) {
+  objects->insert(objects->end(), node->objects.begin(),
+                  node->objects.end());
+  for (int k = 0; k < 2; k++)
+    if (node->children[k] != nullptr)
+      collect_objects(node->children[k], objects);
+}
+
+static bool same_box(const aa_box3f &a, const aa_box3f &b) {
+  for (int k = 0; k < 3; k++)
+    if (a.low_v.data[k] != b.low_v.data[k] ||
+        a.high_v.data[k] != b.high_v.data[k])
+      return false;
+  return true;
+}
+
+// Refits the node and its ancestors. An ancestor left as it was was last
+// refit from the same children, and so were those above it
+static void refit_path(bound_tree_node *node, structure_update *update) {
+  for (; node != nullptr; node = node->parent) {
+    aa_box3f old_box = node->bounding_box;
+    rtfloat old_cost = node->cost;
+    update_bounding_box(node);
+    node->cost = node_cost(node);
+    update->nodes_refit += 1;
+    if (node->cost == old_cost && same_box(node->bounding_box, old_box))
+      break;
+  }
+}
+
+// The highest ancestor of the node, or the node, whose cost has blown up,
+// or null if none has
+static bound_tree_node *highest_blown(bound_tree_node *node) {
+  bound_tree_node *blown = nullptr;
+  for (; node != nullptr; node = node->parent)
+    if (node->cost > rebuild_ratio * node->built_cost)
+      blown = node;
+  return blown;
+}
+
+static void rebuild(bound_tree_node *node, leaf_map *leaves,
+                    structure_update *update) {
+  timeline_scope scope("rebuild bvh subtree", "build");
+  std::vector<scene_object *> objects;
+  collect_objects(node, &objects);
+  for (int k = 0; k < 2; k++) {
+    bound_tree_node_destroy(node->children[k]);
+    node->children[k] = nullptr;
+  }
+
+  node->objects = objects;
+  update_bounding_box(node);
+  distribute(node);
+  init_costs(node);
+  map_leaves(node, leaves);
+
+  update->subtrees_rebuilt += 1;
+  update->objects_rebuilt += objects.size();
+}
+
+
 
 struct bound_tree : object_structure {
   bound_tree_node *root;
+  leaf_map leaves;    // Made on the first update
 
   ~bound_tree() {
     bound_tree_node_destroy(root);
@@ -133,12 +281,69 @@ struct bound_tree : object_structure {
     get_candidates(&result, root, ray);
     return result;
   }
+
+  void count_leaves(uint64_t *histogram) {
+    count_node_leaves(root, histogram);
+  }
+
+  size_t memory_size() {
+    return sizeof(bound_tree) + node_memory(root) +
+           leaves.size() * (sizeof(leaf_map::value_type) + sizeof(void *)) +
+           leaves.bucket_count() * sizeof(void *);
+  }
+
+  structure_update update(const std::vector<scene_object *> &moved) {
+    timeline_scope scope("update bvh", "build");
+    structure_update result = structure_update();
+    if (leaves.empty())
+      map_leaves(root, &leaves);
+
+    std::vector<bound_tree_node *> dirty;
+    for (scene_object *obj : moved) {
+      auto leaf = leaves.find(obj);
+      if (leaf != leaves.end())
+        dirty.push_back(leaf->second);
+    }
+    std::sort(dirty.begin(), dirty.end());
+    dirty.erase(std::unique(dirty.begin(), dirty.end()), dirty.end());
+
+    for (bound_tree_node *leaf : dirty)
+      refit_path(leaf, &result);
+
+    std::vector<bound_tree_node *> blown;
+    for (bound_tree_node *leaf : dirty) {
+      bound_tree_node *node = highest_blown(leaf);
+      if (node != nullptr)
+        blown.push_back(node);
+    }
+
+    /* Rebuild the highest blown up subtrees, then fix the costs above
+     * them. None is inside another, since the highest blown up node above
+     * any leaf inside a subtree is its root or above it. Their bounds stay
+     * the same, as their objects do */
+    std::sort(blown.begin(), blown.end());
+    blown.erase(std::unique(blown.begin(), blown.end()), blown.end());
+    for (bound_tree_node *node : blown) {
+      rebuild(node, &leaves, &result);
+      for (bound_tree_node *n = node->parent; n != nullptr; n = n->parent)
+        n->cost = node_cost(n);
+    }
+    return result;
+  }
 };
 
 
 object_structure *object_bound_tree(scene *s) {
+  timeline_scope scope("build bvh", "build");
   bound_tree *tree = new bound_tree;
-  tree->root = bound_tree_node_create(s->objects);
-  distribute(tree->root);
+  {
+    timeline_scope bounds("bvh root bounds", "build");
+    tree->root = bound_tree_node_create(s->objects);
+  }
+  {
+    timeline_scope split("bvh split", "build");
+    distribute(tree->root);
+  }
+  init_costs(tree->root);
   return tree;
 }
@@ -0,0 +1,218 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <string>
+#include <vector>
+
+#include <unistd.h>
+
+#include "checkpoint.hpp"
+#include "common.hpp"
+#include "framebuffer.hpp"
+#include "render.hpp"
+
+
+typedef std::chrono::steady_clock clock_type;
+
+
+enum checkpoint_kind : uint32_t {
+  kind_rows = 1,    // Header, then color3f rows from the top
+  kind_accum,       // Header, then sum, lum_sq and count of an accum_buffer
+};
+
+struct checkpoint_header {
+  char magic[8];
+  uint32_t kind;
+  uint32_t reserved;
+  uint64_t fingerprint;
+  uint64_t width, height;
+};
+
+static const char checkpoint_magic[8] = { 'A', 'S', '2', 'C', 'K', 'P', 'T',
+                                          '1' };
+
+
+static checkpoint_header make_header(checkpoint_kind kind,
+                                     uint64_t fingerprint, size_t width,
+                                     size_t height) {
+  checkpoint_header header;
+  memcpy(header.magic, checkpoint_magic, sizeof(header.magic));
+  header.kind = kind;
+  header.reserved = 0;
+  header.fingerprint = fingerprint;
+  header.width = width;
+  header.height = height;
+  return header;
+}
+
+static bool read_header(FILE *file, const checkpoint_header &expected) {
+  checkpoint_header header;
+  return fread(&header, sizeof(header), 1, file) == 1 &&
+         memcmp(&header, &expected, sizeof(header)) == 0;
+}
+
+// Flushes file all the way to the disk
+static bool sync_file(FILE *file) {
+  return fflush(file) == 0 && fsync(fileno(file)) == 0;
+}
+
+
+
+/* Row checkpoints. Rows are only ever appended, so a checkpoint cut short
+ * by a crash still holds every row before the last one */
+
+struct row_checkpoint {
+  std::string path;
+  FILE *file;
+  size_t width;
+  rtfloat interval;
+  clock_type::time_point last_sync;
+};
+
+
+// Number of whole rows in a matching checkpoint, with file positioned at
+// the first one, or 0
+static size_t saved_rows(FILE *file, const checkpoint_header &expected) {
+  if (!read_header(file, expected)) return 0;
+
+  long start = ftell(file);
+  if (fseek(file, 0, SEEK_END) != 0) return 0;
+  long end = ftell(file);
+  fseek(file, start, SEEK_SET);
+
+  size_t row_bytes = expected.width * sizeof(color3f);
+  size_t rows = row_bytes > 0 ? (size_t) (end - start) / row_bytes : 0;
+  return std::min(rows, (size_t) expected.height);
+}
+
+row_checkpoint *row_checkpoint_open(const std::string &path,
+                                    uint64_t fingerprint, size_t width,
+                                    size_t height, rtfloat interval,
+                                    bool resume, const row_callback &replay,
+                                    size_t *rows_done) {
+  checkpoint_header header = make_header(kind_rows, fingerprint, width,
+                                         height);
+  *rows_done = 0;
+
+  FILE *file = resume ? fopen(path.c_str(), "r+b") : nullptr;
+  if (file != nullptr) {
+    size_t rows = saved_rows(file, header);
+    std::vector<color3f> row(width);
+    while (*rows_done < rows &&
+           fread(row.data(), sizeof(color3f), width, file) == width) {
+      replay(*rows_done, row.data());
+      *rows_done += 1;
+    }
+
+    if (*rows_done == 0) {
+      fclose(file);
+      file = nullptr;
+    } else {
+      // Drop a row that was only partly written
+      long end = (long) (sizeof(header) + *rows_done * width *
+                                           sizeof(color3f));
+      if (fflush(file) != 0 || ftruncate(fileno(file), end) != 0 ||
+          fseek(file, end, SEEK_SET) != 0) {
+        fclose(file);
+        return nullptr;
+      }
+    }
+  }
+
+  if (file == nullptr) {
+    file = fopen(path.c_str(), "wb");
+    if (file == nullptr ||
+        fwrite(&header, sizeof(header), 1, file) != 1 || !sync_file(file)) {
+      if (file != nullptr) fclose(file);
+      return nullptr;
+    }
+  }
+
+  row_checkpoint *ckpt = new row_checkpoint;
+  ckpt->path = path;
+  ckpt->file = file;
+  ckpt->width = width;
+  ckpt->interval = interval;
+  ckpt->last_sync = clock_type::now();
+  return ckpt;
+}
+
+void row_checkpoint_add(row_checkpoint *ckpt, const color3f *row) {
+  fwrite(row, sizeof(color3f), ckpt->width, ckpt->file);
+
+  std::chrono::duration<double> elapsed = clock_type::now() -
+                                          ckpt->last_sync;
+  if (elapsed.count() >= ckpt->interval) {
+    sync_file(ckpt->file);
+    ckpt->last_sync = clock_type::now();
+  }
+}
+
+void row_checkpoint_close(row_checkpoint *ckpt, bool finished) {
+  if (ckpt == nullptr) return;
+  if (finished) {
+    fclose(ckpt->file);
+    remove(ckpt->path.c_str());
+  } else {
+    sync_file(ckpt->file);
+    fclose(ckpt->file);
+  }
+  delete ckpt;
+}
+
+
+
+/* Accumulation buffer checkpoints. A new checkpoint is written next to the
+ * old one and renamed over it, so there is always a complete one */
+
+bool accum_checkpoint_save(const std::string &path, uint64_t fingerprint,
+                           const accum_buffer *accum) {
+  checkpoint_header header = make_header(kind_accum, fingerprint,
+                                         accum->width, accum->height);
+  std::string temp = path + ".tmp";
+  FILE *file = fopen(temp.c_str(), "wb");
+  if (file == nullptr) return false;
+
+  size_t pixels = accum->width * accum->height;
+  bool ok = fwrite(&header, sizeof(header), 1, file) == 1 &&
+            fwrite(accum->sum.data(), sizeof(float), 3 * pixels, file) ==
+                3 * pixels &&
+            fwrite(accum->lum_sq.data(), sizeof(float), pixels, file) ==
+                pixels &&
+            fwrite(accum->count.data(), sizeof(uint32_t), pixels, file) ==
+                pixels;
+  ok = sync_file(file) && ok;
+  fclose(file);
+
+  if (!ok || rename(temp.c_str(), path.c_str()) != 0) {
+    remove(temp.c_str());
+    return false;
+  }
+  return true;
+}
+
+bool accum_checkpoint_load(const std::string &path, uint64_t fingerprint,
+                           accum_buffer *accum) {
+  checkpoint_header header = make_header(kind_accum, fingerprint,
+                                         accum->width, accum->height);
+  FILE *file = fopen(path.c_str(), "rb");
+  if (file == nullptr) return false;
+
+  size_t pixels = accum->width * accum->height;
+  std::vector<float> sum(3 * pixels), lum_sq(pixels);
+  std::vector<uint32_t> count(pixels);
+  bool ok = read_header(file, header) &&
+            fread(sum.data(), sizeof(float), 3 * pixels, file) ==
+                3 * pixels &&
+            fread(lum_sq.data(), sizeof(float), pixels, file) == pixels &&
+            fread(count.data(), sizeof(uint32_t), pixels, file) == pixels;
+  fclose(file);
+  if (!ok) return false;
+
+  accum->sum.swap(sum);
+  accum->lum_sq.swap(lum_sq);
+  accum->count.swap(count);
+  return true;
+}
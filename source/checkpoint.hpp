@@ -0,0 +1,42 @@
+#ifndef _RAYTRACER_CHECKPOINT_HPP
+#define _RAYTRACER_CHECKPOINT_HPP
+
+
+#include <cstdint>
+#include <string>
+
+#include "common.hpp"
+#include "framebuffer.hpp"
+#include "render.hpp"
+
+
+/* Checkpoints let a render that was killed pick up where it stopped. A
+ * render in row order appends finished rows to its checkpoint, and a
+ * progressive render saves its whole accumulation buffer, replacing the
+ * old checkpoint in one step. Every checkpoint starts with a fingerprint
+ * of the job, and one from a different job is ignored */
+
+struct row_checkpoint;
+
+// Checkpoint for an image of width x height pixels, written to disk at
+// most every interval seconds. If resume is set, the rows of a matching
+// checkpoint are passed to replay in order and counted in *rows_done.
+// Returns null if the file cannot be written
+row_checkpoint *row_checkpoint_open(const std::string &path,
+                                    uint64_t fingerprint, size_t width,
+                                    size_t height, rtfloat interval,
+                                    bool resume, const row_callback &replay,
+                                    size_t *rows_done);
+void row_checkpoint_add(row_checkpoint *, const color3f *row);
+// Removes the file if the image is finished, else writes it out
+void row_checkpoint_close(row_checkpoint *, bool finished);
+
+
+// Each returns false on failure. A failed load leaves accum unchanged
+bool accum_checkpoint_save(const std::string &path, uint64_t fingerprint,
+                           const accum_buffer *);
+bool accum_checkpoint_load(const std::string &path, uint64_t fingerprint,
+                           accum_buffer *);
+
+
+#endif
@@ -23,6 +23,7 @@ template <typename T>
 T clamp(T x, T lo, T hi);
 
 std::string get_directory(std::string filename);
+bool read_file(const std::string &filename, std::string *contents);
 
 
 
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "common.hpp"
+#include "denoise.hpp"
+#include "framebuffer.hpp"
+#include "render.hpp"
+#include "thread_pool.hpp"
+
+
+static const rtfloat b3_kernel[5] = { 1/16.0, 1/4.0, 3/8.0, 1/4.0, 1/16.0 };
+static const rtfloat gauss3_kernel[3] = { 1/4.0, 1/2.0, 1/4.0 };
+
+
+struct denoise_pass {
+  const denoise_options *opts;
+  const pixel_aov *aovs;        // With unit normals
+  int width, height;
+  int step;
+
+  const color3f *color_in;
+  const rtfloat *lum_in;        // Luminance of color_in
+  const rtfloat *var_in;
+  color3f *color_out;
+  rtfloat *var_out;
+};
+
+
+// Calls f(tap index, qx, qy) for the taps of an n x n kernel around (x, y)
+// that are inside the image
+template <typename F>
+static void for_taps(const denoise_pass &pass, int x, int y, int n, int step,
+                     F f) {
+  for (int j = 0; j < n; j++) {
+    int qy = y + (j - n/2) * step;
+    if (qy < 0 || qy >= pass.height) continue;
+    for (int i = 0; i < n; i++) {
+      int qx = x + (i - n/2) * step;
+      if (qx < 0 || qx >= pass.width) continue;
+      f(i, j, (size_t) qy * pass.width + qx);
+    }
+  }
+}
+
+
+/* Pixels with one sample have no variance of their own, so the spread of
+ * luminance over their neighbors on the same object stands in */
+static rtfloat spatial_variance(const denoise_pass &pass, int x, int y) {
+  size_t center = (size_t) y * pass.width + x;
+  uint32_t object = pass.aovs[center].object;
+  rtfloat sum = 0, sq_sum = 0;
+  size_t count = 0;
+
+  for_taps(pass, x, y, 3, 1, [&](int, int, size_t q) {
+    if (pass.aovs[q].object != object) return;
+    rtfloat lum = luminance(pass.color_in[q]);
+    sum += lum;
+    sq_sum += lum * lum;
+    count += 1;
+  });
+
+  rtfloat mean = sum / count;
+  return std::max(sq_sum / count - mean * mean, (rtfloat) 0);
+}
+
+
+// Weight of tap q for pixel p, apart from the kernel
+static rtfloat edge_weight(const denoise_pass &pass, const pixel_aov &p,
+                           const pixel_aov &q, rtfloat lum_diff) {
+  const denoise_options &opts = *pass.opts;
+  if (p.object != q.object) return 0;
+  rtfloat w = q.coverage * q.coverage;
+  rtfloat exponent = lum_diff;
+
+  if (p.object != 0) {
+    rtfloat cosine = dot(p.normal, q.normal);
+    if (cosine <= 0) return 0;
+    w *= std::pow(cosine, opts.sigma_normal);
+
+    rtfloat dz = std::abs(p.depth - q.depth) / std::max(p.depth, 1e-6);
+    color3f da = p.albedo - q.albedo;
+    exponent += dz / (opts.sigma_depth * pass.step) +
+                dot(da, da) / (opts.sigma_albedo * opts.sigma_albedo);
+  }
+  return w * std::exp(-exponent);
+}
+
+static void filter_row(const denoise_pass &pass, int y) {
+  const denoise_options &opts = *pass.opts;
+
+  for (int x = 0; x < pass.width; x++) {
+    size_t center = (size_t) y * pass.width + x;
+    const pixel_aov &p = pass.aovs[center];
+
+    // Colors at object edges vary because of what the pixel covers, not
+    // noise, so these pixels keep their antialiasing
+    if (p.coverage < 1) {
+      pass.color_out[center] = pass.color_in[center];
+      pass.var_out[center] = pass.var_in[center];
+      continue;
+    }
+    rtfloat lum_p = pass.lum_in[center];
+
+    // The noise level is blurred a little, since it is itself noisy
+    rtfloat var = 0;
+    for_taps(pass, x, y, 3, 1, [&](int i, int j, size_t q) {
+      var += gauss3_kernel[i] * gauss3_kernel[j] * pass.var_in[q];
+    });
+    rtfloat lum_scale = 1 / (opts.sigma_luminance * std::sqrt(var) + 1e-4);
+
+    color3f color_sum = {0, 0, 0};
+    rtfloat var_sum = 0, weight_sum = 0;
+    for_taps(pass, x, y, 5, pass.step, [&](int i, int j, size_t q) {
+      rtfloat w = b3_kernel[i] * b3_kernel[j];
+      if (q != center) {
+        rtfloat dl = std::abs(lum_p - pass.lum_in[q]) * lum_scale;
+        w *= edge_weight(pass, p, pass.aovs[q], dl);
+      }
+      color_sum = color_sum + w * pass.color_in[q];
+      var_sum += w * w * pass.var_in[q];
+      weight_sum += w;
+    });
+
+    // The center tap always has full weight, so weight_sum > 0
+    pass.color_out[center] = color_sum / weight_sum;
+    pass.var_out[center] = var_sum / (weight_sum * weight_sum);
+  }
+}
+
+
+// Runs f(y) for each row, over the pool or on this thread if it is null
+template <typename F>
+static void for_rows(thread_pool *pool, size_t rows, F f) {
+  if (pool == nullptr) {
+    for (size_t y = 0; y < rows; y++) f((int) y);
+  } else {
+    parallel_for(pool, rows, [&](size_t y, size_t) { f((int) y); });
+  }
+}
+
+
+void denoise(color3f *image, const pixel_aov *aovs, size_t width,
+             size_t height, const denoise_options &opts, thread_pool *pool) {
+  size_t pixels = width * height;
+  std::vector<color3f> color_buffer(pixels);
+  std::vector<rtfloat> lum(pixels);
+  std::vector<rtfloat> var_buffer[2] = { std::vector<rtfloat>(pixels),
+                                         std::vector<rtfloat>(pixels) };
+  color3f *color_in = image, *color_out = color_buffer.data();
+  rtfloat *var_in = var_buffer[0].data(), *var_out = var_buffer[1].data();
+
+  // Mean normals are shorter at creases, so only their directions count
+  std::vector<pixel_aov> guides(aovs, aovs + pixels);
+  for (pixel_aov &g : guides) {
+    rtfloat length = magnitude(g.normal);
+    if (length > 0) g.normal = g.normal / length;
+  }
+
+  denoise_pass pass = { &opts, guides.data(), (int) width, (int) height, 1,
+                        color_in, lum.data(), var_in, color_out, var_out };
+
+  for_rows(pool, height, [&](int y) {
+    for (int x = 0; x < pass.width; x++) {
+      size_t i = (size_t) y * width + x;
+      var_in[i] = aovs[i].variance >= 0 ? aovs[i].variance :
+                                          spatial_variance(pass, x, y);
+    }
+  });
+
+  for (int i = 0; i < opts.iterations; i++) {
+    pass.step = 1 << i;
+    pass.color_in = color_in;
+    pass.var_in = var_in;
+    pass.color_out = color_out;
+    pass.var_out = var_out;
+
+    for (size_t p = 0; p < pixels; p++)
+      lum[p] = luminance(color_in[p]);
+    for_rows(pool, height, [&](int y) { filter_row(pass, y); });
+
+    std::swap(color_in, color_out);
+    std::swap(var_in, var_out);
+  }
+
+  if (color_in != image)
+    std::copy(color_in, color_in + pixels, image);
+}
+
+
+size_t denoise_memory(size_t width, size_t height) {
+  return width * height * (sizeof(color3f) + 3 * sizeof(rtfloat) +
+                           sizeof(pixel_aov));
+}
@@ -0,0 +1,35 @@
+#ifndef _RAYTRACER_DENOISE_HPP
+#define _RAYTRACER_DENOISE_HPP
+
+
+#include "common.hpp"
+#include "render.hpp"
+#include "thread_pool.hpp"
+
+
+/* Edge-avoiding a-trous wavelet filter (Dammertz et al. 2010) with the
+ * variance guidance of SVGF (Schied et al. 2017). Each pass blurs with a
+ * 5x5 B3-spline kernel whose taps are twice as far apart as in the last
+ * pass. Taps are weighted by how closely their object, normal, depth and
+ * albedo match the center pixel, and by their difference in luminance
+ * relative to the pixel's noise, so clean pixels are left alone and noise
+ * is smoothed within surfaces but not across their edges */
+
+struct denoise_options {
+  int iterations = 5;           // Filter radius is 2^(iterations+1) pixels
+  rtfloat sigma_luminance = 4;  // In standard deviations of the noise
+  rtfloat sigma_normal = 128;   // Exponent on the cosine between normals
+  rtfloat sigma_depth = 0.02;   // Relative depth change per pixel of step
+  rtfloat sigma_albedo = 0.1;
+};
+
+// Filters a width x height image in place, guided by the AOVs of its
+// pixels. Runs over pool, or on this thread if it is null
+void denoise(color3f *image, const pixel_aov *aovs, size_t width,
+             size_t height, const denoise_options &, thread_pool *pool);
+
+// Bytes of the buffers denoise allocates for a width x height image
+size_t denoise_memory(size_t width, size_t height);
+
+
+#endif
@@ -0,0 +1,426 @@
+#include <chrono>
+#include <cstdint>
+#include <cstdio>
+#include <cstring>
+#include <deque>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "distributed.hpp"
+#include "image.hpp"
+#include "net.hpp"
+#include "raster.hpp"
+#include "raytracer.hpp"
+#include "render.hpp"
+#include "thread_pool.hpp"
+
+
+typedef std::chrono::steady_clock clock_type;
+
+
+static const size_t dist_tile_size = 64;
+static const size_t tiles_per_worker = 2;   // In flight, to hide latency
+static const int max_copies = 2;            // Workers rendering one tile
+
+
+/* Messages are a header followed by size bytes of payload, in host byte
+ * order */
+
+enum message_type : uint32_t {
+  msg_args = 1,     // To a worker: NUL-terminated command line arguments
+  msg_ready,        // To the coordinator: the scene is loaded
+  msg_tile,         // To a worker: a tile_message
+  msg_result,       // To the coordinator: a result_header and RGB floats
+  msg_done,         // To a worker: the frame is finished
+};
+
+struct message_header {
+  uint32_t type;
+  uint32_t size;
+};
+
+struct tile_message {
+  uint32_t id;
+  uint32_t x0, y0, x1, y1;
+};
+
+struct result_header {
+  uint32_t id;
+  uint32_t reserved;
+  uint64_t samples;
+};
+
+
+static bool send_message(int fd, message_type type, const void *payload,
+                         size_t size, const void *extra = nullptr,
+                         size_t extra_size = 0) {
+  message_header header = { type, (uint32_t) (size + extra_size) };
+  return send_all(fd, &header, sizeof(header)) &&
+         send_all(fd, payload, size) &&
+         send_all(fd, extra, extra_size);
+}
+
+
+
+/* Coordinator */
+
+struct frame_tile {
+  render_region region;
+  int copies;                 // Workers rendering it now
+  bool issued;
+  bool done;
+  std::vector<float> pixels;  // Until its band is written
+  clock_type::time_point issue_time;
+};
+
+struct worker_conn {
+  int fd;
+  bool ready;
+  bool dead;
+  std::vector<uint32_t> in_flight;
+  std::vector<char> inbox;
+};
+
+struct coordinator {
+  size_t width, height;
+  size_t tiles_x, tiles_y;
+  std::vector<frame_tile> tiles;
+  std::deque<uint32_t> pending;
+  std::vector<worker_conn> workers;
+  size_t next_band;
+  render_stats stats;
+  distributed_stats dstats;
+};
+
+
+static void drop_worker(coordinator *c, worker_conn *w) {
+  for (uint32_t id : w->in_flight) {
+    frame_tile &tile = c->tiles[id];
+    tile.copies -= 1;
+    if (!tile.done && tile.copies == 0)
+      c->pending.push_front(id);
+  }
+  w->in_flight.clear();
+  if (!w->ready)
+    fprintf(stderr, "Warning: Worker failed to start\n");
+  else
+    fprintf(stderr, "Warning: Worker disconnected\n");
+  close(w->fd);
+  w->dead = true;
+}
+
+static bool holds(const worker_conn &w, uint32_t id) {
+  for (uint32_t held : w.in_flight)
+    if (held == id) return true;
+  return false;
+}
+
+// The next tile for w, or -1 if there is nothing useful for it to do
+static long next_tile(coordinator *c, const worker_conn &w) {
+  while (!c->pending.empty()) {
+    uint32_t id = c->pending.front();
+    c->pending.pop_front();
+    if (!c->tiles[id].done) return id;
+  }
+
+  /* Everything has been handed out, so help with the tile that has been
+   * out the longest */
+  long best = -1;
+  for (size_t id = 0; id < c->tiles.size(); id++) {
+    const frame_tile &tile = c->tiles[id];
+    if (tile.done || tile.copies == 0 || tile.copies >= max_copies ||
+        holds(w, (uint32_t) id))
+      continue;
+    if (best < 0 || tile.issue_time < c->tiles[best].issue_time)
+      best = (long) id;
+  }
+  return best;
+}
+
+static void assign_tiles(coordinator *c, worker_conn *w) {
+  while (w->ready && !w->dead && w->in_flight.size() < tiles_per_worker) {
+    long id = next_tile(c, *w);
+    if (id < 0) return;
+
+    frame_tile &tile = c->tiles[id];
+    if (tile.issued)
+      c->dstats.reissued += 1;
+    tile.issued = true;
+    tile.copies += 1;
+    tile.issue_time = clock_type::now();
+    w->in_flight.push_back((uint32_t) id);
+
+    const render_region &r = tile.region;
+    tile_message msg = { (uint32_t) id, (uint32_t) r.x0, (uint32_t) r.y0,
+                         (uint32_t) r.x1, (uint32_t) r.y1 };
+    if (!send_message(w->fd, msg_tile, &msg, sizeof(msg)))
+      drop_worker(c, w);
+  }
+}
+
+
+static bool receive_result(coordinator *c, worker_conn *w,
+                           const char *payload, size_t size) {
+  result_header header;
+  if (size < sizeof(header)) return false;
+  memcpy(&header, payload, sizeof(header));
+  if (header.id >= c->tiles.size() || !holds(*w, header.id)) return false;
+
+  frame_tile &tile = c->tiles[header.id];
+  const render_region &r = tile.region;
+  size_t floats = 3 * (r.x1 - r.x0) * (r.y1 - r.y0);
+  if (size != sizeof(header) + floats * sizeof(float)) return false;
+
+  for (size_t i = 0; i < w->in_flight.size(); i++) {
+    if (w->in_flight[i] == header.id) {
+      w->in_flight.erase(w->in_flight.begin() + i);
+      break;
+    }
+  }
+  tile.copies -= 1;
+
+  // The first copy to arrive wins
+  if (!tile.done) {
+    tile.done = true;
+    tile.pixels.resize(floats);
+    memcpy(tile.pixels.data(), payload + sizeof(header),
+           floats * sizeof(float));
+    c->stats.samples += header.samples;
+  }
+  return true;
+}
+
+// Handles the complete messages in the worker's inbox
+static bool read_messages(coordinator *c, worker_conn *w) {
+  size_t offset = 0;
+  message_header header;
+
+  while (w->inbox.size() - offset >= sizeof(header)) {
+    memcpy(&header, &w->inbox[offset], sizeof(header));
+    if (w->inbox.size() - offset - sizeof(header) < header.size) break;
+    const char *payload = &w->inbox[offset + sizeof(header)];
+
+    if (header.type == msg_ready)
+      w->ready = true;
+    else if (header.type != msg_result ||
+             !receive_result(c, w, payload, header.size))
+      return false;
+
+    offset += sizeof(header) + header.size;
+  }
+
+  w->inbox.erase(w->inbox.begin(), w->inbox.begin() + offset);
+  return true;
+}
+
+
+// Writes out the bands of tiles that are finished, in order
+static void write_bands(coordinator *c, image_ostream *stream) {
+  while (c->next_band < c->tiles_y) {
+    frame_tile *band = &c->tiles[c->next_band * c->tiles_x];
+    for (size_t t = 0; t < c->tiles_x; t++)
+      if (!band[t].done) return;
+
+    size_t y0 = band[0].region.y0, y1 = band[0].region.y1;
+    for (size_t y = y0; y < y1; y++) {
+      for (size_t t = 0; t < c->tiles_x; t++) {
+        const render_region &r = band[t].region;
+        const float *row = &band[t].pixels[3 * (y - y0) * (r.x1 - r.x0)];
+        for (size_t x = 0; x < r.x1 - r.x0; x++)
+          stream << color3f{ row[3*x], row[3*x + 1], row[3*x + 2] };
+      }
+    }
+
+    for (size_t t = 0; t < c->tiles_x; t++)
+      std::vector<float>().swap(band[t].pixels);
+    c->next_band += 1;
+  }
+}
+
+
+bool coordinator_run(const std::string &address,
+                     const std::vector<std::string> &args,
+                     render_region region,
+                     image_ostream *stream, render_stats *stats,
+                     distributed_stats *dstats) {
+  int listen_fd = socket_listen(address);
+  if (listen_fd < 0) return false;
+
+  coordinator c;
+  c.width = region.x1 - region.x0;
+  c.height = region.y1 - region.y0;
+  c.tiles_x = (c.width + dist_tile_size - 1) / dist_tile_size;
+  c.tiles_y = (c.height + dist_tile_size - 1) / dist_tile_size;
+  c.next_band = c.width > 0 ? 0 : c.tiles_y;
+  c.stats = { c.width * c.height, 0, 1, 0 };
+  c.dstats = { 0, c.tiles_x * c.tiles_y, 0 };
+
+  for (size_t ty = 0; ty < c.tiles_y; ty++) {
+    for (size_t tx = 0; tx < c.tiles_x; tx++) {
+      size_t x0 = region.x0 + tx * dist_tile_size;
+      size_t y0 = region.y0 + ty * dist_tile_size;
+      frame_tile tile;
+      tile.region = { x0, y0, std::min(x0 + dist_tile_size, region.x1),
+                      std::min(y0 + dist_tile_size, region.y1) };
+      tile.copies = 0;
+      tile.issued = false;
+      tile.done = false;
+      c.pending.push_back((uint32_t) c.tiles.size());
+      c.tiles.push_back(tile);
+    }
+  }
+
+  std::string packed;
+  for (const std::string &arg : args) {
+    packed += arg;
+    packed += '\0';
+  }
+
+  fprintf(stderr, "Waiting for workers on %s\n", address.c_str());
+
+  while (c.next_band < c.tiles_y) {
+    std::vector<pollfd> fds = { { listen_fd, POLLIN, 0 } };
+    for (const worker_conn &w : c.workers)
+      fds.push_back({ w.fd, POLLIN, 0 });
+    if (poll(fds.data(), fds.size(), -1) < 0) continue;
+
+    if (fds[0].revents & POLLIN) {
+      int fd = accept(listen_fd, nullptr, nullptr);
+      if (fd >= 0) {
+        c.workers.push_back({ fd, false, false, {}, {} });
+        c.dstats.workers += 1;
+        if (!send_message(fd, msg_args, packed.data(), packed.size()))
+          drop_worker(&c, &c.workers.back());
+      }
+    }
+
+    for (size_t i = 1; i < fds.size(); i++) {
+      worker_conn *w = &c.workers[i - 1];
+      if (w->dead || fds[i].revents == 0) continue;
+
+      char buffer[65536];
+      ssize_t n = recv(w->fd, buffer, sizeof(buffer), 0);
+      if (n <= 0) {
+        drop_worker(&c, w);
+        continue;
+      }
+      w->inbox.insert(w->inbox.end(), buffer, buffer + n);
+      if (!read_messages(&c, w)) {
+        fprintf(stderr, "Warning: Bad message from worker\n");
+        drop_worker(&c, w);
+      }
+    }
+
+    std::vector<worker_conn> live;
+    for (worker_conn &w : c.workers)
+      if (!w.dead) live.push_back(std::move(w));
+    c.workers.swap(live);
+
+    for (worker_conn &w : c.workers)
+      assign_tiles(&c, &w);
+    write_bands(&c, stream);
+  }
+
+  for (worker_conn &w : c.workers) {
+    send_message(w.fd, msg_done, nullptr, 0);
+    close(w.fd);
+  }
+  socket_unlisten(listen_fd, address);
+
+  if (stats != nullptr) *stats = c.stats;
+  if (dstats != nullptr) *dstats = c.dstats;
+  return true;
+}
+
+
+
+/* Worker */
+
+static bool receive_message(int fd, message_header *header,
+                            std::vector<char> *payload) {
+  if (!recv_all(fd, header, sizeof(*header))) return false;
+  payload->resize(header->size);
+  return recv_all(fd, payload->data(), header->size);
+}
+
+int worker_run(const std::string &address, const setup_function &setup) {
+  // The coordinator may still be starting up
+  int fd = -1;
+  for (int attempt = 0; attempt < 100 && fd < 0; attempt++) {
+    fd = socket_connect(address);
+    if (fd < 0)
+      std::this_thread::sleep_for(std::chrono::milliseconds(100));
+  }
+  if (fd < 0) {
+    fprintf(stderr, "Error: Failed to connect to %s\n", address.c_str());
+    return 1;
+  }
+
+  message_header header;
+  std::vector<char> payload;
+  if (!receive_message(fd, &header, &payload) || header.type != msg_args) {
+    fprintf(stderr, "Error: No arguments from coordinator\n");
+    close(fd);
+    return 1;
+  }
+
+  std::vector<std::string> args;
+  for (size_t start = 0; start < payload.size(); ) {
+    std::string arg = &payload[start];
+    start += arg.size() + 1;
+    args.push_back(arg);
+  }
+
+  worker_setup ws;
+  if (!setup(args, &ws)) {
+    close(fd);
+    return 1;
+  }
+
+  thread_pool *pool = thread_pool_create(ws.options.num_threads);
+  render_job job;
+  job.width = ws.width;
+  job.height = ws.height;
+  job.stride = 0;
+  job.options = ws.options;
+  job.options.pool = pool;
+
+  // Every tile is of the same frame, so they share one set of bins
+  raster_bins *raster = nullptr;
+  if (job.options.raster_primary) {
+    raster = raster_create(ws.s, ws.s->camera, ws.width, ws.height);
+    job.options.raster = raster;
+    job.options.raster_primary = raster != nullptr;
+  }
+
+  std::vector<float> pixels;
+  bool ok = send_message(fd, msg_ready, nullptr, 0);
+
+  while (ok && receive_message(fd, &header, &payload) &&
+         header.type == msg_tile && payload.size() == sizeof(tile_message)) {
+    tile_message msg;
+    memcpy(&msg, payload.data(), sizeof(msg));
+    job.region = { msg.x0, msg.y0, msg.x1, msg.y1 };
+    pixels.resize(3 * (msg.x1 - msg.x0) * (msg.y1 - msg.y0));
+    job.pixels = pixels.data();
+
+    render_stats stats = { 0, 0, 0, 0 };
+    render_job_run(ws.s, job, &stats);
+
+    result_header result = { msg.id, 0, stats.samples };
+    ok = send_message(fd, msg_result, &result, sizeof(result),
+                      pixels.data(), pixels.size() * sizeof(float));
+  }
+
+  close(fd);
+  raster_destroy(raster);
+  thread_pool_destroy(pool);
+  scene_destroy(ws.s);
+  return 0;
+}
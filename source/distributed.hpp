@@ -0,0 +1,51 @@
+#ifndef _RAYTRACER_DISTRIBUTED_HPP
+#define _RAYTRACER_DISTRIBUTED_HPP
+
+
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "image.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+
+
+/* Distributed rendering. Workers connect to a coordinator, which sends them
+ * its command line arguments so that they all load the same scene with the
+ * same options, and then hands out tiles of the frame. A tile held by a
+ * worker that disconnects goes back into the queue, and once every tile
+ * has been handed out, idle workers get copies of the tiles still being
+ * rendered, so a slow worker cannot hold up the frame */
+
+struct worker_setup {
+  scene *s;
+  size_t width, height;
+  render_options options;
+};
+
+// Turns the coordinator's arguments into a setup, or returns false
+typedef std::function<bool(const std::vector<std::string> &args,
+                           worker_setup *)> setup_function;
+
+struct distributed_stats {
+  size_t workers;     // Connections over the whole render
+  size_t tiles;
+  size_t reissued;    // Tiles handed out more than once
+};
+
+
+// Renders a region of the frame described by args on the workers that
+// connect to address and writes it to stream. Returns false if the address
+// cannot be used
+bool coordinator_run(const std::string &address,
+                     const std::vector<std::string> &args, render_region,
+                     image_ostream *stream, render_stats *stats = nullptr,
+                     distributed_stats *dstats = nullptr);
+
+// Renders tiles for the coordinator at address until it is done. Returns
+// the process exit status
+int worker_run(const std::string &address, const setup_function &setup);
+
+
+#endif
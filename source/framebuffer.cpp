@@ -0,0 +1,79 @@
+#include <cmath>
+#include <vector>
+
+#include "common.hpp"
+#include "framebuffer.hpp"
+#include "image.hpp"
+
+
+rtfloat luminance(color3f c) {
+  return 0.2126*c.r + 0.7152*c.g + 0.0722*c.b;
+}
+
+
+
+accum_buffer *accum_create(size_t width, size_t height) {
+  accum_buffer *accum = new accum_buffer;
+  accum->width = width;
+  accum->height = height;
+  accum->sum.assign(3 * width * height, 0);
+  accum->lum_sq.assign(width * height, 0);
+  accum->count.assign(width * height, 0);
+  return accum;
+}
+
+void accum_destroy(accum_buffer *accum) {
+  delete accum;
+}
+
+
+void accum_add(accum_buffer *accum, size_t x, size_t y, color3f sample) {
+  size_t i = y * accum->width + x;
+  rtfloat lum = luminance(sample);
+  accum->sum[3*i + 0] += (float) sample.r;
+  accum->sum[3*i + 1] += (float) sample.g;
+  accum->sum[3*i + 2] += (float) sample.b;
+  accum->lum_sq[i] += (float) (lum * lum);
+  accum->count[i] += 1;
+}
+
+
+color3f accum_mean(const accum_buffer *accum, size_t x, size_t y) {
+  size_t i = y * accum->width + x;
+  if (accum->count[i] == 0) return {0, 0, 0};
+  color3f sum = { accum->sum[3*i], accum->sum[3*i + 1], accum->sum[3*i + 2] };
+  return sum / accum->count[i];
+}
+
+rtfloat accum_error(const accum_buffer *accum, size_t x, size_t y) {
+  size_t i = y * accum->width + x;
+  size_t n = accum->count[i];
+  if (n < 2) return rtfloat_inf;
+
+  rtfloat mean = luminance(accum_mean(accum, x, y));
+  rtfloat var = (accum->lum_sq[i] - n * mean * mean) / (n - 1);
+  return std::sqrt(std::max(var, (rtfloat) 0) / n);
+}
+
+rtfloat accum_noise(const accum_buffer *accum) {
+  rtfloat total = 0;
+  for (size_t y = 0; y < accum->height; y++) {
+    for (size_t x = 0; x < accum->width; x++) {
+      rtfloat err = accum_error(accum, x, y);
+      total += err * err;
+    }
+  }
+  return std::sqrt(total / (accum->width * accum->height));
+}
+
+size_t accum_memory(const accum_buffer *accum) {
+  return sizeof(accum_buffer) + accum->sum.capacity() * sizeof(float) +
+         accum->lum_sq.capacity() * sizeof(float) +
+         accum->count.capacity() * sizeof(uint32_t);
+}
+
+
+void write_accum(const accum_buffer *accum, image_ostream *stream) {
+  while (!done(stream))
+    stream << accum_mean(accum, stream->cur_col, stream->cur_row);
+}
@@ -0,0 +1,39 @@
+#ifndef _RAYTRACER_FRAMEBUFFER_HPP
+#define _RAYTRACER_FRAMEBUFFER_HPP
+
+
+#include <cstdint>
+#include <vector>
+
+#include "common.hpp"
+#include "image.hpp"
+
+
+/* Float accumulation buffer. Keeps running sums per pixel so samples can be
+ * added over several passes and the image resolved at any point */
+
+struct accum_buffer {
+  size_t width, height;
+  std::vector<float> sum;       // RGB sums, row major from the top row
+  std::vector<float> lum_sq;    // Sums of squared luminance
+  std::vector<uint32_t> count;
+};
+
+accum_buffer *accum_create(size_t width, size_t height);
+void accum_destroy(accum_buffer *);
+
+void accum_add(accum_buffer *, size_t x, size_t y, color3f sample);
+
+color3f accum_mean(const accum_buffer *, size_t x, size_t y);
+rtfloat accum_error(const accum_buffer *, size_t x, size_t y);
+rtfloat accum_noise(const accum_buffer *);  // RMS of per-pixel error
+
+size_t accum_memory(const accum_buffer *);   // Bytes
+
+void write_accum(const accum_buffer *, image_ostream *);
+
+
+rtfloat luminance(color3f);
+
+
+#endif
@@ -1,7 +1,54 @@
+#include <cstdint>
 #include <cstdio>
+#include <cstring>
+#include <memory>
+#include <string>
+#include <vector>
+
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
 
 #include "common.hpp"
 #include "image.hpp"
+#include "tonemap.hpp"
+
+
+image_format image_format_for(const std::string &filename) {
+  size_t dot = filename.find_last_of('.');
+  image_format format = image_format::ppm;
+  if (dot != std::string::npos)
+    parse_image_format(filename.substr(dot + 1), &format);
+  return format;
+}
+
+bool parse_image_format(std::string name, image_format *format) {
+  if (name == "ppm") *format = image_format::ppm;
+  else if (name == "pfm") *format = image_format::pfm;
+  else if (name == "raw") *format = image_format::raw;
+  else return false;
+  return true;
+}
+
+
+static bool little_endian() {
+  uint16_t x = 1;
+  return *(unsigned char *) &x == 1;
+}
+
+// The scale's sign gives the byte order of the pixels
+static std::string pfm_header(size_t width, size_t height) {
+  return stringf("PF\n%zu %zu\n%s\n", width, height,
+                 little_endian() ? "-1.0" : "1.0");
+}
+
+static void to_floats(color3f color, float *rgb) {
+  rgb[0] = (float) color.r;
+  rgb[1] = (float) color.g;
+  rgb[2] = (float) color.b;
+}
+
 
 
 bool done(image_ostream *stream) {
@@ -13,6 +60,8 @@ void operator<<(image_ostream *stream, color3f pixel) {
 }
 
 void close(image_ostream *stream) {
+  if (stream->finish)
+    stream->finish(stream);
   delete stream;
 }
 
@@ -41,7 +90,8 @@ image_ostream *open_buffer_stream(color3f *buffer, size_t width,
 }
 
 
-image_ostream *open_ppm_stream(FILE *file, size_t width, size_t height) {
+image_ostream *open_ppm_stream(FILE *file, size_t width, size_t height,
+                               const tonemap_options &tm) {
   fprintf(file, "P6 %zu %zu 255\n", width, height);
   fflush(file);
 
@@ -49,17 +99,194 @@ image_ostream *open_ppm_stream(FILE *file, size_t width, size_t height) {
   stream->width = width;
   stream->height = height;
 
-  stream->write_pixel = [file](image_ostream *stream, color3f color) {
+  stream->write_pixel = [file, tm](image_ostream *stream, color3f color) {
     if (done(stream)) return;
-    int r = clamp((int) (color.r * 255), 0, 255);
-    int g = clamp((int) (color.g * 255), 0, 255);
-    int b = clamp((int) (color.b * 255), 0, 255);
-    fputc(r, file);
-    fputc(g, file);
-    fputc(b, file);
+    unsigned char rgb[3];
+    quantize(tonemap(color, tm), stream->cur_col, stream->cur_row, tm, rgb);
+    fwrite(rgb, 1, 3, file);
+    next(stream);
+    if (stream->cur_col == 0)
+      fflush(file);
+  };
+
+  return stream;
+}
+
+image_ostream *open_pfm_stream(FILE *file, size_t width, size_t height) {
+  image_ostream *stream = new image_ostream;
+  stream->width = width;
+  stream->height = height;
+
+  auto image = std::make_shared<std::vector<float>>(3 * width * height);
+
+  stream->write_pixel = [image](image_ostream *stream, color3f color) {
+    if (done(stream)) return;
+    size_t row = stream->height - 1 - stream->cur_row;
+    to_floats(color, &(*image)[3 * (row * stream->width + stream->cur_col)]);
+    next(stream);
+  };
+
+  stream->finish = [file, image](image_ostream *stream) {
+    std::string header = pfm_header(stream->width, stream->height);
+    fwrite(header.data(), 1, header.size(), file);
+    fwrite(image->data(), sizeof(float), image->size(), file);
     fflush(file);
+  };
+
+  return stream;
+}
+
+image_ostream *open_raw_stream(FILE *file, size_t width, size_t height) {
+  image_ostream *stream = new image_ostream;
+  stream->width = width;
+  stream->height = height;
+
+  stream->write_pixel = [file](image_ostream *stream, color3f color) {
+    if (done(stream)) return;
+    float rgb[3];
+    to_floats(color, rgb);
+    fwrite(rgb, sizeof(float), 3, file);
     next(stream);
+    if (stream->cur_col == 0)
+      fflush(file);
   };
 
   return stream;
 }
+
+image_ostream *open_image_stream(FILE *file, size_t width, size_t height,
+                                 image_format format,
+                                 const tonemap_options &tm) {
+  switch (format) {
+  case image_format::ppm: return open_ppm_stream(file, width, height, tm);
+  case image_format::pfm: return open_pfm_stream(file, width, height);
+  case image_format::raw: return open_raw_stream(file, width, height);
+  }
+  return nullptr;
+}
+
+
+
+struct image_file {
+  int fd;
+  unsigned char *data;
+  size_t size;
+  size_t header_size;
+  size_t width, height;
+  image_format format;
+  tonemap_options tm;
+};
+
+image_file *open_image_file(const std::string &filename, size_t width,
+                            size_t height, image_format format,
+                            const tonemap_options &tm) {
+  int fd = open(filename.c_str(), O_RDWR | O_CREAT, 0666);
+  if (fd < 0) return nullptr;
+
+  std::string header;
+  size_t pixel_size = 3 * sizeof(float);
+  if (format == image_format::ppm) {
+    header = stringf("P6 %zu %zu 255\n", width, height);
+    pixel_size = 3;
+  } else if (format == image_format::pfm) {
+    header = pfm_header(width, height);
+  }
+
+  /* The blocks are allocated up front, since running out of disk while
+   * writing through the mapping would raise SIGBUS */
+  struct stat st;
+  size_t size = header.size() + pixel_size * width * height;
+  if (size == 0 || fstat(fd, &st) != 0 || !S_ISREG(st.st_mode) ||
+      ftruncate(fd, 0) != 0) {
+    close(fd);
+    return nullptr;
+  }
+  if (posix_fallocate(fd, 0, (off_t) size) != 0) {
+    // Leave the file empty for the caller to write another way
+    if (ftruncate(fd, 0) != 0)
+      fprintf(stderr, "Warning: Failed to empty %s\n", filename.c_str());
+    close(fd);
+    return nullptr;
+  }
+
+  void *data = mmap(nullptr, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+  if (data == MAP_FAILED) {
+    close(fd);
+    return nullptr;
+  }
+
+  image_file *file = new image_file;
+  file->fd = fd;
+  file->data = (unsigned char *) data;
+  file->size = size;
+  file->header_size = header.size();
+  file->width = width;
+  file->height = height;
+  file->format = format;
+  file->tm = tm;
+  header.copy((char *) file->data, header.size());
+  return file;
+}
+
+void write_pixels(image_file *file, size_t x, size_t y, size_t count,
+                  const color3f *pixels) {
+  unsigned char *start = file->data + file->header_size;
+
+  if (file->format == image_format::ppm) {
+    unsigned char *out = start + 3 * (y * file->width + x);
+    for (size_t i = 0; i < count; i++)
+      quantize(tonemap(pixels[i], file->tm), x + i, y, file->tm, out + 3*i);
+    return;
+  }
+
+  size_t row = file->format == image_format::pfm ? file->height - 1 - y : y;
+  unsigned char *out = start + 3 * sizeof(float) * (row * file->width + x);
+  for (size_t i = 0; i < count; i++) {
+    float rgb[3];
+    to_floats(pixels[i], rgb);
+    memcpy(out + sizeof(rgb) * i, rgb, sizeof(rgb));
+  }
+}
+
+bool close(image_file *file) {
+  bool ok = msync(file->data, file->size, MS_SYNC) == 0;
+  ok = munmap(file->data, file->size) == 0 && ok;
+  ok = close(file->fd) == 0 && ok;
+  delete file;
+  return ok;
+}
+
+
+
+bool read_pfm(const std::string &filename, size_t *width, size_t *height,
+              std::vector<float> *pixels) {
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (file == nullptr) return false;
+
+  char type[3] = {0};
+  double scale;
+  bool ok = fscanf(file, "%2s %zu %zu %lf", type, width, height, &scale) == 4
+            && std::string(type) == "PF" && scale != 0 && fgetc(file) != EOF;
+
+  size_t floats = 3 * *width * *height;
+  std::vector<float> data(ok ? floats : 0);
+  ok = ok && fread(data.data(), sizeof(float), floats, file) == floats;
+  fclose(file);
+  if (!ok) return false;
+
+  // Swap bytes if the file's order is not ours
+  if ((scale < 0) != little_endian()) {
+    for (float &f : data) {
+      unsigned char *b = (unsigned char *) &f;
+      std::swap(b[0], b[3]);
+      std::swap(b[1], b[2]);
+    }
+  }
+
+  size_t row_floats = 3 * *width;
+  pixels->resize(floats);
+  for (size_t y = 0; y < *height; y++)
+    memcpy(&(*pixels)[y * row_floats],
+           &data[(*height - 1 - y) * row_floats], row_floats * sizeof(float));
+  return true;
+}
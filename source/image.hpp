@@ -2,9 +2,25 @@
 #define _RAYTRACER_IMAGE_HPP
 
 
+#include <cstdio>
 #include <functional>
+#include <string>
+#include <vector>
 
 #include "common.hpp"
+#include "tonemap.hpp"
+
+
+
+enum class image_format {
+  ppm,    // 8-bit binary PPM, after the display transform
+  pfm,    // Portable float map, 32-bit RGB radiance as rendered
+  raw,    // 32-bit RGB radiance in rows from the top, with no header
+};
+
+// By file extension, PPM for anything unrecognized
+image_format image_format_for(const std::string &filename);
+bool parse_image_format(std::string name, image_format *format);
 
 
 
@@ -12,6 +28,7 @@ struct image_ostream {
   size_t width, height;
   size_t cur_row = 0, cur_col = 0;
   std::function<void(image_ostream *, color3f)> write_pixel;
+  std::function<void(image_ostream *)> finish;  // Called by close, if set
 };
 
 bool done(image_ostream *stream);
@@ -22,7 +39,43 @@ void close(image_ostream *stream);
 
 image_ostream *open_buffer_stream(color3f *buffer, size_t width, size_t height);
 
-image_ostream *open_ppm_stream(FILE *file, size_t width, size_t height);
+image_ostream *open_ppm_stream(FILE *file, size_t width, size_t height,
+                               const tonemap_options & = tonemap_options());
+// PFM rows run from the bottom up, so the image is kept until close
+image_ostream *open_pfm_stream(FILE *file, size_t width, size_t height);
+image_ostream *open_raw_stream(FILE *file, size_t width, size_t height);
+
+image_ostream *open_image_stream(FILE *file, size_t width, size_t height,
+                                 image_format,
+                                 const tonemap_options & = tonemap_options());
+
+
+
+/* Image file written in place. The file is sized for the whole image and
+ * mapped into memory when it is opened, so pixels can be written in any
+ * order, from several threads at once, without holding the image in
+ * memory. Unwritten pixels are black */
+
+struct image_file;
+
+// Returns null if filename cannot be opened or mapped, as for a pipe, or
+// if there is no room on the disk for the whole image
+image_file *open_image_file(const std::string &filename, size_t width,
+                            size_t height, image_format,
+                            const tonemap_options & = tonemap_options());
+
+// Writes count pixels starting at (x, y), all in row y
+void write_pixels(image_file *, size_t x, size_t y, size_t count,
+                  const color3f *pixels);
+
+// Returns false if the image could not be written out
+bool close(image_file *);
+
+
+
+// Reads RGB radiance from a PFM file, in rows from the top
+bool read_pfm(const std::string &filename, size_t *width, size_t *height,
+              std::vector<float> *pixels);
 
 
 
@@ -0,0 +1,194 @@
+#include <algorithm>
+#include <cmath>
+#include <vector>
+
+#include "common.hpp"
+#include "light_tree.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "timeline.hpp"
+
+
+struct light_tree_node {
+  aa_box3f bounding_box;
+  rtfloat power[3];       // Brightest channel, summed per falloff exponent
+  int children[2];        // -1 for leaves
+  const light_source *light;
+};
+
+struct light_tree {
+  std::vector<light_tree_node> nodes;   // nodes[0] is the root
+};
+
+
+static int build(light_tree *tree, std::vector<const light_source *> &lights,
+                 size_t begin, size_t end) {
+  int index = (int) tree->nodes.size();
+  tree->nodes.push_back(light_tree_node());
+
+  light_tree_node node;
+  node.bounding_box = {
+    rtfloat_inf, rtfloat_inf, rtfloat_inf,
+    -rtfloat_inf, -rtfloat_inf, -rtfloat_inf
+  };
+  node.power[0] = node.power[1] = node.power[2] = 0;
+  node.children[0] = node.children[1] = -1;
+  node.light = nullptr;
+
+  for (size_t i = begin; i < end; i++) {
+    const light_source *light = lights[i];
+    expand(&node.bounding_box, { light->pos, light->pos });
+    node.power[light->falloff] += std::max(light->color.r,
+                                  std::max(light->color.g, light->color.b));
+  }
+
+  if (end - begin == 1) {
+    node.light = lights[begin];
+
+  } else {
+    /* Split at the median of the longest axis */
+    aa_box3f box = node.bounding_box;
+    int axis = 0;
+    for (int a = 1; a < 3; a++) {
+      if (box.high_v.data[a] - box.low_v.data[a] >
+          box.high_v.data[axis] - box.low_v.data[axis])
+        axis = a;
+    }
+
+    size_t mid = (begin + end) / 2;
+    std::nth_element(lights.begin() + begin, lights.begin() + mid,
+                     lights.begin() + end,
+                     [axis](const light_source *a, const light_source *b) {
+                       return a->pos.data[axis] < b->pos.data[axis];
+                     });
+
+    node.children[0] = build(tree, lights, begin, mid);
+    node.children[1] = build(tree, lights, mid, end);
+  }
+
+  tree->nodes[index] = node;
+  return index;
+}
+
+
+light_tree *light_tree_create(const std::vector<light_source> &lights) {
+  timeline_scope scope("build light tree", "build");
+  std::vector<const light_source *> points;
+  for (const light_source &light : lights)
+    if (light.type == light_type::point)
+      points.push_back(&light);
+
+  light_tree *tree = new light_tree;
+  if (!points.empty())
+    build(tree, points, 0, points.size());
+  return tree;
+}
+
+void light_tree_destroy(light_tree *tree) {
+  delete tree;
+}
+
+size_t light_tree_memory(const light_tree *tree) {
+  if (tree == nullptr) return 0;
+  return sizeof(light_tree) +
+         tree->nodes.capacity() * sizeof(light_tree_node);
+}
+
+
+
+static inline rtfloat falloff_power(const light_tree_node &node, rtfloat d) {
+  return node.power[0] + node.power[1] / d + node.power[2] / (d * d);
+}
+
+// Upper bound on the light the node delivers to point
+static rtfloat node_bound(const light_tree_node &node, vec3f point) {
+  vec3f closest;
+  for (int k = 0; k < 3; k++)
+    closest.data[k] = clamp(point.data[k], node.bounding_box.low_v.data[k],
+                            node.bounding_box.high_v.data[k]);
+
+  rtfloat d = magnitude(closest - point);
+  if (d == 0) return rtfloat_inf;
+  return falloff_power(node, d);
+}
+
+// Estimate of the light the node delivers to point, used for sampling
+static rtfloat node_importance(const light_tree_node &node, vec3f point) {
+  const aa_box3f &box = node.bounding_box;
+  vec3f center = (box.low_v + box.high_v) / 2;
+  rtfloat radius = magnitude(box.high_v - box.low_v) / 2;
+
+  rtfloat d = std::max(magnitude(center - point), radius);
+  return falloff_power(node, std::max(d, (rtfloat) 1e-6));
+}
+
+
+// Chooses a light below node, returning the probability of the choice
+static const light_source *sample_node(const light_tree *tree, int index,
+                                       vec3f point, rng_state *rng,
+                                       rtfloat *prob) {
+  *prob = 1;
+
+  while (tree->nodes[index].light == nullptr) {
+    const light_tree_node &node = tree->nodes[index];
+    rtfloat i0 = node_importance(tree->nodes[node.children[0]], point);
+    rtfloat i1 = node_importance(tree->nodes[node.children[1]], point);
+
+    rtfloat p0 = i0 + i1 > 0 ? i0 / (i0 + i1) : 0.5;
+    if (rng_float(rng) < p0) {
+      index = node.children[0];
+      *prob *= p0;
+    } else {
+      index = node.children[1];
+      *prob *= 1 - p0;
+    }
+  }
+
+  return tree->nodes[index].light;
+}
+
+
+void select_lights(const light_tree *tree, vec3f point, rtfloat scale,
+                   rtfloat cutoff, size_t max_lights, rng_state *rng,
+                   std::vector<light_sample> *samples) {
+  samples->clear();
+  if (tree->nodes.empty() || max_lights == 0) return;
+
+  /* Find a cut through the tree by repeatedly splitting the node with the
+   * largest bound, dropping nodes that can't contribute */
+  struct cut_node {
+    int index;
+    rtfloat bound;
+  };
+  std::vector<cut_node> cut;
+
+  rtfloat root_bound = node_bound(tree->nodes[0], point);
+  if (root_bound * scale >= cutoff)
+    cut.push_back({0, root_bound});
+
+  while (cut.size() < max_lights) {
+    size_t best = cut.size();
+    for (size_t i = 0; i < cut.size(); i++) {
+      if (tree->nodes[cut[i].index].light != nullptr) continue;
+      if (best == cut.size() || cut[i].bound > cut[best].bound)
+        best = i;
+    }
+    if (best == cut.size()) break;
+
+    const light_tree_node &node = tree->nodes[cut[best].index];
+    cut.erase(cut.begin() + best);
+
+    for (int k = 0; k < 2; k++) {
+      rtfloat bound = node_bound(tree->nodes[node.children[k]], point);
+      if (bound * scale >= cutoff)
+        cut.push_back({node.children[k], bound});
+    }
+  }
+
+  /* Leaves are exact, larger clusters are represented by one light */
+  for (cut_node &c : cut) {
+    rtfloat prob = 1;
+    const light_source *light = sample_node(tree, c.index, point, rng, &prob);
+    samples->push_back({light, 1 / prob});
+  }
+}
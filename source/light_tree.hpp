@@ -0,0 +1,38 @@
+#ifndef _RAYTRACER_LIGHT_TREE_HPP
+#define _RAYTRACER_LIGHT_TREE_HPP
+
+
+#include <vector>
+
+#include "common.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+
+
+/* Bounding volume hierarchy over the point lights of a scene. Each node
+ * stores the total power of the lights below it for each falloff, which
+ * bounds how much light the node can deliver to a point */
+
+struct light_tree;
+
+light_tree *light_tree_create(const std::vector<light_source> &lights);
+void light_tree_destroy(light_tree *);
+
+size_t light_tree_memory(const light_tree *);   // Bytes, 0 for null
+
+
+struct light_sample {
+  const light_source *light;
+  rtfloat weight;   // 1 / probability of picking the light
+};
+
+// Picks at most max_lights point lights to shade a point with. Lights
+// close to the point are evaluated exactly, clusters further away are
+// represented by one light chosen by importance. Lights that can deliver
+// less than cutoff (with scale applied) are skipped
+void select_lights(const light_tree *, vec3f point, rtfloat scale,
+                   rtfloat cutoff, size_t max_lights, rng_state *rng,
+                   std::vector<light_sample> *samples);
+
+
+#endif
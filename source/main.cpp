@@ -1,23 +1,119 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
 #include <cstdio>
 #include <string>
+#include <thread>
+#include <vector>
 
+#include "batch.hpp"
 #include "common.hpp"
+#include "distributed.hpp"
 #include "image.hpp"
+#include "object_structure.hpp"
+#include "output.hpp"
+#include "profile.hpp"
+#include "raytracer.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
 #include "scene.hpp"
-#include "shapes.hpp"
+#include "server.hpp"
+#include "stats.hpp"
+#include "timeline.hpp"
+#include "tonemap.hpp"
 
 
 static std::string in_filename = "<stdin>";
 static FILE *in_file = stdin;
 static FILE *out_file = stdout;
+static std::string out_filename;
+static image_format out_format = image_format::ppm;
+static bool format_set = false;
+static tonemap_options tonemap_opts;
+static std::string postprocess_path;
+static std::vector<std::string> aov_names;
+static bool denoising = false;
+static std::string heatmap_path;
+static std::string report_path;
+static std::string timeline_path;
+static std::string estimate_path;
+static size_t estimate_pixels = 4096;
+static double deadline = 0;
+static std::string batch_path;
 static size_t img_width = 700, img_height = 700;
-static int sample_freq = 0;
-static int obj_struct = 0;
+static render_region region;
+static bool region_set = false;
+static load_options load;
+static render_options options;
+static bool print_stats = false;
+static bool sampler_set = false;
+static std::string serve_path;
+static std::string coordinate_address;
+static std::string worker_address;
+static bool checkpointing = false;
+static rtfloat checkpoint_interval = 60;
+static bool resume = false;
+
+// Set once an output file fails to be written, for the exit status
+static bool write_failed = false;
+
+// Arguments that describe the render, for distributed workers
+static std::vector<std::string> job_args;
+
+
+static long int int_argument(int argc, char *argv[], int *i,
+                             const char *flag, long int min) {
+  if (*i + 1 >= argc) {
+    fprintf(stderr, "Error: Expected number after %s flag\n", flag);
+    exit(1);
+  }
+  std::string arg = argv[++*i];
+
+  const char *endptr = arg.c_str();
+  long int n = strtol(arg.c_str(), (char **) &endptr, 10);
+  if (endptr != arg.c_str() + arg.size() || arg.empty() || n < min) {
+    fprintf(stderr, "Error: Invalid argument to %s\n", flag);
+    exit(1);
+  }
+  return n;
+}
+
+static double float_argument(int argc, char *argv[], int *i,
+                             const char *flag, double min) {
+  if (*i + 1 >= argc) {
+    fprintf(stderr, "Error: Expected number after %s flag\n", flag);
+    exit(1);
+  }
+  std::string arg = argv[++*i];
+
+  const char *endptr = arg.c_str();
+  double x = strtod(arg.c_str(), (char **) &endptr);
+  if (endptr != arg.c_str() + arg.size() || arg.empty() || !(x >= min)) {
+    fprintf(stderr, "Error: Invalid argument to %s\n", flag);
+    exit(1);
+  }
+  return x;
+}
+
 
+// Flags that only matter to this process
+static bool local_flag(const std::string &arg) {
+  return arg == "--output" || arg == "-o" || arg == "--threads" ||
+         arg == "-j" || arg == "--stats" || arg == "--serve" ||
+         arg == "--coordinate" || arg == "--worker" ||
+         arg == "--checkpoint" || arg == "--resume" || arg == "--format" ||
+         arg == "--exposure" || arg == "--gamma" || arg == "--tonemap" ||
+         arg == "--dither" || arg == "--postprocess" || arg == "--aov" ||
+         arg == "--denoise" || arg == "--heatmap" || arg == "--report" ||
+         arg == "--timeline" || arg == "--estimate" ||
+         arg == "--estimate-pixels" || arg == "--deadline" ||
+         arg == "--batch";
+}
 
 static void read_arguments(int argc, char *argv[]) {
   for (int i = 1; i < argc; i++) {
     std::string arg = argv[i];
+    int first = i;
 
     if (arg == "--size" || arg == "-s") {
       if (i + 2 >= argc) {
@@ -50,13 +146,155 @@ static void read_arguments(int argc, char *argv[]) {
         fprintf(stderr, "Error: Expected filename after --output flag\n");
         exit(1);
       }
-      std::string filename = argv[++i];
+      out_filename = argv[++i];
 
-      out_file = fopen(filename.c_str(), "w");
+      out_file = fopen(out_filename.c_str(), "w");
       if (out_file == nullptr) {
-        fprintf(stderr, "Error: Failed to open %s\n", filename.c_str());
+        fprintf(stderr, "Error: Failed to open %s\n", out_filename.c_str());
+        exit(1);
+      }
+
+
+    } else if (arg == "--format") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected format after --format flag\n");
+        exit(1);
+      }
+      format_set = true;
+      if (!parse_image_format(argv[++i], &out_format)) {
+        fprintf(stderr, "Error: Invalid format. Valid formats are 'ppm', "
+                        "'pfm' and 'raw'\n");
+        exit(1);
+      }
+
+
+    } else if (arg == "--exposure") {
+      tonemap_opts.exposure = (rtfloat) float_argument(argc, argv, &i,
+                                                       "--exposure",
+                                                       -HUGE_VAL);
+
+
+    } else if (arg == "--gamma") {
+      tonemap_opts.gamma = (rtfloat) float_argument(argc, argv, &i,
+                                                    "--gamma", 0.01);
+
+
+    } else if (arg == "--tonemap") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected operator after --tonemap flag\n");
+        exit(1);
+      }
+      if (!parse_tonemap_operator(argv[++i], &tonemap_opts.op)) {
+        fprintf(stderr, "Error: Invalid tonemap operator. Valid operators "
+                        "are 'clamp', 'reinhard' and 'aces'\n");
+        exit(1);
+      }
+
+
+    } else if (arg == "--dither") {
+      tonemap_opts.dither = true;
+
+
+    } else if (arg == "--postprocess") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected filename after --postprocess "
+                        "flag\n");
+        exit(1);
+      }
+      postprocess_path = argv[++i];
+
+
+    } else if (arg == "--aov") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected AOV names after --aov flag\n");
+        exit(1);
+      }
+      std::string names = argv[++i];
+      size_t start = 0;
+      while (start <= names.size()) {
+        size_t end = std::min(names.find(',', start), names.size());
+        std::string name = names.substr(start, end - start);
+        if (!valid_aov_name(name)) {
+          fprintf(stderr, "Error: Invalid AOV '%s'. Valid AOVs are 'depth', "
+                          "'normal', 'object', 'albedo' and 'cost'\n",
+                  name.c_str());
+          exit(1);
+        }
+        aov_names.push_back(name);
+        start = end + 1;
+      }
+
+
+    } else if (arg == "--denoise") {
+      denoising = true;
+
+
+    } else if (arg == "--heatmap") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected filename after --heatmap flag\n");
+        exit(1);
+      }
+      heatmap_path = argv[++i];
+
+
+    } else if (arg == "--report") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected filename after --report flag\n");
+        exit(1);
+      }
+      report_path = argv[++i];
+
+
+    } else if (arg == "--timeline") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected filename after --timeline flag\n");
+        exit(1);
+      }
+      timeline_path = argv[++i];
+
+
+    } else if (arg == "--estimate") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected filename after --estimate flag\n");
+        exit(1);
+      }
+      estimate_path = argv[++i];
+
+
+    } else if (arg == "--estimate-pixels") {
+      estimate_pixels = (size_t) int_argument(argc, argv, &i,
+                                              "--estimate-pixels", 1);
+
+
+    } else if (arg == "--deadline") {
+      deadline = float_argument(argc, argv, &i, "--deadline", 0);
+
+
+    } else if (arg == "--batch") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected filename after --batch flag\n");
         exit(1);
       }
+      batch_path = argv[++i];
+
+
+    } else if (arg == "--region") {
+      region.x0 = (size_t) int_argument(argc, argv, &i, "--region", 0);
+      region.y0 = (size_t) int_argument(argc, argv, &i, "--region", 0);
+      region.x1 = (size_t) int_argument(argc, argv, &i, "--region", 0);
+      region.y1 = (size_t) int_argument(argc, argv, &i, "--region", 0);
+      region_set = true;
+
+
+    } else if (arg == "--checkpoint") {
+      checkpointing = true;
+      checkpoint_interval = (rtfloat) float_argument(argc, argv, &i,
+                                                     "--checkpoint", 0);
+
+
+    } else if (arg == "--resume") {
+      checkpointing = true;
+      resume = true;
 
 
     } else if (arg == "--freq" || arg == "-f") {
@@ -67,11 +305,152 @@ static void read_arguments(int argc, char *argv[]) {
       std::string fs = argv[++i];
 
       const char *endptr = fs.c_str();
-      sample_freq = (int) strtol(fs.c_str(), (char **) &endptr, 10);
+      int sample_freq = (int) strtol(fs.c_str(), (char **) &endptr, 10);
       if (endptr != fs.c_str() + fs.size() || sample_freq < 0) {
         fprintf(stderr, "Error: Invalid argument to --freq\n");
         exit(1);
       }
+      options.sample_freq = sample_freq;
+
+
+    } else if (arg == "--engine" || arg == "-E") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected engine type after "
+                        "--engine flag\n");
+        exit(1);
+      }
+      std::string type = argv[++i];
+
+      if (type == "recursive") options.engine = render_engine::recursive;
+      else if (type == "wavefront") options.engine = render_engine::wavefront;
+      else {
+        fprintf(stderr, "Error: Invalid engine type. Valid types are "
+                        "'recursive' and 'wavefront'\n");
+        exit(1);
+      }
+
+
+    } else if (arg == "--sort-rays") {
+      options.sort_rays = true;
+
+
+    } else if (arg == "--raster") {
+      options.raster_primary = true;
+
+
+    } else if (arg == "--samples" || arg == "-n") {
+      options.sample_count = (size_t) int_argument(argc, argv, &i,
+                                                   "--samples", 1);
+
+
+    } else if (arg == "--sampler") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected sampler type after "
+                        "--sampler flag\n");
+        exit(1);
+      }
+      std::string type = argv[++i];
+
+      sampler_set = true;
+      if (!parse_sampler_type(type, &options.sampler)) {
+        fprintf(stderr, "Error: Invalid sampler type. Valid types are "
+                        "'random', 'stratified', 'r2', 'sobol' and "
+                        "'bluenoise'\n");
+        exit(1);
+      }
+
+
+    } else if (arg == "--depth" || arg == "-d") {
+      options.max_depth = (int) int_argument(argc, argv, &i, "--depth", 0);
+
+
+    } else if (arg == "--min-weight") {
+      options.min_weight = (rtfloat) float_argument(argc, argv, &i,
+                                                    "--min-weight", 0);
+
+
+    } else if (arg == "--roulette") {
+      options.roulette = (rtfloat) float_argument(argc, argv, &i,
+                                                  "--roulette", 0);
+
+
+    } else if (arg == "--light-samples" || arg == "-l") {
+      options.light_samples = (size_t) int_argument(argc, argv, &i,
+                                                    "--light-samples", 0);
+
+
+    } else if (arg == "--light-cutoff") {
+      options.light_cutoff = (rtfloat) float_argument(argc, argv, &i,
+                                                      "--light-cutoff", 0);
+
+
+    } else if (arg == "--adaptive" || arg == "-a") {
+      options.adaptive = true;
+      options.adaptive_threshold = (rtfloat) float_argument(argc, argv, &i,
+                                                            "--adaptive", 0);
+
+
+    } else if (arg == "--min-samples") {
+      options.min_samples = (size_t) int_argument(argc, argv, &i,
+                                                  "--min-samples", 1);
+
+
+    } else if (arg == "--max-samples") {
+      options.max_samples = (size_t) int_argument(argc, argv, &i,
+                                                  "--max-samples", 1);
+
+
+    } else if (arg == "--progressive" || arg == "-p") {
+      options.progressive = true;
+
+
+    } else if (arg == "--time-budget") {
+      options.progressive = true;
+      options.time_budget = (rtfloat) float_argument(argc, argv, &i,
+                                                     "--time-budget", 0);
+
+
+    } else if (arg == "--target-noise") {
+      options.progressive = true;
+      options.target_noise = (rtfloat) float_argument(argc, argv, &i,
+                                                      "--target-noise", 0);
+
+
+    } else if (arg == "--stats") {
+      print_stats = true;
+
+
+    } else if (arg == "--seed") {
+      options.seed = (uint32_t) int_argument(argc, argv, &i, "--seed", 0);
+
+
+    } else if (arg == "--threads" || arg == "-j") {
+      options.num_threads = (size_t) int_argument(argc, argv, &i,
+                                                  "--threads", 0);
+
+
+    } else if (arg == "--serve") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected socket path after --serve flag\n");
+        exit(1);
+      }
+      serve_path = argv[++i];
+
+
+    } else if (arg == "--coordinate") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected address after --coordinate flag\n");
+        exit(1);
+      }
+      coordinate_address = argv[++i];
+
+
+    } else if (arg == "--worker") {
+      if (i + 1 >= argc) {
+        fprintf(stderr, "Error: Expected address after --worker flag\n");
+        exit(1);
+      }
+      worker_address = argv[++i];
 
 
     } else if (arg == "--structure" || arg == "-S") {
@@ -82,8 +461,10 @@ static void read_arguments(int argc, char *argv[]) {
       }
       std::string type = argv[++i];
 
-      if (type == "linear" || type == "l") obj_struct = 0;
-      else if (type == "bvh") obj_struct = 1;
+      if (type == "linear" || type == "l")
+        load.structure = structure_type::list;
+      else if (type == "bvh")
+        load.structure = structure_type::bvh;
       else {
         fprintf(stderr, "Error: Invalid structure type. Valid types are "
                         "'linear' and 'bvh'\n");
@@ -112,36 +493,382 @@ static void read_arguments(int argc, char *argv[]) {
         exit(1);
       }
     }
+
+    if (!local_flag(arg))
+      job_args.insert(job_args.end(), argv + first, argv + i + 1);
   }
 }
 
 
+// Fills in the options that depend on other options
+static void finish_options() {
+  if (options.max_samples < options.min_samples)
+    options.max_samples = options.min_samples;
+  if ((options.progressive || options.adaptive) && !sampler_set)
+    options.sampler = sampler_type::sobol;
+
+  load.light_tree = options.light_samples > 0;
+
+  if (!format_set)
+    out_format = image_format_for(out_filename);
+
+  if (!region_set) {
+    region = { 0, 0, img_width, img_height };
+  } else if (region.x0 >= region.x1 || region.y0 >= region.y1 ||
+             region.x1 > img_width || region.y1 > img_height) {
+    fprintf(stderr, "Error: Region must be nonempty and inside the "
+                    "image\n");
+    exit(1);
+  }
+}
+
+
+// Sets up a distributed worker from the coordinator's arguments
+static bool worker_setup_args(const std::vector<std::string> &args,
+                              worker_setup *ws) {
+  std::vector<char *> argv = { (char *) "as2" };
+  for (const std::string &arg : args)
+    argv.push_back((char *) arg.c_str());
+  read_arguments((int) argv.size(), argv.data());
+  finish_options();
+
+  if (in_file == stdin) {
+    fprintf(stderr, "Error: No scene file from coordinator\n");
+    return false;
+  }
+  ws->s = scene_load(in_file, in_filename, load);
+  fclose(in_file);
+  ws->width = img_width;
+  ws->height = img_height;
+  ws->options = options;
+  return ws->s != nullptr;
+}
+
+
+// Also reports output that failed on its way to stdout
+static void close_output() {
+  bool ok = !ferror(out_file) && fflush(out_file) == 0;
+  if (out_file != stdout)
+    ok = fclose(out_file) == 0 && ok;
+  if (!ok) {
+    fprintf(stderr, "Error: Failed to write %s\n",
+            out_file == stdout ? "output" : out_filename.c_str());
+    write_failed = true;
+  }
+}
+
+
+static output_options output_settings() {
+  output_options out;
+  out.file = out_file;
+  out.filename = out_filename;
+  out.format = out_format;
+  out.tonemap = tonemap_opts;
+  out.aovs = aov_names;
+  out.heatmap = heatmap_path;
+  out.denoise = denoising;
+  out.checkpoint = checkpointing;
+  out.checkpoint_path = out_filename + ".ckpt";
+  out.checkpoint_interval = checkpoint_interval;
+  out.resume = resume;
+  return out;
+}
+
+
+static int run_coordinator() {
+  if (options.progressive) {
+    fprintf(stderr, "Error: Progressive rendering is not available "
+                    "with --coordinate\n");
+    return 1;
+  }
+  if (in_file == stdin) {
+    fprintf(stderr, "Error: --coordinate needs a scene file\n");
+    return 1;
+  }
+  if (checkpointing) {
+    fprintf(stderr, "Error: Checkpoints are not available with "
+                    "--coordinate\n");
+    return 1;
+  }
+  fclose(in_file);
+
+  render_stats stats;
+  distributed_stats dstats;
+  image_ostream *stream = open_image_stream(out_file, region.x1 - region.x0,
+                                           region.y1 - region.y0, out_format,
+                                           tonemap_opts);
+  bool ok = coordinator_run(coordinate_address, job_args, region, stream,
+                            &stats, &dstats);
+  close(stream);
+  close_output();
+  if (!ok || write_failed) return 1;
+
+  if (print_stats) {
+    print_render_stats(stderr, stats, false);
+    fprintf(stderr, "Workers: %zu\n", dstats.workers);
+    fprintf(stderr, "Tiles: %zu (%zu reissued)\n", dstats.tiles,
+            dstats.reissued);
+  }
+  return 0;
+}
+
+
+static size_t render_threads() {
+  if (options.num_threads > 0) return options.num_threads;
+  return std::max(std::thread::hardware_concurrency(), 1U);
+}
+
+
+/* Estimates the cost of the render instead of doing it, with the time
+ * setup took. Returns 2 if the slow end of the estimate misses the
+ * deadline */
+static int run_estimate(scene *s, double setup_seconds) {
+  cost_estimate e = estimate_render(s, img_width, img_height, region,
+                                    options, estimate_pixels);
+  e.scene_file = in_filename;
+  e.setup_seconds = setup_seconds;
+  e.memory = scene_memory(s);
+  e.memory.framebuffer = output_buffer_bytes(output_settings(), options,
+                                             region.x1 - region.x0,
+                                             region.y1 - region.y0,
+                                             render_threads());
+  e.peak_rss = peak_rss_bytes() + e.memory.framebuffer;
+
+  print_estimate(stderr, e, render_threads());
+  if (!write_estimate(estimate_path, e, render_threads())) {
+    fprintf(stderr, "Error: Failed to write %s\n", estimate_path.c_str());
+    return 1;
+  }
+
+  double slowest = estimate_wall_seconds(e, render_threads()).high;
+  if (deadline > 0 && slowest > deadline) {
+    fprintf(stderr, "Estimate of up to %.3g s misses the deadline of "
+                    "%.3g s\n", slowest, deadline);
+    return 2;
+  }
+  return 0;
+}
+
+
 int main(int argc, char *argv[]) {
+  auto start_time = std::chrono::steady_clock::now();
+
   read_arguments(argc, argv);
+  finish_options();
+
+  if (!postprocess_path.empty()) {
+    bool ok = postprocess_to_file(postprocess_path, output_settings());
+    close_output();
+    return ok && !write_failed ? 0 : 1;
+  }
+
+  if (denoising && (options.progressive || checkpointing ||
+                    !serve_path.empty() || !coordinate_address.empty())) {
+    fprintf(stderr, "Error: Denoising is not available with --progressive, "
+                    "--checkpoint, --serve or --coordinate\n");
+    exit(1);
+  }
+
+  if (!aov_names.empty()) {
+    if (out_filename.empty()) {
+      fprintf(stderr, "Error: AOVs need an output file\n");
+      exit(1);
+    }
+    if (options.progressive || checkpointing || !serve_path.empty() ||
+        !coordinate_address.empty()) {
+      fprintf(stderr, "Error: AOVs are not available with --progressive, "
+                      "--checkpoint, --serve or --coordinate\n");
+      exit(1);
+    }
+  }
+
+  if (!heatmap_path.empty() && (options.progressive || checkpointing ||
+                                !serve_path.empty() ||
+                                !coordinate_address.empty())) {
+    fprintf(stderr, "Error: Heatmaps are not available with --progressive, "
+                    "--checkpoint, --serve or --coordinate\n");
+    exit(1);
+  }
+
+  if (!report_path.empty() && (!serve_path.empty() ||
+                               !coordinate_address.empty())) {
+    fprintf(stderr, "Error: Reports are not available with --serve or "
+                    "--coordinate\n");
+    exit(1);
+  }
+
+  if (!timeline_path.empty() && (!serve_path.empty() ||
+                                 !coordinate_address.empty())) {
+    fprintf(stderr, "Error: Timelines are not available with --serve or "
+                    "--coordinate\n");
+    exit(1);
+  }
+
+  if (!estimate_path.empty()) {
+    if (checkpointing || !serve_path.empty() || !coordinate_address.empty()) {
+      fprintf(stderr, "Error: Estimates are not available with "
+                      "--checkpoint, --serve or --coordinate\n");
+      exit(1);
+    }
+    if ((options.time_budget > 0 || options.target_noise > 0) &&
+        options.sample_count == 0 && options.sample_freq == 0) {
+      fprintf(stderr, "Error: Estimates need --samples or --freq with "
+                      "--time-budget or --target-noise\n");
+      exit(1);
+    }
+  } else if (deadline > 0) {
+    fprintf(stderr, "Error: --deadline needs --estimate\n");
+    exit(1);
+  }
+
+  if (!batch_path.empty()) {
+    if (!out_filename.empty()) {
+      fprintf(stderr, "Error: Batch frames name their own output files\n");
+      exit(1);
+    }
+    if (options.progressive || checkpointing || denoising ||
+        !aov_names.empty() || !heatmap_path.empty() ||
+        !estimate_path.empty() || !serve_path.empty() ||
+        !coordinate_address.empty() || !worker_address.empty()) {
+      fprintf(stderr, "Error: Batches are not available with "
+                      "--progressive, --checkpoint, --denoise, --aov, "
+                      "--heatmap, --estimate, --serve, --coordinate or "
+                      "--worker\n");
+      exit(1);
+    }
+  }
+
+  if (!worker_address.empty())
+    return worker_run(worker_address, worker_setup_args);
+
+  if (!serve_path.empty()) {
+    if (options.progressive) {
+      fprintf(stderr, "Error: Progressive rendering is not available "
+                      "with --serve\n");
+      exit(1);
+    }
+    server_options server_opts;
+    server_opts.render = options;
+    server_opts.load = load;
+    return server_run(serve_path, server_opts);
+  }
+
+  if (!coordinate_address.empty())
+    return run_coordinator();
+
   if (in_file == stdin)
     fprintf(stderr, "Reading from stdin...\n");
 
+  if (checkpointing && (in_file == stdin || out_file == stdout)) {
+    fprintf(stderr, "Error: Checkpoints need a scene file and an output "
+                    "file\n");
+    exit(1);
+  }
+
+  /* The checkpoint belongs to this scene and these flags */
+  output_options out = output_settings();
+  if (checkpointing) {
+    std::string contents;
+    if (!read_file(in_filename, &contents)) {
+      fprintf(stderr, "Error: Failed to read %s\n", in_filename.c_str());
+      exit(1);
+    }
+    out.fingerprint = hash64(contents);
+    for (const std::string &arg : job_args)
+      out.fingerprint = hash64(arg + '\0', out.fingerprint);
+  }
+
+  if (!timeline_path.empty())
+    timeline_enable();
+
+  phase_timer timer;
+  phase_begin(&timer, "parse");
   scene *s = scene_create(in_file, in_filename);
   if (in_file != stdin)
     fclose(in_file);
   if (s == nullptr) exit(1);
 
+  std::vector<batch_frame> frames;
+  if (!batch_path.empty()) {
+    if (!batch_read_file(batch_path, *s, &frames)) exit(1);
+    if (format_set)
+      for (batch_frame &frame : frames)
+        frame.format = out_format;
+  }
 
-  if (obj_struct == 1)
-    s->obj_structure = object_bound_tree(s);
-  else
-    s->obj_structure = object_list(s);
-
-
-  image_ostream *stream = open_ppm_stream(out_file, img_width, img_height);
+  phase_begin(&timer, "build");
+  scene_build(s, load);
+
+  if (!estimate_path.empty()) {
+    phase_end(&timer);
+    double setup = 0;
+    for (const phase_time &p : timer.phases)
+      setup += p.wall_seconds;
+    int status = run_estimate(s, setup);
+    if (out_file != stdout)
+      fclose(out_file);
+    scene_destroy(s);
+    return status;
+  }
+  phase_begin(&timer, "render");
+
+  render_stats stats;
+  reset_counters();
+  size_t frame_bytes = 0;
+
+  if (!batch_path.empty()) {
+    batch_stats bstats;
+    if (!batch_render(s, frames, img_width, img_height, region, tonemap_opts,
+                      options, &stats, &bstats))
+      write_failed = true;
+    if (print_stats) {
+      fprintf(stderr, "Frames: %zu\n", bstats.frames);
+      if (bstats.moves > 0)
+        fprintf(stderr, "Moves: %zu (%zu nodes refit, %zu subtrees with %zu "
+                        "objects rebuilt)\n", bstats.moves,
+                bstats.updates.nodes_refit, bstats.updates.subtrees_rebuilt,
+                bstats.updates.objects_rebuilt);
+    }
 
-  scene_render(s, stream, sample_freq);
+  } else {
+    // The budget covers the whole job, including scene loading
+    if (options.progressive && options.time_budget > 0) {
+      std::chrono::duration<double> elapsed =
+          std::chrono::steady_clock::now() - start_time;
+      options.time_budget = std::max(options.time_budget - elapsed.count(),
+                                     1e-6);
+    }
+    if (!render_to_files(s, img_width, img_height, region, out, options,
+                         &timer, &stats, &frame_bytes))
+      write_failed = true;
+  }
+  close_output();
+  phase_end(&timer);
+
+  if (!report_path.empty()) {
+    run_report report;
+    report.scene_file = in_filename;
+    report.width = region.x1 - region.x0;
+    report.height = region.y1 - region.y0;
+    report.threads = render_threads();
+    report.phases = timer.phases;
+    report.stats = stats;
+    report.counters = sum_counters();
+    report.memory = scene_memory(s);
+    report.memory.framebuffer = stats.buffer_bytes + frame_bytes;
+    report.peak_rss = peak_rss_bytes();
+    if (!write_report(report_path, report))
+      fprintf(stderr, "Warning: Failed to write %s\n", report_path.c_str());
+  }
 
-  if (out_file != stdout)
-    fclose(out_file);
-  close(stream);
+  if (!timeline_path.empty() && !timeline_write(timeline_path))
+    fprintf(stderr, "Warning: Failed to write %s\n", timeline_path.c_str());
 
+  if (print_stats) {
+    print_render_stats(stderr, stats, options.progressive);
+    print_trace_stats(stderr, s);
+  }
 
   scene_destroy(s);
-  return 0;
+  return write_failed ? 1 : 0;
 }
@@ -0,0 +1,146 @@
+#include <cstdio>
+#include <cstring>
+#include <string>
+
+#include <netdb.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/stat.h>
+#include <sys/un.h>
+#include <unistd.h>
+
+#include "net.hpp"
+
+
+static bool is_tcp(const std::string &address, std::string *host,
+                   std::string *port) {
+  size_t colon = address.rfind(':');
+  if (colon == std::string::npos || address.find('/') != std::string::npos)
+    return false;
+  *host = address.substr(0, colon);
+  *port = address.substr(colon + 1);
+  return !port->empty();
+}
+
+static bool unix_address(const std::string &path, sockaddr_un *addr) {
+  memset(addr, 0, sizeof(*addr));
+  addr->sun_family = AF_UNIX;
+  if (path.empty() || path.size() >= sizeof(addr->sun_path))
+    return false;
+  strcpy(addr->sun_path, path.c_str());
+  return true;
+}
+
+// Calls f(fd, addr, len) on sockets for the address until it returns true
+template <typename F>
+static int open_socket(const std::string &address, bool passive, F f) {
+  std::string host, port;
+  if (!is_tcp(address, &host, &port)) {
+    sockaddr_un addr;
+    if (!unix_address(address, &addr)) return -1;
+    int fd = socket(AF_UNIX, SOCK_STREAM, 0);
+    if (fd < 0) return -1;
+    if (f(fd, (sockaddr *) &addr, sizeof(addr))) return fd;
+    close(fd);
+    return -1;
+  }
+
+  addrinfo hints, *list;
+  memset(&hints, 0, sizeof(hints));
+  hints.ai_family = AF_UNSPEC;
+  hints.ai_socktype = SOCK_STREAM;
+  hints.ai_flags = passive ? AI_PASSIVE : 0;
+  if (getaddrinfo(host.empty() ? nullptr : host.c_str(), port.c_str(),
+                  &hints, &list) != 0)
+    return -1;
+
+  int result = -1;
+  for (addrinfo *ai = list; ai != nullptr && result < 0; ai = ai->ai_next) {
+    int fd = socket(ai->ai_family, ai->ai_socktype, ai->ai_protocol);
+    if (fd < 0) continue;
+    int one = 1;
+    setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+    if (f(fd, ai->ai_addr, ai->ai_addrlen)) {
+      // Requests are small and should go out at once
+      setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+      result = fd;
+    } else {
+      close(fd);
+    }
+  }
+  freeaddrinfo(list);
+  return result;
+}
+
+
+// Removes a socket left at path by a server that is gone. Anything else
+// there, including the socket of a live server, is left alone
+static bool clear_stale_socket(const std::string &path) {
+  struct stat st;
+  if (lstat(path.c_str(), &st) != 0) return true;
+  if (!S_ISSOCK(st.st_mode)) {
+    fprintf(stderr, "Error: %s exists and is not a socket\n", path.c_str());
+    return false;
+  }
+
+  int fd = socket_connect(path);
+  if (fd >= 0) {
+    close(fd);
+    fprintf(stderr, "Error: Address %s is in use\n", path.c_str());
+    return false;
+  }
+  unlink(path.c_str());
+  return true;
+}
+
+int socket_listen(const std::string &address) {
+  std::string host, port;
+  if (!is_tcp(address, &host, &port) && !clear_stale_socket(address))
+    return -1;
+
+  int fd = open_socket(address, true,
+                       [](int fd, const sockaddr *addr, socklen_t len) {
+    return bind(fd, addr, len) == 0 && listen(fd, 64) == 0;
+  });
+  if (fd < 0)
+    fprintf(stderr, "Error: Failed to listen on %s\n", address.c_str());
+  return fd;
+}
+
+int socket_connect(const std::string &address) {
+  return open_socket(address, false,
+                     [](int fd, const sockaddr *addr, socklen_t len) {
+    return connect(fd, addr, len) == 0;
+  });
+}
+
+void socket_unlisten(int fd, const std::string &address) {
+  std::string host, port;
+  close(fd);
+  if (!is_tcp(address, &host, &port))
+    unlink(address.c_str());
+}
+
+
+bool send_all(int fd, const void *data, size_t size) {
+  const char *p = (const char *) data;
+  while (size > 0) {
+    ssize_t n = send(fd, p, size, MSG_NOSIGNAL);
+    if (n <= 0) return false;
+    p += n;
+    size -= (size_t) n;
+  }
+  return true;
+}
+
+bool recv_all(int fd, void *data, size_t size) {
+  char *p = (char *) data;
+  while (size > 0) {
+    ssize_t n = recv(fd, p, size, 0);
+    if (n <= 0) return false;
+    p += n;
+    size -= (size_t) n;
+  }
+  return true;
+}
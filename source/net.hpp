@@ -0,0 +1,28 @@
+#ifndef _RAYTRACER_NET_HPP
+#define _RAYTRACER_NET_HPP
+
+
+#include <cstddef>
+#include <string>
+
+
+/* Stream sockets. An address of the form host:port is a TCP address, and
+ * anything else (or anything with a '/' in it) is the path of a Unix
+ * domain socket */
+
+// Returns -1 on failure, after printing the reason to stderr. A Unix
+// socket left by a server that has gone is replaced, but any other file at
+// the path, or a server still listening there, is a failure
+int socket_listen(const std::string &address);
+// Returns -1 on failure
+int socket_connect(const std::string &address);
+
+// Closes a socket from socket_listen, removing a Unix socket's file
+void socket_unlisten(int fd, const std::string &address);
+
+// Each returns false if the connection is closed or fails first
+bool send_all(int fd, const void *data, size_t size);
+bool recv_all(int fd, void *data, size_t size);
+
+
+#endif
@@ -4,6 +4,7 @@
 #include "common.hpp"
 #include "obj_geometry.hpp"
 #include "parse.hpp"
+#include "timeline.hpp"
 
 
 using std::string;
@@ -127,6 +128,7 @@ static void exec_command(obj_env *env, std::string line) {
 
 
 obj_geometry *obj_read(std::string filename) {
+  timeline_scope scope("parse obj", "load");
   FILE *file = fopen(filename.c_str(), "r");
   if (file == nullptr) {
     fprintf(stderr, "Error: Failed to open '%s'\n", filename.c_str());
@@ -153,7 +155,10 @@ obj_geometry *obj_read(std::string filename) {
     return nullptr;
   }
 
-  calculate_normals(env.obj);
+  {
+    timeline_scope normals("compute normals", "load");
+    calculate_normals(env.obj);
+  }
   return env.obj;
 }
 
@@ -1,5 +1,6 @@
 #include "object_structure.hpp"
 #include "scene.hpp"
+#include "stats.hpp"
 
 
 struct obj_array : object_structure {
@@ -8,10 +9,25 @@ struct obj_array : object_structure {
   obj_array(scene *s) : s(s) {}
 
   flat_list<scene_object *> candidates(ray3f) {
+    // The whole array is one leaf
+    thread_counters().leaf_visits[leaf_bucket(s->objects.size())] += 1;
     flat_list<scene_object *> result;
     result.extend(&s->objects);
     return result;
   }
+
+  void count_leaves(uint64_t *histogram) {
+    histogram[leaf_bucket(s->objects.size())] += 1;
+  }
+
+  size_t memory_size() {
+    return sizeof(obj_array);
+  }
+
+  // The array holds no bounds
+  structure_update update(const std::vector<scene_object *> &) {
+    return structure_update();
+  }
 };
 
 
@@ -2,16 +2,39 @@
 #define _RAYTRACER_OBJECT_STRUCTURE_HPP
 
 
+#include <cstdint>
+#include <vector>
+
 #include "common.hpp"
 
 struct scene;
 struct scene_object;
 
 
+/* What bringing a structure up to date took */
+struct structure_update {
+  size_t nodes_refit;
+  size_t subtrees_rebuilt;
+  size_t objects_rebuilt;   // In the rebuilt subtrees
+};
+
+
 struct object_structure {
   virtual ~object_structure() {}
   
   virtual flat_list<scene_object *> candidates(ray3f ray) = 0;
+
+  // Adds the leaves to a histogram of leaf_buckets counts, by the number
+  // of objects in them
+  virtual void count_leaves(uint64_t *histogram) = 0;
+
+  // Bytes of the nodes and their object lists
+  virtual size_t memory_size() = 0;
+
+  // Brings the structure up to date after the objects in moved changed
+  // their bounds
+  virtual structure_update update(
+      const std::vector<scene_object *> &moved) = 0;
 };
 
 
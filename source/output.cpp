@@ -0,0 +1,426 @@
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "checkpoint.hpp"
+#include "common.hpp"
+#include "denoise.hpp"
+#include "framebuffer.hpp"
+#include "image.hpp"
+#include "output.hpp"
+#include "profile.hpp"
+#include "render.hpp"
+#include "thread_pool.hpp"
+#include "timeline.hpp"
+
+
+bool close_image(image_file *file, const std::string &filename) {
+  if (close(file)) return true;
+  fprintf(stderr, "Error: Failed to write %s\n", filename.c_str());
+  return false;
+}
+
+static image_file *open_output(const std::string &filename, size_t width,
+                               size_t height, image_format format,
+                               const tonemap_options &tm =
+                                   tonemap_options()) {
+  image_file *file = open_image_file(filename, width, height, format, tm);
+  if (file == nullptr)
+    fprintf(stderr, "Error: Failed to open %s\n", filename.c_str());
+  return file;
+}
+
+
+
+/* AOV files, named after the output file with the AOV name in front of a
+ * .pfm extension */
+
+struct aov_output {
+  std::string name;
+  image_file *file;
+};
+
+bool valid_aov_name(const std::string &name) {
+  return name == "depth" || name == "normal" || name == "object" ||
+         name == "albedo" || name == "cost";
+}
+
+std::string aov_filename(const std::string &output, const std::string &name) {
+  size_t dot = output.find_last_of('.');
+  size_t slash = output.find_last_of('/');
+  std::string base = output;
+  if (dot != std::string::npos && (slash == std::string::npos || dot > slash))
+    base = output.substr(0, dot);
+  return base + "." + name + ".pfm";
+}
+
+static color3f aov_color(const std::string &name, const pixel_aov &aov) {
+  if (name == "depth") {
+    rtfloat depth = aov.depth < rtfloat_inf ? aov.depth : 0;
+    return { depth, depth, depth };
+  }
+  if (name == "normal") return { aov.normal.x, aov.normal.y, aov.normal.z };
+  if (name == "object") {
+    rtfloat id = (rtfloat) aov.object;
+    return { id, id, id };
+  }
+  if (name == "cost") return { aov.cost, aov.cost, aov.cost };
+  return aov.albedo;
+}
+
+static bool open_aov_files(const output_options &out, size_t width,
+                           size_t height, std::vector<aov_output> *outputs) {
+  for (const std::string &name : out.aovs) {
+    image_file *file = open_output(aov_filename(out.filename, name), width,
+                                   height, image_format::pfm);
+    if (file == nullptr) return false;
+    outputs->push_back({ name, file });
+  }
+  return true;
+}
+
+static void write_aovs(const std::vector<aov_output> &outputs,
+                       render_region region, render_region tile,
+                       const pixel_aov *aovs) {
+  size_t tile_width = tile.x1 - tile.x0;
+  std::vector<color3f> row(tile_width);
+  for (const aov_output &out : outputs) {
+    for (size_t y = tile.y0; y < tile.y1; y++) {
+      for (size_t x = 0; x < tile_width; x++)
+        row[x] = aov_color(out.name, aovs[(y - tile.y0)*tile_width + x]);
+      write_pixels(out.file, tile.x0 - region.x0, y - region.y0, tile_width,
+                   row.data());
+    }
+  }
+}
+
+
+
+/* Traversal cost heatmap, in false color from dark blue through cyan, green
+ * and yellow to red. Red is the 99th percentile cost, so a few extreme
+ * pixels do not leave the rest of the image dark */
+
+static color3f heat_color(rtfloat t) {
+  static const color3f stops[] = {
+    {0, 0, 0.5}, {0, 0, 1}, {0, 1, 1}, {0, 1, 0}, {1, 1, 0}, {1, 0, 0}
+  };
+  static const int last = sizeof(stops) / sizeof(stops[0]) - 1;
+
+  t = clamp(t, (rtfloat) 0, (rtfloat) 1) * last;
+  int k = std::min((int) t, last - 1);
+  rtfloat f = t - k;
+  return (1 - f) * stops[k] + f * stops[k + 1];
+}
+
+static bool write_heatmap(image_file *file, const std::string &filename,
+                          const std::vector<rtfloat> &cost, size_t width,
+                          size_t height) {
+  std::vector<rtfloat> sorted = cost;
+  size_t k = sorted.size() * 99 / 100;
+  std::nth_element(sorted.begin(), sorted.begin() + k, sorted.end());
+  rtfloat scale = std::max(sorted[k], (rtfloat) 1);
+
+  std::vector<color3f> row(width);
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++)
+      row[x] = heat_color(cost[y*width + x] / scale);
+    write_pixels(file, 0, y, width, row.data());
+  }
+  bool ok = close_image(file, filename);
+  fprintf(stderr, "Heatmap: red is %.0f traversal steps per sample\n",
+          scale);
+  return ok;
+}
+
+
+
+/* The render itself, by the path its outputs call for */
+
+struct output_render {
+  scene *s;
+  size_t frame_width, frame_height;
+  render_region region;
+  size_t width, height;
+  const output_options *out;
+  render_options opts;
+  phase_timer *timer;
+  render_stats *stats;
+  size_t frame_bytes;     // Of whole-frame buffers
+};
+
+static void begin_phase(output_render *r, const char *name) {
+  if (r->timer != nullptr)
+    phase_begin(r->timer, name);
+}
+
+
+/* Rewrites the whole output image in place. The file size never changes,
+ * so the file is a valid image at any point */
+static void write_progress(const output_options &out,
+                           const accum_buffer *accum) {
+  timeline_scope scope("write progress", "output");
+  rewind(out.file);
+  image_ostream *stream = open_image_stream(out.file, accum->width,
+                                            accum->height, out.format,
+                                            out.tonemap);
+  write_accum(accum, stream);
+  close(stream);
+  fflush(out.file);
+}
+
+static void render_progressive(output_render *r) {
+  const output_options &out = *r->out;
+  accum_buffer *accum = accum_create(r->width, r->height);
+  if (out.resume &&
+      accum_checkpoint_load(out.checkpoint_path, out.fingerprint, accum))
+    fprintf(stderr, "Resuming from %s\n", out.checkpoint_path.c_str());
+
+  bool seekable = fseek(out.file, 0, SEEK_SET) == 0;
+  auto last_checkpoint = std::chrono::steady_clock::now();
+  r->opts.pass_done = [&](const accum_buffer *accum) {
+    if (seekable)
+      write_progress(out, accum);
+
+    std::chrono::duration<double> elapsed =
+        std::chrono::steady_clock::now() - last_checkpoint;
+    if (out.checkpoint && elapsed.count() >= out.checkpoint_interval) {
+      timeline_scope scope("checkpoint", "output");
+      if (!accum_checkpoint_save(out.checkpoint_path, out.fingerprint,
+                                 accum))
+        fprintf(stderr, "Warning: Failed to write %s\n",
+                out.checkpoint_path.c_str());
+      last_checkpoint = std::chrono::steady_clock::now();
+    }
+  };
+
+  scene_render_progressive(r->s, r->frame_width, r->frame_height, r->region,
+                           accum, r->opts, r->stats);
+  begin_phase(r, "write");
+  timeline_scope scope("flush output", "output");
+  if (!seekable)
+    write_progress(out, accum);
+  accum_destroy(accum);
+  if (out.checkpoint)
+    remove(out.checkpoint_path.c_str());
+}
+
+
+/* The filter needs the whole frame and its AOVs */
+static void render_denoised(output_render *r) {
+  const output_options &out = *r->out;
+  size_t width = r->width;
+  render_region region = r->region;
+  std::vector<color3f> frame(width * r->height);
+  std::vector<pixel_aov> frame_aovs(width * r->height);
+
+  thread_pool *pool = nullptr;
+  if (r->opts.pool == nullptr)
+    r->opts.pool = pool = thread_pool_create(r->opts.num_threads);
+  aov_callback write_tile_aovs = r->opts.aov_done;
+  r->opts.aov_done = [&](render_region tile, const pixel_aov *pixels) {
+    size_t tile_width = tile.x1 - tile.x0;
+    for (size_t y = tile.y0; y < tile.y1; y++)
+      std::copy(pixels + (y - tile.y0) * tile_width,
+                pixels + (y - tile.y0 + 1) * tile_width,
+                &frame_aovs[(y - region.y0) * width + tile.x0 - region.x0]);
+    if (write_tile_aovs)
+      write_tile_aovs(tile, pixels);
+  };
+
+  scene_render_tiles(r->s, r->frame_width, r->frame_height, region,
+                     [&](render_region tile, const color3f *pixels) {
+    size_t tile_width = tile.x1 - tile.x0;
+    for (size_t y = tile.y0; y < tile.y1; y++)
+      std::copy(pixels + (y - tile.y0) * tile_width,
+                pixels + (y - tile.y0 + 1) * tile_width,
+                &frame[(y - region.y0) * width + tile.x0 - region.x0]);
+  }, r->opts, r->stats);
+  r->frame_bytes += frame.size() * sizeof(color3f) +
+                    frame_aovs.size() * sizeof(pixel_aov);
+
+  begin_phase(r, "denoise");
+  {
+    timeline_scope scope("denoise", "post");
+    denoise(frame.data(), frame_aovs.data(), width, r->height,
+            denoise_options(), r->opts.pool);
+  }
+  if (pool != nullptr)
+    thread_pool_destroy(pool);
+
+  begin_phase(r, "write");
+  timeline_scope scope("write image", "output");
+
+  image_ostream *stream = open_image_stream(out.file, width, r->height,
+                                            out.format, out.tonemap);
+  for (color3f c : frame)
+    stream << c;
+  close(stream);
+}
+
+
+// Tiles go straight to the file, whatever order they finish in
+static bool render_tiles(output_render *r, image_file *image) {
+  render_region region = r->region;
+  scene_render_tiles(r->s, r->frame_width, r->frame_height, region,
+                     [&](render_region tile, const color3f *pixels) {
+    size_t tile_width = tile.x1 - tile.x0;
+    for (size_t y = tile.y0; y < tile.y1; y++)
+      write_pixels(image, tile.x0 - region.x0, y - region.y0, tile_width,
+                   &pixels[(y - tile.y0) * tile_width]);
+  }, r->opts, r->stats);
+  begin_phase(r, "write");
+  timeline_scope scope("flush output", "output");
+  return close_image(image, r->out->filename);
+}
+
+
+// Rows go out in order, so any stream will do
+static void render_rows(output_render *r) {
+  const output_options &out = *r->out;
+  size_t width = r->width;
+  image_ostream *stream = open_image_stream(out.file, width, r->height,
+                                            out.format, out.tonemap);
+  auto write_row = [&](size_t, const color3f *row) {
+    for (size_t x = 0; x < width; x++)
+      stream << row[x];
+  };
+
+  row_checkpoint *ckpt = nullptr;
+  size_t rows_done = 0;
+  if (out.checkpoint) {
+    ckpt = row_checkpoint_open(out.checkpoint_path, out.fingerprint, width,
+                               r->height, out.checkpoint_interval,
+                               out.resume, write_row, &rows_done);
+    if (ckpt == nullptr)
+      fprintf(stderr, "Warning: Failed to write %s\n",
+              out.checkpoint_path.c_str());
+    else if (rows_done > 0)
+      fprintf(stderr, "Resuming from %s after %zu rows\n",
+              out.checkpoint_path.c_str(), rows_done);
+  }
+
+  render_region rest = r->region;
+  rest.y0 += rows_done;
+  bool finished = scene_render_region(r->s, r->frame_width, r->frame_height,
+                                      rest,
+                                      [&](size_t y, const color3f *row) {
+    write_row(y, row);
+    if (ckpt != nullptr)
+      row_checkpoint_add(ckpt, row);
+  }, r->opts, r->stats);
+
+  begin_phase(r, "write");
+  timeline_scope scope("flush output", "output");
+  row_checkpoint_close(ckpt, finished);
+  close(stream);
+}
+
+
+bool render_to_files(scene *s, size_t frame_width, size_t frame_height,
+                     render_region region, const output_options &out,
+                     const render_options &opts, phase_timer *timer,
+                     render_stats *stats, size_t *frame_bytes) {
+  output_render r;
+  r.s = s;
+  r.frame_width = frame_width;
+  r.frame_height = frame_height;
+  r.region = region;
+  r.width = region.x1 - region.x0;
+  r.height = region.y1 - region.y0;
+  r.out = &out;
+  r.opts = opts;
+  r.timer = timer;
+  r.stats = stats;
+  r.frame_bytes = 0;
+  size_t width = r.width, height = r.height;
+
+  std::vector<aov_output> aovs;
+  image_file *heatmap = nullptr;
+  bool ok = open_aov_files(out, width, height, &aovs);
+  if (ok && !out.heatmap.empty()) {
+    heatmap = open_output(out.heatmap, width, height,
+                          image_format_for(out.heatmap));
+    ok = heatmap != nullptr;
+  }
+  if (!ok) {
+    for (aov_output &aov : aovs)
+      close(aov.file);
+    return false;
+  }
+
+  std::vector<rtfloat> heat(heatmap != nullptr ? width * height : 0);
+  r.frame_bytes += heat.size() * sizeof(rtfloat);
+  if (!aovs.empty() || heatmap != nullptr) {
+    r.opts.aov_done = [&](render_region tile, const pixel_aov *pixels) {
+      write_aovs(aovs, region, tile, pixels);
+      if (heatmap == nullptr) return;
+      size_t tile_width = tile.x1 - tile.x0;
+      for (size_t y = tile.y0; y < tile.y1; y++)
+        for (size_t x = tile.x0; x < tile.x1; x++)
+          heat[(y - region.y0) * width + x - region.x0] =
+              pixels[(y - tile.y0) * tile_width + x - tile.x0].cost;
+    };
+  }
+
+  image_file *image = nullptr;
+  if (opts.progressive)
+    render_progressive(&r);
+  else if (out.denoise)
+    render_denoised(&r);
+  else if (!out.checkpoint && !out.filename.empty() &&
+           (image = open_image_file(out.filename, width, height, out.format,
+                                    out.tonemap)))
+    ok = render_tiles(&r, image);
+  else
+    render_rows(&r);
+
+  if (heatmap != nullptr) {
+    timeline_scope scope("write heatmap", "output");
+    ok = write_heatmap(heatmap, out.heatmap, heat, width, height) && ok;
+  }
+  for (aov_output &aov : aovs)
+    ok = close_image(aov.file, aov_filename(out.filename, aov.name)) && ok;
+
+  if (frame_bytes != nullptr)
+    *frame_bytes = r.frame_bytes;
+  return ok;
+}
+
+
+size_t output_buffer_bytes(const output_options &out,
+                           const render_options &options, size_t width,
+                           size_t height, size_t threads) {
+  render_options opts = options;
+  if (!out.aovs.empty() || !out.heatmap.empty() || out.denoise)
+    opts.aov_done = [](render_region, const pixel_aov *) {};
+  bool tiles = out.denoise || (!out.filename.empty() && !out.checkpoint);
+
+  size_t bytes = render_buffer_bytes(opts, width, height, threads, tiles);
+  if (!out.heatmap.empty())
+    bytes += width * height * sizeof(rtfloat);
+  if (out.denoise)
+    bytes += width * height * (sizeof(color3f) + sizeof(pixel_aov)) +
+             denoise_memory(width, height);
+  return bytes;
+}
+
+
+
+bool postprocess_to_file(const std::string &pfm_path,
+                         const output_options &out) {
+  size_t width, height;
+  std::vector<float> pixels;
+  if (!read_pfm(pfm_path, &width, &height, &pixels)) {
+    fprintf(stderr, "Error: Failed to read %s\n", pfm_path.c_str());
+    return false;
+  }
+
+  image_ostream *stream = open_image_stream(out.file, width, height,
+                                            out.format, out.tonemap);
+  for (size_t i = 0; i < width * height; i++)
+    stream << color3f{ pixels[3*i], pixels[3*i + 1], pixels[3*i + 2] };
+  close(stream);
+  return true;
+}
@@ -0,0 +1,74 @@
+#ifndef _RAYTRACER_OUTPUT_HPP
+#define _RAYTRACER_OUTPUT_HPP
+
+
+#include <cstdint>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "common.hpp"
+#include "image.hpp"
+#include "profile.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "tonemap.hpp"
+
+
+/* Renders written to image files, as the as2 command line writes them.
+ * A regular file gets tiles written into it as they finish; a pipe gets
+ * rows in order. Progressive renders rewrite the whole image after every
+ * pass, and AOVs and the traversal cost heatmap go to files of their own */
+
+struct output_options {
+  FILE *file = stdout;        // The image; the caller flushes and closes it
+  std::string filename;       // Of file, empty for standard output
+  image_format format = image_format::ppm;
+  tonemap_options tonemap;
+
+  std::vector<std::string> aovs;  // Written next to filename
+  std::string heatmap;        // Traversal cost heatmap file, or empty
+  bool denoise = false;       // Holds the whole frame; not progressive
+
+  // Rows in order, or progressive passes, are saved to checkpoint_path
+  // every checkpoint_interval seconds, and taken up again if resume is set
+  // and the fingerprint matches
+  bool checkpoint = false;
+  std::string checkpoint_path;
+  uint64_t fingerprint = 0;
+  rtfloat checkpoint_interval = 60;
+  bool resume = false;
+};
+
+// depth, normal, object, albedo or cost
+bool valid_aov_name(const std::string &);
+
+// File for an AOV of output, as in out.depth.pfm for out.ppm
+std::string aov_filename(const std::string &output, const std::string &name);
+
+
+// Renders a region of a frame_width x frame_height frame to the files of
+// out. Phases after the render ("denoise" and "write") are started on
+// timer if it is not null, and frame_bytes gets the bytes of whole-frame
+// buffers held besides stats->buffer_bytes. Returns false after reporting
+// a file that could not be opened or written
+bool render_to_files(scene *, size_t frame_width, size_t frame_height,
+                     render_region, const output_options &out,
+                     const render_options &, phase_timer *timer,
+                     render_stats *stats, size_t *frame_bytes);
+
+// Most bytes the pixel buffers of such a render of a width x height region
+// would hold, as render_to_files reports them
+size_t output_buffer_bytes(const output_options &out, const render_options &,
+                           size_t width, size_t height, size_t threads);
+
+// Writes a saved PFM image to out through its display transform, without
+// rendering anything. Returns false after reporting a failure
+bool postprocess_to_file(const std::string &pfm_path,
+                         const output_options &out);
+
+// Returns false after reporting a failure to write the file
+bool close_image(image_file *, const std::string &filename);
+
+
+#endif
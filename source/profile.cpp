@@ -0,0 +1,448 @@
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include <sys/resource.h>
+
+#include "common.hpp"
+#include "light_tree.hpp"
+#include "profile.hpp"
+#include "sampler.hpp"
+
+
+void phase_begin(phase_timer *timer, const std::string &name) {
+  phase_end(timer);
+  timer->current = name;
+  timer->wall_start = std::chrono::steady_clock::now();
+  timer->cpu_start = process_cpu_seconds();
+}
+
+void phase_end(phase_timer *timer) {
+  if (timer->current.empty()) return;
+  std::chrono::duration<double> wall =
+      std::chrono::steady_clock::now() - timer->wall_start;
+  timer->phases.push_back({ timer->current, wall.count(),
+                            process_cpu_seconds() - timer->cpu_start });
+  timer->current.clear();
+}
+
+
+double process_cpu_seconds() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return usage.ru_utime.tv_sec + usage.ru_utime.tv_usec * 1e-6 +
+         usage.ru_stime.tv_sec + usage.ru_stime.tv_usec * 1e-6;
+}
+
+size_t peak_rss_bytes() {
+  rusage usage;
+  getrusage(RUSAGE_SELF, &usage);
+  return (size_t) usage.ru_maxrss * 1024;   // Reported in kB on Linux
+}
+
+
+
+memory_usage scene_memory(scene *s) {
+  memory_usage m = memory_usage();
+
+  m.objects = s->objects.capacity() * sizeof(scene_object *);
+  for (scene_object *obj : s->objects) {
+    m.objects += obj->memory_size() - sizeof(object_material);
+    m.materials += sizeof(object_material);
+  }
+
+  m.obj_staging = s->obj_staging_bytes;
+  if (s->obj_structure != nullptr)
+    m.structure = s->obj_structure->memory_size();
+  m.lights = s->lights.capacity() * sizeof(light_source) +
+             light_tree_memory(s->light_structure);
+  return m;
+}
+
+
+
+/* Written by hand, with one field per line so the report diffs well */
+
+static std::string json_escape(const std::string &text) {
+  std::string result;
+  for (unsigned char c : text) {
+    if (c == '"' || c == '\\') {
+      result += '\\';
+      result += (char) c;
+    } else if (c < 0x20) {
+      result += stringf("\\u%04x", c);
+    } else {
+      result += (char) c;
+    }
+  }
+  return result;
+}
+
+static void write_rays(FILE *file, const char *kind, const ray_counts &c,
+                       bool last) {
+  fprintf(file, "    \"%s\": {\"rays\": %llu, \"nodes\": %llu, "
+                "\"primitives\": %llu}%s\n", kind,
+          (unsigned long long) c.rays, (unsigned long long) c.nodes,
+          (unsigned long long) c.primitives, last ? "" : ",");
+}
+
+// The last field of the object
+static void write_memory(FILE *file, const memory_usage &m, size_t peak_rss) {
+  fprintf(file, "  \"memory_bytes\": {\n");
+  fprintf(file, "    \"objects\": %zu,\n", m.objects);
+  fprintf(file, "    \"materials\": %zu,\n", m.materials);
+  fprintf(file, "    \"obj_staging\": %zu,\n", m.obj_staging);
+  fprintf(file, "    \"structure\": %zu,\n", m.structure);
+  fprintf(file, "    \"lights\": %zu,\n", m.lights);
+  fprintf(file, "    \"framebuffer\": %zu,\n", m.framebuffer);
+  fprintf(file, "    \"peak_rss\": %zu\n", peak_rss);
+  fprintf(file, "  }\n");
+}
+
+bool write_report(const std::string &path, const run_report &r) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) return false;
+
+  double wall = 0, cpu = 0;
+  for (const phase_time &p : r.phases) {
+    wall += p.wall_seconds;
+    cpu += p.cpu_seconds;
+  }
+
+  fprintf(file, "{\n");
+  fprintf(file, "  \"scene\": \"%s\",\n", json_escape(r.scene_file).c_str());
+  fprintf(file, "  \"width\": %zu,\n", r.width);
+  fprintf(file, "  \"height\": %zu,\n", r.height);
+  fprintf(file, "  \"threads\": %zu,\n", r.threads);
+
+  fprintf(file, "  \"phases\": [\n");
+  for (size_t i = 0; i < r.phases.size(); i++) {
+    const phase_time &p = r.phases[i];
+    fprintf(file, "    {\"name\": \"%s\", \"wall_seconds\": %.6f, "
+                  "\"cpu_seconds\": %.6f}%s\n",
+            json_escape(p.name).c_str(), p.wall_seconds, p.cpu_seconds,
+            i + 1 < r.phases.size() ? "," : "");
+  }
+  fprintf(file, "  ],\n");
+  fprintf(file, "  \"wall_seconds\": %.6f,\n", wall);
+  fprintf(file, "  \"cpu_seconds\": %.6f,\n", cpu);
+
+  fprintf(file, "  \"pixels\": %zu,\n", r.stats.pixels);
+  fprintf(file, "  \"samples\": %llu,\n",
+          (unsigned long long) r.stats.samples);
+  fprintf(file, "  \"rays\": {\n");
+  write_rays(file, "primary", r.counters.primary, false);
+  write_rays(file, "shadow", r.counters.shadow, false);
+  write_rays(file, "reflection", r.counters.reflection, true);
+  fprintf(file, "  },\n");
+
+  write_memory(file, r.memory, r.peak_rss);
+  fprintf(file, "}\n");
+
+  return fclose(file) == 0;
+}
+
+
+
+/* Render statistics, as --stats prints them */
+
+void print_render_stats(FILE *file, const render_stats &stats,
+                        bool passes) {
+  fprintf(file, "Pixels: %zu\n", stats.pixels);
+  if (passes)
+    fprintf(file, "Passes: %zu\n", stats.passes);
+  fprintf(file, "Samples: %llu (%.2f per pixel)\n",
+          (unsigned long long) stats.samples,
+          stats.pixels > 0 ? (double) stats.samples / stats.pixels : 0.0);
+}
+
+static void print_rays(FILE *file, const char *kind, const ray_counts &counts,
+                       const char *extra = "") {
+  if (counts.rays == 0) return;
+  fprintf(file, "%s rays: %llu (%.1f nodes, %.1f primitives per ray%s)\n",
+          kind, (unsigned long long) counts.rays,
+          (double) counts.nodes / counts.rays,
+          (double) counts.primitives / counts.rays, extra);
+}
+
+static void print_leaf_histogram(FILE *file, const char *title,
+                                 const uint64_t *counts) {
+  fprintf(file, "%s:", title);
+  for (int b = 0; b < leaf_buckets; b++) {
+    size_t low = (size_t) 1 << b;
+    if (b == leaf_buckets - 1)
+      fprintf(file, " %zu+: %llu", low, (unsigned long long) counts[b]);
+    else if (low == 1)
+      fprintf(file, " 1: %llu", (unsigned long long) counts[b]);
+    else
+      fprintf(file, " %zu-%zu: %llu", low, 2*low - 1,
+              (unsigned long long) counts[b]);
+  }
+  fprintf(file, "\n");
+}
+
+void print_trace_stats(FILE *file, scene *s) {
+  trace_counters counters = sum_counters();
+
+  char cache_hits[64] = "";
+  if (counters.shadow.rays > 0)
+    snprintf(cache_hits, sizeof(cache_hits), ", %.1f%% occluder cache hits",
+             100.0 * counters.occluder_cache_hits / counters.shadow.rays);
+
+  print_rays(file, "Primary", counters.primary);
+  print_rays(file, "Shadow", counters.shadow, cache_hits);
+  print_rays(file, "Reflection", counters.reflection);
+
+  ray_counts total = counters.primary;
+  const ray_counts *secondary[] = { &counters.shadow, &counters.reflection };
+  for (const ray_counts *c : secondary) {
+    total.rays += c->rays;
+    total.nodes += c->nodes;
+    total.primitives += c->primitives;
+  }
+  print_rays(file, "Total", total);
+
+  uint64_t leaves[leaf_buckets] = {};
+  s->obj_structure->count_leaves(leaves);
+  print_leaf_histogram(file, "Leaves by object count", leaves);
+  print_leaf_histogram(file, "Leaf visits by object count",
+                       counters.leaf_visits);
+}
+
+
+
+/* Strata are the cells of a grid over the region, as square as the region
+ * allows, visited in serpentine order so that strata next to each other in
+ * the list are next to each other in the frame. A block of pixels is
+ * rendered in each, rather than one pixel, so that rays share the caches
+ * with their neighbors as they do in the tiles of a full render */
+
+static const size_t estimate_block = 4;
+
+struct stratum {
+  size_t x0, y0, x1, y1;
+};
+
+static std::vector<stratum> make_strata(render_region region, size_t count) {
+  size_t width = region.x1 - region.x0;
+  size_t height = region.y1 - region.y0;
+  size_t nx = (size_t) std::lround(std::sqrt((double) count * width /
+                                             height));
+  nx = std::min(std::max(nx, (size_t) 1), width);
+  size_t ny = (size_t) std::lround((double) count / nx);
+  ny = std::min(std::max(ny, (size_t) 1), height);
+
+  std::vector<stratum> strata;
+  for (size_t j = 0; j < ny; j++) {
+    for (size_t k = 0; k < nx; k++) {
+      size_t i = j % 2 == 0 ? k : nx - 1 - k;
+      strata.push_back({ region.x0 + width * i / nx,
+                         region.y0 + height * j / ny,
+                         region.x0 + width * (i + 1) / nx,
+                         region.y0 + height * (j + 1) / ny });
+    }
+  }
+  return strata;
+}
+
+
+/* Total of a quantity over the region, from its mean over the one block of
+ * each stratum, the areas of the strata and the pixels of their blocks.
+ * One block per stratum says nothing about the variance within a stratum,
+ * so it comes from the differences between neighboring strata, which
+ * overstates it where the quantity changes smoothly across the frame */
+static estimate_interval extrapolate(const std::vector<double> &values,
+                                     const std::vector<double> &areas,
+                                     const std::vector<double> &sampled) {
+  size_t n = values.size();
+  double sum = 0, variance = 0;
+  for (size_t h = 0; h < n; h++) {
+    sum += areas[h] * values[h];
+    if (h == 0) continue;
+    // Strata sampled in full add no error
+    double weight = areas[h] * (areas[h] - sampled[h]) +
+                    areas[h - 1] * (areas[h - 1] - sampled[h - 1]);
+    double diff = values[h] - values[h - 1];
+    variance += weight / 4 * diff * diff;
+  }
+  double error = n < 2 ? 0 : 1.96 * std::sqrt(variance * n / (n - 1));
+  return { sum, std::max(sum - error, 0.0), sum + error };
+}
+
+
+static size_t area(const render_region &r) {
+  return (r.x1 - r.x0) * (r.y1 - r.y0);
+}
+
+cost_estimate estimate_render(scene *s, size_t frame_width,
+                              size_t frame_height, render_region region,
+                              const render_options &opts,
+                              size_t sample_pixels) {
+  cost_estimate e = cost_estimate();
+  e.width = region.x1 - region.x0;
+  e.height = region.y1 - region.y0;
+
+  size_t block_pixels = estimate_block * estimate_block;
+  std::vector<stratum> strata = make_strata(
+      region, std::max(sample_pixels / block_pixels, (size_t) 1));
+  std::vector<region_cost> blocks(strata.size());
+  rng_state rng = rng_create(opts.seed, 1);
+  for (size_t h = 0; h < strata.size(); h++) {
+    const stratum &c = strata[h];
+    size_t w = std::min(estimate_block, c.x1 - c.x0);
+    size_t b = std::min(estimate_block, c.y1 - c.y0);
+    size_t x = c.x0 + rng_next(&rng) % (c.x1 - c.x0 - w + 1);
+    size_t y = c.y0 + rng_next(&rng) % (c.y1 - c.y0 - b + 1);
+    blocks[h].region = { x, y, x + w, y + b };
+  }
+
+  // A first pass warms the caches and the clock speed up, and sets up
+  // whatever is set up on first use
+  std::vector<region_cost> warmup = blocks;
+  scene_measure_regions(s, frame_width, frame_height, &warmup, opts);
+
+  reset_counters();
+  auto start = std::chrono::steady_clock::now();
+  scene_measure_regions(s, frame_width, frame_height, &blocks, opts);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  e.measure_seconds = elapsed.count();
+  e.counters = sum_counters();
+
+  size_t n = strata.size();
+  std::vector<double> areas(n), sampled(n), samples(n), primary(n),
+      shadow(n), reflection(n), rays(n), seconds(n);
+  for (size_t h = 0; h < n; h++) {
+    const region_cost &c = blocks[h];
+    double pixels = (double) area(c.region);
+    e.sampled_pixels += area(c.region);
+    sampled[h] = pixels;
+    areas[h] = (double) (strata[h].x1 - strata[h].x0) *
+               (strata[h].y1 - strata[h].y0);
+    samples[h] = c.samples / pixels;
+    primary[h] = c.primary.rays / pixels;
+    shadow[h] = c.shadow.rays / pixels;
+    reflection[h] = c.reflection.rays / pixels;
+    rays[h] = primary[h] + shadow[h] + reflection[h];
+    seconds[h] = c.seconds / pixels;
+  }
+  e.samples = extrapolate(samples, areas, sampled);
+  e.primary = extrapolate(primary, areas, sampled);
+  e.shadow = extrapolate(shadow, areas, sampled);
+  e.reflection = extrapolate(reflection, areas, sampled);
+  e.rays = extrapolate(rays, areas, sampled);
+  e.cpu_seconds = extrapolate(seconds, areas, sampled);
+  return e;
+}
+
+
+estimate_interval estimate_wall_seconds(const cost_estimate &e,
+                                        size_t threads) {
+  return { e.setup_seconds + e.cpu_seconds.value / threads,
+           e.setup_seconds + e.cpu_seconds.low / threads,
+           e.setup_seconds + e.cpu_seconds.high / threads };
+}
+
+std::vector<size_t> estimate_thread_counts(size_t max_threads) {
+  std::vector<size_t> counts;
+  for (size_t t = 1; t < max_threads; t *= 2)
+    counts.push_back(t);
+  counts.push_back(max_threads);
+  return counts;
+}
+
+
+static void write_interval(FILE *file, const char *name,
+                           const estimate_interval &i, int precision) {
+  fprintf(file, "  \"%s\": {\"value\": %.*f, \"low\": %.*f, "
+                "\"high\": %.*f},\n", name, precision, i.value, precision,
+          i.low, precision, i.high);
+}
+
+bool write_estimate(const std::string &path, const cost_estimate &e,
+                    size_t max_threads) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) return false;
+
+  const trace_counters &c = e.counters;
+  uint64_t primary = std::max(c.primary.rays, (uint64_t) 1);
+  uint64_t rays = std::max(c.primary.rays + c.shadow.rays +
+                           c.reflection.rays, (uint64_t) 1);
+
+  fprintf(file, "{\n");
+  fprintf(file, "  \"scene\": \"%s\",\n", json_escape(e.scene_file).c_str());
+  fprintf(file, "  \"width\": %zu,\n", e.width);
+  fprintf(file, "  \"height\": %zu,\n", e.height);
+  fprintf(file, "  \"sampled_pixels\": %zu,\n", e.sampled_pixels);
+  fprintf(file, "  \"measure_seconds\": %.6f,\n", e.measure_seconds);
+  fprintf(file, "  \"setup_seconds\": %.6f,\n", e.setup_seconds);
+
+  fprintf(file, "  \"shadow_rays_per_primary\": %.4f,\n",
+          (double) c.shadow.rays / primary);
+  fprintf(file, "  \"reflection_rays_per_primary\": %.4f,\n",
+          (double) c.reflection.rays / primary);
+  fprintf(file, "  \"steps_per_ray\": %.2f,\n",
+          (double) traversal_steps(c) / rays);
+  fprintf(file, "  \"ns_per_ray\": %.2f,\n",
+          1e9 * e.measure_seconds / rays);
+
+  write_interval(file, "samples", e.samples, 0);
+  write_interval(file, "primary_rays", e.primary, 0);
+  write_interval(file, "shadow_rays", e.shadow, 0);
+  write_interval(file, "reflection_rays", e.reflection, 0);
+  write_interval(file, "rays", e.rays, 0);
+  write_interval(file, "cpu_seconds", e.cpu_seconds, 6);
+
+  std::vector<size_t> counts = estimate_thread_counts(max_threads);
+  fprintf(file, "  \"wall_seconds\": [\n");
+  for (size_t i = 0; i < counts.size(); i++) {
+    estimate_interval wall = estimate_wall_seconds(e, counts[i]);
+    fprintf(file, "    {\"threads\": %zu, \"value\": %.6f, \"low\": %.6f, "
+                  "\"high\": %.6f}%s\n", counts[i], wall.value, wall.low,
+            wall.high, i + 1 < counts.size() ? "," : "");
+  }
+  fprintf(file, "  ],\n");
+
+  write_memory(file, e.memory, e.peak_rss);
+  fprintf(file, "}\n");
+
+  return fclose(file) == 0;
+}
+
+
+static void print_interval(FILE *file, const char *title,
+                           const estimate_interval &i, const char *unit) {
+  fprintf(file, "%s: %.3g%s (%.3g-%.3g)\n", title, i.value, unit, i.low,
+          i.high);
+}
+
+void print_estimate(FILE *file, const cost_estimate &e, size_t max_threads) {
+  const trace_counters &c = e.counters;
+  uint64_t primary = std::max(c.primary.rays, (uint64_t) 1);
+  uint64_t rays = std::max(c.primary.rays + c.shadow.rays +
+                           c.reflection.rays, (uint64_t) 1);
+
+  fprintf(file, "Estimate from %zu of %zu pixels, in %.3f s\n",
+          e.sampled_pixels, e.width * e.height, e.measure_seconds);
+  print_interval(file, "Samples", e.samples, "");
+  print_interval(file, "Rays", e.rays, "");
+  fprintf(file, "Per primary ray: %.2f shadow rays, %.2f reflection "
+                "rays\n", (double) c.shadow.rays / primary,
+          (double) c.reflection.rays / primary);
+  fprintf(file, "Per ray: %.1f traversal steps, %.0f ns\n",
+          (double) traversal_steps(c) / rays,
+          1e9 * e.measure_seconds / rays);
+  print_interval(file, "CPU time", e.cpu_seconds, " s");
+  fprintf(file, "Setup: %.3f s\n", e.setup_seconds);
+  for (size_t threads : estimate_thread_counts(max_threads)) {
+    std::string title = stringf("Wall time on %zu thread%s", threads,
+                                threads == 1 ? "" : "s");
+    print_interval(file, title.c_str(), estimate_wall_seconds(e, threads),
+                   " s");
+  }
+  fprintf(file, "Peak memory: %.1f MB (%.1f MB of pixel buffers)\n",
+          e.peak_rss / 1e6, e.memory.framebuffer / 1e6);
+}
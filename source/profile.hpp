@@ -0,0 +1,135 @@
+#ifndef _RAYTRACER_PROFILE_HPP
+#define _RAYTRACER_PROFILE_HPP
+
+
+#include <chrono>
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "render.hpp"
+#include "scene.hpp"
+#include "stats.hpp"
+
+
+/* Phase timers. Phases run one after another, and each records the wall
+ * time and the CPU time of all threads of the process spent in it */
+
+struct phase_time {
+  std::string name;
+  double wall_seconds;
+  double cpu_seconds;
+};
+
+struct phase_timer {
+  std::vector<phase_time> phases;
+  std::string current;      // Empty between phases
+  std::chrono::steady_clock::time_point wall_start;
+  double cpu_start;
+};
+
+// Ends the current phase, if there is one, and starts the next
+void phase_begin(phase_timer *, const std::string &name);
+void phase_end(phase_timer *);
+
+double process_cpu_seconds();
+size_t peak_rss_bytes();
+
+
+
+/* Memory accounting, in bytes */
+
+struct memory_usage {
+  size_t objects;       // Object records and the list of them, without
+                        // their materials
+  size_t materials;
+  size_t obj_staging;   // Most held at once while reading OBJ files
+  size_t structure;     // Spatial structure nodes
+  size_t lights;        // Light records and the light tree
+  size_t framebuffer;   // Pixel buffers of the render and its output
+};
+
+// Fills in everything but framebuffer
+memory_usage scene_memory(scene *);
+
+
+
+/* Run report, as JSON */
+
+struct run_report {
+  std::string scene_file;
+  size_t width, height;
+  size_t threads;
+  std::vector<phase_time> phases;
+  render_stats stats;
+  trace_counters counters;
+  memory_usage memory;
+  size_t peak_rss;
+};
+
+// Returns false if the file cannot be written
+bool write_report(const std::string &path, const run_report &);
+
+
+
+/* Printed statistics, as --stats shows them */
+
+// Pixels, samples, and passes if passes is set
+void print_render_stats(FILE *, const render_stats &, bool passes);
+
+// Rays of all threads by kind, and the leaves of the scene's structure
+void print_trace_stats(FILE *, scene *);
+
+
+
+/* Cost estimates. A small block of pixels in each cell of a grid over the
+ * region is rendered on one thread, and the cost of the whole region is
+ * extrapolated from them, with 95% confidence intervals. The intervals
+ * cover the error of sampling, not the noise of the clock between runs */
+
+struct estimate_interval {
+  double value;
+  double low, high;
+};
+
+struct cost_estimate {
+  std::string scene_file;
+  size_t width, height;
+  size_t sampled_pixels;
+  double measure_seconds;     // Spent rendering the sampled pixels
+  double setup_seconds;       // Parsing and building, once per job
+
+  estimate_interval samples;
+  estimate_interval primary, shadow, reflection;  // Rays
+  estimate_interval rays;
+  estimate_interval cpu_seconds;  // Of rendering, on one core
+  trace_counters counters;        // Of the sampled pixels
+
+  memory_usage memory;
+  size_t peak_rss;            // So far, plus the pixel buffers to come
+};
+
+// Fills in the sample and everything extrapolated from it. The rest is up
+// to the caller
+cost_estimate estimate_render(scene *, size_t frame_width,
+                              size_t frame_height, render_region,
+                              const render_options &, size_t sample_pixels);
+
+// Setup plus rendering on that many cores, assuming the render scales
+// linearly with them
+estimate_interval estimate_wall_seconds(const cost_estimate &,
+                                        size_t threads);
+
+// Core counts worth listing: powers of two up to max_threads, and
+// max_threads itself
+std::vector<size_t> estimate_thread_counts(size_t max_threads);
+
+// Returns false if the file cannot be written
+bool write_estimate(const std::string &path, const cost_estimate &,
+                    size_t max_threads);
+
+// Readable summary of the estimate, with wall times up to max_threads
+void print_estimate(FILE *, const cost_estimate &, size_t max_threads);
+
+
+#endif
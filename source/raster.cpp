@@ -0,0 +1,170 @@
+#include <cmath>
+#include <cstdint>
+#include <cstdio>
+#include <vector>
+
+#include "common.hpp"
+#include "raster.hpp"
+#include "scene.hpp"
+#include "shading.hpp"
+#include "stats.hpp"
+
+
+static const size_t bin_size = 16;
+
+
+struct raster_object {
+  scene_object *obj;
+  size_t x0, y0, x1, y1;    // Pixels that may see the object, inclusive
+};
+
+struct raster_bins {
+  size_t tiles_x, tiles_y;
+  std::vector<raster_object> objects;
+  std::vector<std::vector<uint32_t>> bins;
+};
+
+
+/* Perspective projection onto the image plane eye + d0 + u*du + v*dv.
+ * Solving p - eye = s * (d0 + u*du + v*dv) for s, s*u and s*v gives the
+ * plane coordinates of p, which is in front of the eye if s > 0 */
+struct projection {
+  vec3f eye;
+  vec3f rows[3];
+};
+
+static bool projection_create(const scene_camera &cam, projection *proj) {
+  vec3f d0 = cam.lower_left - cam.eye;
+  vec3f du = cam.lower_right - cam.lower_left;
+  vec3f dv = cam.upper_left - cam.lower_left;
+
+  vec3f skew = cam.upper_right - cam.lower_left - du - dv;
+  if (magnitude(skew) > 1e-6 * (magnitude(du) + magnitude(dv)))
+    return false;
+
+  rtfloat det = dot(d0, cross(du, dv));
+  if (det == 0) return false;
+
+  proj->eye = cam.eye;
+  proj->rows[0] = cross(du, dv) / det;
+  proj->rows[1] = cross(dv, d0) / det;
+  proj->rows[2] = cross(d0, du) / det;
+  return true;
+}
+
+static bool project(const projection &proj, vec3f p, rtfloat *u, rtfloat *v) {
+  vec3f d = p - proj.eye;
+  rtfloat s = dot(proj.rows[0], d);
+  if (!(s > 1e-9)) return false;
+  *u = dot(proj.rows[1], d) / s;
+  *v = dot(proj.rows[2], d) / s;
+  return true;
+}
+
+
+// Finds the pixels that can see obj. Returns false if there are none
+static bool screen_rect(const projection &proj, scene_object *obj,
+                        size_t width, size_t height, raster_object *ro) {
+  aa_box3f box = bound_transform(obj->bounding_box(),
+                                 obj->transform_ow.matrix);
+
+  rtfloat u0 = rtfloat_inf, v0 = rtfloat_inf;
+  rtfloat u1 = -rtfloat_inf, v1 = -rtfloat_inf;
+  bool whole_screen = false;
+
+  for (int c = 0; c < 8; c++) {
+    vec3f corner = { box.vs[c & 1].x, box.vs[(c >> 1) & 1].y,
+                     box.vs[(c >> 2) & 1].z };
+    rtfloat u, v;
+    if (!project(proj, corner, &u, &v)) {
+      // The box reaches behind the eye, so its projection is unbounded
+      whole_screen = true;
+      break;
+    }
+    u0 = std::min(u0, u);
+    u1 = std::max(u1, u);
+    v0 = std::min(v0, v);
+    v1 = std::max(v1, v);
+  }
+
+  ro->obj = obj;
+  if (whole_screen) {
+    *ro = { obj, 0, 0, width - 1, height - 1 };
+    return true;
+  }
+  if (u1 < 0 || u0 > 1 || v1 < 0 || v0 > 1)
+    return false;
+
+  /* Rows count from the top, the image plane from the bottom. Pad by a
+   * pixel to absorb rounding */
+  rtfloat x0 = std::floor(u0 * width) - 1, x1 = std::ceil(u1 * width) + 1;
+  rtfloat y0 = std::floor((1 - v1) * height) - 1;
+  rtfloat y1 = std::ceil((1 - v0) * height) + 1;
+
+  ro->x0 = (size_t) clamp(x0, (rtfloat) 0, (rtfloat) (width - 1));
+  ro->x1 = (size_t) clamp(x1, (rtfloat) 0, (rtfloat) (width - 1));
+  ro->y0 = (size_t) clamp(y0, (rtfloat) 0, (rtfloat) (height - 1));
+  ro->y1 = (size_t) clamp(y1, (rtfloat) 0, (rtfloat) (height - 1));
+  return true;
+}
+
+
+raster_bins *raster_create(scene *s, const scene_camera &cam, size_t width,
+                          size_t height) {
+  projection proj;
+  if (width == 0 || height == 0 || !projection_create(cam, &proj)) {
+    fprintf(stderr, "Warning: Camera image plane is not a parallelogram, "
+                    "tracing primary rays instead\n");
+    return nullptr;
+  }
+
+  raster_bins *raster = new raster_bins;
+  raster->tiles_x = (width + bin_size - 1) / bin_size;
+  raster->tiles_y = (height + bin_size - 1) / bin_size;
+  raster->bins.resize(raster->tiles_x * raster->tiles_y);
+
+  for (scene_object *obj : s->objects) {
+    raster_object ro;
+    if (!screen_rect(proj, obj, width, height, &ro)) continue;
+
+    uint32_t index = (uint32_t) raster->objects.size();
+    raster->objects.push_back(ro);
+
+    for (size_t ty = ro.y0 / bin_size; ty <= ro.y1 / bin_size; ty++)
+      for (size_t tx = ro.x0 / bin_size; tx <= ro.x1 / bin_size; tx++)
+        raster->bins[ty * raster->tiles_x + tx].push_back(index);
+  }
+
+  return raster;
+}
+
+void raster_destroy(const raster_bins *raster) {
+  delete raster;
+}
+
+
+void raster_primary(const raster_bins *raster, scene *,
+                    const camera_sample *samples, const ray3f *rays,
+                    size_t count, ray_intersection *hits) {
+  trace_counters &counters = thread_counters();
+
+  for (size_t i = 0; i < count; i++) {
+    size_t px = samples[i].px, py = samples[i].py;
+    size_t bin = (py / bin_size) * raster->tiles_x + px / bin_size;
+    rtfloat invmagdir = 1 / magnitude(rays[i].dir);
+    ray_intersection result = no_intersection(nullptr);
+
+    for (uint32_t index : raster->bins[bin]) {
+      const raster_object &ro = raster->objects[index];
+      if (px < ro.x0 || px > ro.x1 || py < ro.y0 || py > ro.y1) continue;
+
+      counters.primitives_tested += 1;
+      ray_intersection inter = object_test(ro.obj, rays[i], invmagdir,
+                                           result.dist);
+      if (inter.dist < result.dist)
+        result = inter;
+    }
+
+    hits[i] = result;
+  }
+}
@@ -0,0 +1,29 @@
+#ifndef _RAYTRACER_RASTER_HPP
+#define _RAYTRACER_RASTER_HPP
+
+
+#include "common.hpp"
+#include "scene.hpp"
+#include "shading.hpp"
+
+
+/* Rasterized primary visibility. Every object's bounding box is projected
+ * onto the image plane and the object is binned into the screen tiles it
+ * covers. A camera ray then only needs to be tested against the objects
+ * binned to its tile whose screen rectangle contains its pixel, keeping
+ * the closest hit as in a depth buffer. Shadow and reflection rays still
+ * go through the object structure */
+
+struct raster_bins;
+
+// Returns null if the camera's image plane is not a parallelogram
+raster_bins *raster_create(scene *, const scene_camera &, size_t width,
+                          size_t height);
+void raster_destroy(const raster_bins *);
+
+void raster_primary(const raster_bins *, scene *,
+                    const camera_sample *samples, const ray3f *rays,
+                    size_t count, ray_intersection *hits);
+
+
+#endif
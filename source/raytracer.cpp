@@ -0,0 +1,102 @@
+#include <cstdio>
+#include <string>
+
+#include "common.hpp"
+#include "framebuffer.hpp"
+#include "light_tree.hpp"
+#include "raytracer.hpp"
+#include "render.hpp"
+#include "scene.hpp"
+#include "shapes.hpp"
+
+
+scene *scene_load(FILE *input, const std::string &filename,
+                  const load_options &opts) {
+  scene *s = scene_create(input, filename);
+  if (s != nullptr)
+    scene_build(s, opts);
+  return s;
+}
+
+void scene_build(scene *s, const load_options &opts) {
+  if (opts.structure == structure_type::bvh)
+    s->obj_structure = object_bound_tree(s);
+  else
+    s->obj_structure = object_list(s);
+
+  if (opts.light_tree)
+    s->light_structure = light_tree_create(s->lights);
+}
+
+structure_update scene_transform_objects(
+    scene *s, const std::vector<scene_object *> &objects,
+    const transform3f &trans) {
+  for (scene_object *obj : objects)
+    if (!obj->apply_affine(trans))
+      obj->transform_ow = trans * obj->transform_ow;
+  return s->obj_structure->update(objects);
+}
+
+scene *scene_load_file(const std::string &path, const load_options &opts) {
+  FILE *input = fopen(path.c_str(), "r");
+  if (input == nullptr) {
+    fprintf(stderr, "Error: Failed to open %s\n", path.c_str());
+    return nullptr;
+  }
+  scene *s = scene_load(input, path, opts);
+  fclose(input);
+  return s;
+}
+
+scene *scene_load_memory(const std::string &contents,
+                         const std::string &filename,
+                         const load_options &opts) {
+  FILE *input = fmemopen((void *) contents.data(), contents.size(), "r");
+  if (input == nullptr) {
+    fprintf(stderr, "Error: Failed to read %s\n", filename.c_str());
+    return nullptr;
+  }
+  scene *s = scene_load(input, filename, opts);
+  fclose(input);
+  return s;
+}
+
+
+
+bool render_job_run(scene *s, const render_job &job, render_stats *stats) {
+  const render_region &r = job.region;
+  if (job.pixels == nullptr || r.x1 > job.width || r.y1 > job.height ||
+      r.x0 >= r.x1 || r.y0 >= r.y1)
+    return false;
+
+  size_t width = r.x1 - r.x0;
+  size_t stride = job.stride > 0 ? job.stride : 3 * width;
+
+  const render_options &opts = job.options;
+  if (opts.progressive || opts.time_budget > 0 || opts.target_noise > 0) {
+    accum_buffer *accum = accum_create(width, r.y1 - r.y0);
+    scene_render_progressive(s, job.width, job.height, r, accum, opts,
+                             stats);
+    for (size_t y = r.y0; y < r.y1; y++) {
+      float *out = job.pixels + (y - r.y0) * stride;
+      for (size_t x = 0; x < width; x++) {
+        color3f c = accum_mean(accum, x, y - r.y0);
+        out[3*x + 0] = (float) c.r;
+        out[3*x + 1] = (float) c.g;
+        out[3*x + 2] = (float) c.b;
+      }
+    }
+    accum_destroy(accum);
+    return opts.cancel == nullptr || !opts.cancel->load();
+  }
+
+  return scene_render_region(s, job.width, job.height, r,
+                             [&](size_t y, const color3f *row) {
+    float *out = job.pixels + (y - r.y0) * stride;
+    for (size_t x = 0; x < width; x++) {
+      out[3*x + 0] = (float) row[x].r;
+      out[3*x + 1] = (float) row[x].g;
+      out[3*x + 2] = (float) row[x].b;
+    }
+  }, job.options, stats);
+}
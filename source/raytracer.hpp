@@ -0,0 +1,63 @@
+#ifndef _RAYTRACER_RAYTRACER_HPP
+#define _RAYTRACER_RAYTRACER_HPP
+
+
+#include <cstdio>
+#include <string>
+#include <vector>
+
+#include "render.hpp"
+#include "scene.hpp"
+
+
+/* Interface for embedding the renderer, built as libraytracer.a. A scene
+ * is loaded once, with its acceleration structures, and then rendered any
+ * number of times. Failures are reported by return value; messages go to
+ * stderr */
+
+
+enum class structure_type {
+  list,     // No spatial partitioning
+  bvh,      // Bounding volume hierarchy
+};
+
+struct load_options {
+  structure_type structure = structure_type::list;
+  bool light_tree = false;  // Needed for render_options::light_samples
+};
+
+// Each returns null if the scene cannot be read. filename is used in
+// messages and to find OBJ files named by the scene
+scene *scene_load(FILE *input, const std::string &filename,
+                  const load_options &);
+scene *scene_load_file(const std::string &path, const load_options &);
+scene *scene_load_memory(const std::string &contents,
+                         const std::string &filename, const load_options &);
+
+// Builds the spatial structures of a scene from scene_create, which
+// scene_load does by itself
+void scene_build(scene *, const load_options &);
+
+// Moves the objects by a transform, after the ones they already have, and
+// brings the spatial structure up to date without building it again
+structure_update scene_transform_objects(
+    scene *, const std::vector<scene_object *> &, const transform3f &);
+
+
+struct render_job {
+  size_t width, height;     // Whole frame
+  render_region region;     // Part to render, { 0, 0, width, height } for all
+  float *pixels;            // RGB for the region, owned by the caller
+  size_t stride;            // Floats from one row to the next, 0 if packed
+  render_options options;   // options.cancel stops the job
+};
+
+// Progressive jobs, and those with a time budget or a noise target, write
+// the mean of the passes they got through. Returns false if the region is
+// invalid or the job was cancelled, in which case some rows of pixels are
+// left unwritten, or progressive pixels hold fewer samples
+bool render_job_run(scene *, const render_job &,
+                    render_stats *stats = nullptr);
+
+
+#endif
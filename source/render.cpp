@@ -1,192 +1,831 @@
+#include <algorithm>
+#include <atomic>
+#include <chrono>
+#include <cmath>
+#include <cstdint>
+#include <vector>
+
 #include "common.hpp"
+#include "framebuffer.hpp"
 #include "image.hpp"
+#include "raster.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
 #include "scene.hpp"
+#include "shading.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+#include "timeline.hpp"
+
 
+static color3f trace_color(const render_context &ctx, ray3f ray,
+                           path_state path);
 
-static color3f trace_color(scene *s, ray3f ray, int bounces);
+
+static color3f compute_shading(const render_context &ctx,
+                               const shading_point &sp, path_state path) {
+  color3f result = {0, 0, 0};
+  trace_counters &counters = thread_counters();
+
+  for_each_light(ctx, sp, &path, [&](const light_eval &e) {
+    result = result + e.ambient;
+    if (!e.direct) return;
+
+    traversal_mark mark = mark_traversal(counters);
+    bool blocked = occluded(ctx.s, e.shadow_ray, e.light_dist);
+    count_rays(&counters.shadow, counters, mark);
+    if (blocked) return;
+
+    result = result + e.diffuse;
+    result = result + e.specular;
+  });
+
+  ray3f ray;
+  rtfloat scale;
+  if (reflect_path(*ctx.opts, sp, &path, &ray, &scale)) {
+    color3f reflection = trace_color(ctx, ray, path);
+    result = result + scale * sp.mat->reflective * reflection;
+  }
+
+  return result;
+}
 
 
-ray_intersection intersection(scene_object *obj, rtfloat dist, vec3f normal) {
-  return {dist, normal, obj};
+static color3f shade_hit(const render_context &ctx, ray3f ray,
+                         const ray_intersection &hit, path_state path) {
+  if (hit.dist < rtfloat_inf)
+    return compute_shading(ctx, make_shading_point(ray, hit), path);
+  else
+    return {0, 0, 0};
 }
 
-ray_intersection no_intersection(scene_object *obj) {
-  return {rtfloat_inf, vec(0,0,0), obj};
+static color3f trace_color(const render_context &ctx, ray3f ray,
+                           path_state path) {
+  trace_counters &counters = thread_counters();
+  traversal_mark mark = mark_traversal(counters);
+  ray_intersection hit = trace_ray(ctx.s, ray);
+  count_rays(&counters.reflection, counters, mark);
+  return shade_hit(ctx, ray, hit, path);
 }
 
 
+void trace_recursive(const render_context &ctx, const camera_sample *samples,
+                     size_t count, color3f *results, pixel_aov *aovs) {
+  std::vector<ray3f> rays(count);
+  std::vector<ray_intersection> hits(count);
+  std::vector<uint64_t> cost(aovs != nullptr ? count : 0);
+  trace_primary(ctx, samples, count, rays.data(), hits.data(),
+                aovs != nullptr ? cost.data() : nullptr);
+  if (aovs != nullptr)
+    primary_aovs(rays.data(), hits.data(), count, aovs);
+
+  trace_counters &counters = thread_counters();
+  for (size_t i = 0; i < count; i++) {
+    uint64_t steps = traversal_steps(counters);
+    path_state path = initial_path(*ctx.opts, samples[i]);
+    results[i] = shade_hit(ctx, rays[i], hits[i], path);
+    if (aovs != nullptr)
+      aovs[i].cost = (rtfloat) (cost[i] + traversal_steps(counters) - steps);
+  }
+}
 
-static ray_intersection trace_ray(scene *s, ray3f ray) {
-  rtfloat invmagdir = 1 / magnitude(ray.dir);
-  ray_intersection result = no_intersection(nullptr);
 
-  flat_list<scene_object *> cands = s->obj_structure->candidates(ray);
-  for (scene_object *obj : cands) {
-    ray_intersection inter = no_intersection(obj);
+// AOVs are only filled in if aovs is not null
+static void trace_samples(const render_context &ctx,
+                          const std::vector<camera_sample> &samples,
+                          std::vector<color3f> *results,
+                          std::vector<pixel_aov> *aovs = nullptr) {
+  results->resize(samples.size());
+  pixel_aov *aov_data = nullptr;
+  if (aovs != nullptr) {
+    aovs->resize(samples.size());
+    aov_data = aovs->data();
+  }
 
-    if (obj->transform_ow.identity) {
-      inter = obj->ray_test(ray);
+  if (ctx.opts->engine == render_engine::wavefront)
+    trace_wavefront(ctx, samples.data(), samples.size(), results->data(),
+                    aov_data);
+  else
+    trace_recursive(ctx, samples.data(), samples.size(), results->data(),
+                    aov_data);
+}
 
-    } else {
-      ray3f oray = inv(obj->transform_ow) * ray;
-      ray_intersection ointer = obj->ray_test(oray);
-      vec3f nodir = ointer.dist * oray.dir;
-      vec3f nwdir = project(obj->transform_ow * hvec(nodir));
-      inter.dist = magnitude(nwdir) * invmagdir;
-
-      if (inter.dist < result.dist)
-        inter.normal = trans_normal(obj->transform_ow, ointer.normal);
+
+/* The AOVs of a pixel from those of its samples. Depth is the nearest hit
+ * and the object the one covering the most samples, since averages of
+ * either would be meaningless at edges */
+static pixel_aov resolve_aovs(const pixel_aov *samples, size_t count) {
+  pixel_aov result = { rtfloat_inf, {0, 0, 0}, {0, 0, 0}, 0, 0, -1, 0 };
+  size_t best = 0;
+  for (size_t k = 0; k < count; k++) {
+    const pixel_aov &a = samples[k];
+    result.depth = std::min(result.depth, a.depth);
+    result.normal = result.normal + a.normal / count;
+    result.albedo = result.albedo + a.albedo / count;
+    result.cost += a.cost / count;
+
+    size_t covered = 0;
+    for (size_t j = 0; j < count; j++)
+      covered += samples[j].object == a.object;
+    if (covered > best) {
+      best = covered;
+      result.object = a.object;
     }
+  }
+  result.coverage = (rtfloat) best / count;
+  return result;
+}
+
+
+static render_context context_create(scene *s, const render_options &opts,
+                                     size_t width, size_t height,
+                                     const scene_camera *camera = nullptr) {
+  render_context ctx;
+  ctx.s = s;
+  ctx.opts = &opts;
+  ctx.sampler = sampler_create(opts.sampler, opts.seed);
+  ctx.width = width;
+  ctx.height = height;
+  ctx.camera = camera != nullptr ? camera :
+               opts.camera != nullptr ? opts.camera : &s->camera;
+  ctx.raster = nullptr;
+  if (opts.raster_primary && opts.raster != nullptr && camera == nullptr)
+    ctx.raster = opts.raster;
+  else if (opts.raster_primary)
+    ctx.raster = raster_create(s, *ctx.camera, width, height);
+  return ctx;
+}
+
+static void context_destroy(render_context *ctx) {
+  delete ctx->sampler;
+  if (ctx->raster != ctx->opts->raster)
+    raster_destroy(ctx->raster);
+}
+
+
+// Variance of the mean of count samples from the sums of their luminance and
+// its square, or -1 if count < 2
+static rtfloat mean_variance(rtfloat lum_sum, rtfloat lum_sq_sum,
+                             size_t count) {
+  if (count < 2) return -1;
+  rtfloat mean = lum_sum / count;
+  rtfloat var = (lum_sq_sum - count * mean * mean) / (count - 1);
+  return std::max(var, (rtfloat) 0) / count;
+}
+
 
-    if (inter.dist < result.dist)
-      result = inter;
+// Renders the pixels in [x0, x1) x [y0, y1) to out, whose rows are stride
+// pixels apart, and their AOVs to aov_out, with rows aov_stride apart, if
+// it is not null
+static void render_tile(const render_context &ctx, size_t x0, size_t y0,
+                        size_t x1, size_t y1, color3f *out, size_t stride,
+                        pixel_aov *aov_out = nullptr, size_t aov_stride = 0) {
+  size_t count = samples_per_pixel(*ctx.opts);
+
+  std::vector<camera_sample> samples;
+  samples.reserve((x1 - x0) * (y1 - y0) * count);
+  for (size_t y = y0; y < y1; y++)
+    for (size_t x = x0; x < x1; x++)
+      for (size_t k = 0; k < count; k++)
+        samples.push_back({x, y, k, count});
+
+  std::vector<color3f> results;
+  std::vector<pixel_aov> aovs;
+  trace_samples(ctx, samples, &results, aov_out ? &aovs : nullptr);
+
+  size_t i = 0;
+  for (size_t y = y0; y < y1; y++) {
+    for (size_t x = x0; x < x1; x++) {
+      if (aov_out != nullptr) {
+        rtfloat lum_sum = 0, lum_sq_sum = 0;
+        for (size_t k = 0; k < count; k++) {
+          rtfloat lum = luminance(results[i + k]);
+          lum_sum += lum;
+          lum_sq_sum += lum * lum;
+        }
+        pixel_aov &aov = aov_out[(y - y0)*aov_stride + (x - x0)];
+        aov = resolve_aovs(&aovs[i], count);
+        aov.variance = mean_variance(lum_sum, lum_sq_sum, count);
+      }
+
+      color3f result = {0, 0, 0};
+      for (size_t k = 0; k < count; k++)
+        result = result + results[i++] / count;
+      out[(y - y0)*stride + (x - x0)] = result;
+    }
   }
+}
 
-  return result;
+
+
+/* Adaptive sampling. Every pixel gets an initial batch of samples, then
+ * pixels whose estimated error is above the threshold (and their neighbors,
+ * since a small batch can miss an edge entirely) get more batches until the
+ * error drops or the sample limit is reached */
+
+struct pixel_estimate {
+  color3f sum;
+  rtfloat lum_sum;
+  rtfloat lum_sq_sum;
+  size_t count;
 };
 
+// Bytes of the estimates render_adaptive keeps for a region
+static size_t adaptive_memory(size_t width, size_t height) {
+  return (width + 2) * (height + 2) * (sizeof(pixel_estimate) + 1);
+}
 
-static color3f compute_shading(scene *s, scene_object *obj, vec3f point, 
-                                vec3f normal, vec3f eye, int bounces) {
-  static const rtfloat bounce_delt = 0.001;
+static rtfloat estimate_error(const pixel_estimate &e) {
+  if (e.count < 2) return rtfloat_inf;
+  return std::sqrt(mean_variance(e.lum_sum, e.lum_sq_sum, e.count));
+}
 
-  color3f result = {0, 0, 0};
-  color3f ka = obj->material.ambient;
-  color3f kd = obj->material.diffuse;
-  color3f ks = obj->material.specular;
-  rtfloat sp = obj->material.specular_power;
-  color3f kr = obj->material.reflective;
-
-  vec3f eye_dir = normalize(eye - point);
-  if (dot(normal, eye_dir) < 0) normal = -normal;
-
-
-  for (light_source light : s->lights) {
-    vec3f light_dir;
-    rtfloat light_dist = 0;
-    rtfloat falloff_factor = 1;
-    if (light.type == light_type::directional) {
-      light_dir = -light.dir;
-      light_dist = rtfloat_inf;
-    } else if (light.type == light_type::point) {
-      light_dir = normalize(light.pos - point);
-      light_dist = magnitude(light.pos - point);
-      falloff_factor = 1/std::pow(light_dist, light.falloff);
+// The AOVs of the new samples go to aov if it is not null
+static void add_samples(const render_context &ctx, size_t px, size_t py,
+                        size_t num, pixel_estimate *e,
+                        pixel_aov *aov = nullptr) {
+  const render_options &opts = *ctx.opts;
+  size_t end = std::min(e->count + num, opts.max_samples);
+
+  std::vector<camera_sample> samples;
+  for (size_t k = e->count; k < end; k++)
+    samples.push_back({px, py, k, opts.max_samples});
+
+  std::vector<color3f> results;
+  std::vector<pixel_aov> aovs;
+  trace_samples(ctx, samples, &results, aov ? &aovs : nullptr);
+  if (aov != nullptr)
+    *aov = resolve_aovs(aovs.data(), aovs.size());
+
+  for (color3f c : results) {
+    rtfloat lum = luminance(c);
+    e->sum = e->sum + c;
+    e->lum_sum += lum;
+    e->lum_sq_sum += lum * lum;
+  }
+  e->count = std::max(e->count, end);
+}
+
+
+static bool cancelled(const render_options &opts) {
+  return opts.cancel != nullptr && opts.cancel->load();
+}
+
+
+// Runs f(row) for each row, over the pool or on this thread if it is null
+template <typename F>
+static void for_rows(thread_pool *pool, size_t rows, F f) {
+  if (pool == nullptr) {
+    for (size_t y = 0; y < rows; y++) f(y);
+  } else {
+    parallel_for(pool, rows, [&](size_t y, size_t) { f(y); });
+  }
+}
+
+
+/* Leaves the mean of every pixel in the region in image, in row order, and
+ * the AOVs from the initial batch in aovs if it is not null */
+static bool render_adaptive(const render_context &ctx, thread_pool *pool,
+                            render_region region, std::vector<color3f> *image,
+                            std::vector<pixel_aov> *aovs,
+                            render_stats *stats) {
+  const render_options &opts = *ctx.opts;
+  size_t batch = std::max(opts.min_samples, (size_t) 1);
+
+  /* Pixels just outside the region can mark pixels inside it, so they are
+   * estimated too, and the region renders as in a full frame */
+  size_t x0 = region.x0 > 0 ? region.x0 - 1 : 0;
+  size_t y0 = region.y0 > 0 ? region.y0 - 1 : 0;
+  size_t x1 = std::min(region.x1 + 1, ctx.width);
+  size_t y1 = std::min(region.y1 + 1, ctx.height);
+  size_t width = x1 - x0;
+  size_t height = y1 - y0;
+  std::vector<pixel_estimate> est(width * height, {{0, 0, 0}, 0, 0, 0});
+  std::vector<char> refine(width * height, 0);
+
+  /* Initial batch everywhere */
+  size_t rx = region.x0 - x0, ry = region.y0 - y0;
+  size_t region_width = region.x1 - region.x0;
+  size_t region_height = region.y1 - region.y0;
+  if (aovs != nullptr)
+    aovs->resize(region_width * region_height);
+
+  for_rows(pool, height, [&](size_t y) {
+    if (cancelled(opts)) return;
+    timeline_scope scope("estimate row", "render", x0, y0 + y);
+    for (size_t x = 0; x < width; x++) {
+      bool inside = aovs != nullptr && x >= rx && x - rx < region_width &&
+                    y >= ry && y - ry < region_height;
+      add_samples(ctx, x0 + x, y0 + y, batch, &est[y*width + x],
+                  inside ? &(*aovs)[(y - ry)*region_width + x - rx] : nullptr);
     }
-    
-    /* Ambient shading */
-    result = result + falloff_factor * ka * light.color;
-
-    /* Shadow test */
-    if (light.type != light_type::ambient) {
-      ray3f ray = { point + bounce_delt * light_dir, light_dir };
-      ray_intersection hit = trace_ray(s, ray);
-      if (hit.dist < light_dist)
+  });
+  if (cancelled(opts)) return false;
+
+  /* Mark noisy pixels and their neighbors */
+  for (size_t y = 0; y < height; y++) {
+    for (size_t x = 0; x < width; x++) {
+      if (estimate_error(est[y*width + x]) <= opts.adaptive_threshold)
         continue;
+      for (size_t ny = (y > 0 ? y-1 : y); ny <= y+1 && ny < height; ny++)
+        for (size_t nx = (x > 0 ? x-1 : x); nx <= x+1 && nx < width; nx++)
+          refine[ny*width + nx] = 1;
     }
+  }
 
-    /* Diffuse shading */
-    if (light.type != light_type::ambient) {
-      rtfloat diff_factor = std::max(dot(light_dir, normal), (rtfloat) 0);
-      result = result + falloff_factor * diff_factor * kd * light.color;
+  /* Refine */
+  for_rows(pool, region_height, [&](size_t y) {
+    if (cancelled(opts)) return;
+    timeline_scope scope("refine row", "render", region.x0, region.y0 + y);
+    for (size_t x = 0; x < region_width; x++) {
+      size_t i = (ry + y)*width + rx + x;
+      if (!refine[i]) continue;
+      do {
+        add_samples(ctx, region.x0 + x, region.y0 + y, batch, &est[i]);
+      } while (est[i].count < opts.max_samples &&
+               estimate_error(est[i]) > opts.adaptive_threshold);
+    }
+  });
+  if (cancelled(opts)) return false;
+
+  image->resize(region_width * region_height);
+  for (size_t y = 0; y < region_height; y++) {
+    for (size_t x = 0; x < region_width; x++) {
+      const pixel_estimate &e = est[(ry + y)*width + rx + x];
+      (*image)[y*region_width + x] = e.sum / e.count;
+      if (aovs != nullptr)
+        (*aovs)[y*region_width + x].variance =
+            mean_variance(e.lum_sum, e.lum_sq_sum, e.count);
+      if (stats != nullptr) stats->samples += e.count;
     }
+  }
+  return true;
+}
+
+
 
-    /* Specular shading */
-    if (light.type != light_type::ambient) {
-      vec3f light_refl = -light_dir + 2*dot(normal, light_dir) * normal;
-      rtfloat spec_factor = std::max(dot(light_refl, eye_dir), (rtfloat) 0);
-      spec_factor = std::pow(spec_factor, sp);
-      result = result + falloff_factor * spec_factor * ks * light.color;
+/* Progressive rendering. Passes of one sample per pixel are accumulated
+ * until the sample limit, the time budget or the noise target is reached,
+ * or the render is cancelled. A pass that runs into the deadline stops
+ * early, so some pixels end up with one sample fewer than others */
+
+static const size_t progressive_chunk = 16;
+
+static size_t progressive_limit(const render_options &opts) {
+  bool budgeted = opts.time_budget > 0 || opts.target_noise > 0;
+  if (budgeted && opts.sample_count == 0 && opts.sample_freq == 0)
+    return SIZE_MAX;
+  return samples_per_pixel(opts);
+}
+
+
+void scene_render_progressive(scene *s, accum_buffer *accum,
+                              const render_options &opts,
+                              render_stats *stats) {
+  render_region frame = { 0, 0, accum->width, accum->height };
+  scene_render_progressive(s, accum->width, accum->height, frame, accum,
+                           opts, stats);
+}
+
+void scene_render_progressive(scene *s, size_t frame_width,
+                              size_t frame_height, render_region region,
+                              accum_buffer *accum, const render_options &opts,
+                              render_stats *stats) {
+  typedef std::chrono::steady_clock clock;
+  typedef std::chrono::duration<double> seconds;
+
+  thread_pool *pool = opts.pool;
+  if (pool == nullptr)
+    pool = thread_pool_create(opts.num_threads);
+  size_t width = accum->width;
+  size_t height = accum->height;
+  render_context ctx = context_create(s, opts, frame_width, frame_height);
+  size_t limit = progressive_limit(opts);
+
+  // A resumed buffer already holds the first passes
+  size_t first = accum->count.empty() ? 0 :
+      *std::min_element(accum->count.begin(), accum->count.end());
+
+  bool timed = opts.time_budget > 0;
+  clock::time_point deadline = clock::now() +
+      std::chrono::duration_cast<clock::duration>(seconds(opts.time_budget));
+  clock::duration reserve = clock::duration::zero();
+  size_t passes = 0;
+
+  for (size_t pass = first; pass < limit; pass++) {
+    timeline_scope scope("pass", "render");
+    std::atomic<bool> expired(false);
+
+    parallel_for(pool, height, [&](size_t y, size_t) {
+      std::vector<camera_sample> samples;
+      std::vector<color3f> results;
+
+      // Check the deadline every few pixels
+      for (size_t x0 = 0; x0 < width; x0 += progressive_chunk) {
+        if ((timed && clock::now() + reserve >= deadline) ||
+            cancelled(opts)) {
+          expired = true;
+          return;
+        }
+
+        // Without a sample limit, each sample is the last one so far
+        size_t x1 = std::min(x0 + progressive_chunk, width);
+        samples.clear();
+        for (size_t x = x0; x < x1; x++) {
+          size_t index = accum->count[y*width + x];
+          samples.push_back({region.x0 + x, region.y0 + y, index,
+                             limit == SIZE_MAX ? index + 1 : limit});
+        }
+
+        trace_samples(ctx, samples, &results);
+        for (size_t x = x0; x < x1; x++)
+          accum_add(accum, x, y, results[x - x0]);
+      }
+    });
+    passes += 1;
+
+    // Leave room for writing the image once the deadline is near
+    if (opts.pass_done) {
+      clock::time_point write_start = clock::now();
+      opts.pass_done(accum);
+      reserve = std::max(reserve, clock::now() - write_start);
     }
+
+    if (expired || (timed && clock::now() + reserve >= deadline))
+      break;
+    if (opts.target_noise > 0 && accum_noise(accum) <= opts.target_noise)
+      break;
   }
 
-  /* Reflection */
-  if (bounces > 0 && (kr.r != 0 || kr.g != 0 || kr.b != 0)) {
-    vec3f refl_dir = -eye_dir + 2*dot(normal, eye_dir) * normal;
-    ray3f ray = { point + bounce_delt * refl_dir, refl_dir };
-    color3f reflection = trace_color(s, ray, bounces-1);
-    result = result + kr * reflection;
+  if (stats != nullptr) {
+    *stats = { width * height, 0, passes, accum_memory(accum) };
+    for (uint32_t n : accum->count)
+      stats->samples += n;
   }
 
-  return result;
+  context_destroy(&ctx);
+  if (opts.pool == nullptr)
+    thread_pool_destroy(pool);
 }
 
 
-static color3f trace_color(scene *s, ray3f ray, int bounces) {
-  ray_intersection hit = trace_ray(s, ray);
 
-  if (hit.dist < rtfloat_inf) {
-    vec3f point = ray.start + hit.dist * ray.dir;
-    return compute_shading(s, hit.obj, point, hit.normal, ray.start, bounces);
+size_t samples_per_pixel(const render_options &opts) {
+  if (opts.sample_count > 0) return opts.sample_count;
+  if (opts.sample_freq > 0) return opts.sample_freq * opts.sample_freq;
+  return 1;
+}
 
-  } else {
-    return {0, 0, 0};
+
+static const size_t tile_size = 16;
+
+
+// Rows of tiles render_rows renders at once, enough to keep every thread
+// busy
+static size_t band_rows(size_t width, size_t threads) {
+  size_t tiles_x = (width + tile_size - 1) / tile_size;
+  return (4 * threads + tiles_x - 1) / tiles_x * tile_size;
+}
+
+static size_t rows_buffer_bytes(const render_options &opts, size_t width,
+                                size_t threads) {
+  size_t band = band_rows(width, threads);
+  size_t bytes = band * width * sizeof(color3f);
+  if (opts.adaptive)
+    bytes += adaptive_memory(width, band);
+  if (opts.aov_done)
+    bytes += (opts.adaptive ? band * width :
+              threads * tile_size * tile_size) * sizeof(pixel_aov);
+  return bytes;
+}
+
+
+/* Renders the region and hands its rows to row_done in order. Returns false
+ * if the render was cancelled */
+static bool render_rows(const render_context &ctx, thread_pool *pool,
+                        render_region region, const row_callback &row_done,
+                        render_stats *stats) {
+  const render_options &opts = *ctx.opts;
+  size_t width = region.x1 - region.x0;
+
+  /* Render bands of tiles in parallel, then pass them on in order */
+  size_t tiles_x = (width + tile_size - 1) / tile_size;
+  size_t band = band_rows(width, thread_count(pool));
+  std::vector<color3f> buffer(band * width);
+  std::vector<pixel_aov> aovs;
+
+  if (stats != nullptr)
+    stats->buffer_bytes = rows_buffer_bytes(opts, width, thread_count(pool));
+
+  for (size_t y0 = region.y0; y0 < region.y1; y0 += band) {
+    size_t rows = std::min(band, region.y1 - y0);
+
+    if (opts.adaptive) {
+      render_region part = { region.x0, y0, region.x1, y0 + rows };
+      if (!render_adaptive(ctx, pool, part, &buffer,
+                           opts.aov_done ? &aovs : nullptr, stats))
+        return false;
+      if (opts.aov_done)
+        opts.aov_done(part, aovs.data());
+      timeline_scope scope("write rows", "output", region.x0, y0);
+      for (size_t y = 0; y < rows; y++)
+        row_done(y0 + y, &buffer[y*width]);
+      continue;
+    }
+
+    size_t tiles_y = (rows + tile_size - 1) / tile_size;
+
+    parallel_for(pool, tiles_x * tiles_y, [&](size_t t, size_t) {
+      if (cancelled(opts)) return;
+      size_t tx = (t % tiles_x) * tile_size;
+      size_t ty = (t / tiles_x) * tile_size;
+      render_region tile = { region.x0 + tx, y0 + ty,
+                             region.x0 + std::min(tx + tile_size, width),
+                             y0 + std::min(ty + tile_size, rows) };
+      timeline_scope scope("tile", "render", tile.x0, tile.y0);
+
+      if (!opts.aov_done) {
+        render_tile(ctx, tile.x0, tile.y0, tile.x1, tile.y1,
+                    &buffer[ty*width + tx], width);
+        return;
+      }
+      std::vector<pixel_aov> tile_aovs((tile.x1 - tile.x0) *
+                                       (tile.y1 - tile.y0));
+      render_tile(ctx, tile.x0, tile.y0, tile.x1, tile.y1,
+                  &buffer[ty*width + tx], width, tile_aovs.data(),
+                  tile.x1 - tile.x0);
+      opts.aov_done(tile, tile_aovs.data());
+    });
+    if (cancelled(opts)) return false;
+
+    timeline_scope scope("write rows", "output", region.x0, y0);
+    for (size_t y = 0; y < rows; y++)
+      row_done(y0 + y, &buffer[y*width]);
+    if (stats != nullptr)
+      stats->samples += rows * width * samples_per_pixel(opts);
   }
+  return true;
 }
 
 
-template <typename T, typename S>
-static inline T bilin(T ll, T lr, T ul, T ur, S u, S v) {
-  T p0 = (1 - u)*ll + u*lr;
-  T p1 = (1 - u)*ul + u*ur;
-  return (1 - v)*p0 + v*p1;
+bool scene_render_region(scene *s, size_t width, size_t height,
+                         render_region region, const row_callback &row_done,
+                         const render_options &opts, render_stats *stats) {
+  if (stats != nullptr)
+    *stats = { 0, 0, 1, 0 };
+  if (region.x1 > width || region.y1 > height ||
+      region.x0 >= region.x1 || region.y0 >= region.y1)
+    return true;
+
+  thread_pool *pool = opts.pool;
+  if (pool == nullptr)
+    pool = thread_pool_create(opts.num_threads);
+  render_context ctx = context_create(s, opts, width, height);
+  if (stats != nullptr)
+    stats->pixels = (region.x1 - region.x0) * (region.y1 - region.y0);
+
+  bool finished = render_rows(ctx, pool, region, row_done, stats);
+
+  context_destroy(&ctx);
+  if (opts.pool == nullptr)
+    thread_pool_destroy(pool);
+  return finished;
 }
 
 
-static color3f sample_color(scene *s, vec3f ll, vec3f lr, vec3f ul, vec3f ur, 
-                            vec3f eye, int grid_size, int bounces) {
-  bool jitter = grid_size > 0;
-  if (grid_size <= 0) grid_size = 1;
+/* Tiles in any order. Each task renders a whole tile, so adaptive tiles
+ * are larger to keep the border estimated around each one cheap */
 
-  color3f result = {0, 0, 0};
+static const size_t adaptive_tile_size = 64;
 
-  for (int i = 0; i < grid_size; i++) {
-    for (int j = 0; j < grid_size; j++) {
-      rtfloat u = (j + 0.5) / grid_size;
-      rtfloat v = (i + 0.5) / grid_size;
+// Each thread holds one tile at a time
+static size_t tiles_buffer_bytes(const render_options &opts, size_t width,
+                                 size_t height, size_t threads) {
+  size_t size = opts.adaptive ? adaptive_tile_size : tile_size;
+  size_t tiles = ((width + size - 1) / size) * ((height + size - 1) / size);
+  size_t tile_bytes = size * size * sizeof(color3f);
+  if (opts.adaptive)
+    tile_bytes += adaptive_memory(size, size);
+  if (opts.aov_done)
+    tile_bytes += size * size * sizeof(pixel_aov);
+  return std::min(threads, tiles) * tile_bytes;
+}
 
-      if (jitter) {
-        u += ((rtfloat) rand() / RAND_MAX) / (2 * grid_size);
-        v += ((rtfloat) rand() / RAND_MAX) / (2 * grid_size);
-      }
-      
-      vec3f p = bilin(ll, lr, ul, ur, u, v);
-      ray3f ray = { eye, p - eye };
-      result = result + trace_color(s, ray, bounces) / (grid_size * grid_size);
+// Renders the tile and hands it to tile_done, and its AOVs to
+// opts.aov_done. Returns the samples taken, or 0 if it was cancelled
+static uint64_t render_whole_tile(const render_context &ctx,
+                                  render_region tile,
+                                  const tile_callback &tile_done) {
+  const render_options &opts = *ctx.opts;
+  timeline_scope scope("tile", "render", tile.x0, tile.y0);
+  size_t pixels = (tile.x1 - tile.x0) * (tile.y1 - tile.y0);
+  std::vector<color3f> buffer(pixels);
+  std::vector<pixel_aov> aovs(opts.aov_done ? pixels : 0);
+  uint64_t samples;
+
+  if (opts.adaptive) {
+    render_stats tile_stats = { 0, 0, 0, 0 };
+    if (!render_adaptive(ctx, nullptr, tile, &buffer,
+                         opts.aov_done ? &aovs : nullptr, &tile_stats))
+      return 0;
+    samples = tile_stats.samples;
+  } else {
+    render_tile(ctx, tile.x0, tile.y0, tile.x1, tile.y1, buffer.data(),
+                tile.x1 - tile.x0, opts.aov_done ? aovs.data() : nullptr,
+                tile.x1 - tile.x0);
+    samples = pixels * samples_per_pixel(opts);
+  }
+  timeline_scope output("write tile", "output", tile.x0, tile.y0);
+  tile_done(tile, buffer.data());
+  if (opts.aov_done)
+    opts.aov_done(tile, aovs.data());
+  return samples;
+}
+
+bool scene_render_tiles(scene *s, size_t width, size_t height,
+                        render_region region, const tile_callback &tile_done,
+                        const render_options &opts, render_stats *stats) {
+  if (stats != nullptr)
+    *stats = { 0, 0, 1, 0 };
+  if (region.x1 > width || region.y1 > height ||
+      region.x0 >= region.x1 || region.y0 >= region.y1)
+    return true;
+
+  thread_pool *pool = opts.pool;
+  if (pool == nullptr)
+    pool = thread_pool_create(opts.num_threads);
+  render_context ctx = context_create(s, opts, width, height);
+
+  size_t size = opts.adaptive ? adaptive_tile_size : tile_size;
+  size_t tiles_x = (region.x1 - region.x0 + size - 1) / size;
+  size_t tiles_y = (region.y1 - region.y0 + size - 1) / size;
+  std::atomic<uint64_t> samples(0);
+
+  parallel_for(pool, tiles_x * tiles_y, [&](size_t t, size_t) {
+    if (cancelled(opts)) return;
+    size_t x0 = region.x0 + (t % tiles_x) * size;
+    size_t y0 = region.y0 + (t / tiles_x) * size;
+    render_region tile = { x0, y0, std::min(x0 + size, region.x1),
+                           std::min(y0 + size, region.y1) };
+    samples += render_whole_tile(ctx, tile, tile_done);
+  });
+
+  if (stats != nullptr) {
+    stats->pixels = (region.x1 - region.x0) * (region.y1 - region.y0);
+    stats->samples = samples;
+    stats->buffer_bytes = tiles_buffer_bytes(opts, region.x1 - region.x0,
+                                             region.y1 - region.y0,
+                                             thread_count(pool));
+  }
+
+  context_destroy(&ctx);
+  if (opts.pool == nullptr)
+    thread_pool_destroy(pool);
+  return !cancelled(opts);
+}
+
+
+bool scene_render_frames(scene *s, const std::vector<render_frame> &frames,
+                         const render_options &opts, render_stats *stats) {
+  if (stats != nullptr)
+    *stats = { 0, 0, 1, 0 };
+
+  thread_pool *pool = opts.pool;
+  if (pool == nullptr)
+    pool = thread_pool_create(opts.num_threads);
+  size_t size = opts.adaptive ? adaptive_tile_size : tile_size;
+
+  /* Frame f owns tiles [first[f], first[f+1]) of the queue */
+  std::vector<render_context> contexts;
+  std::vector<size_t> first(1, 0);
+  std::vector<size_t> tiles_x;
+  for (const render_frame &frame : frames) {
+    const render_region &r = frame.region;
+    bool empty = r.x1 > frame.width || r.y1 > frame.height ||
+                 r.x0 >= r.x1 || r.y0 >= r.y1;
+    size_t across = empty ? 0 : (r.x1 - r.x0 + size - 1) / size;
+    size_t down = empty ? 0 : (r.y1 - r.y0 + size - 1) / size;
+    contexts.push_back(context_create(s, opts, frame.width, frame.height,
+                                      &frame.camera));
+    tiles_x.push_back(across);
+    first.push_back(first.back() + across * down);
+
+    if (stats != nullptr && !empty) {
+      stats->pixels += (r.x1 - r.x0) * (r.y1 - r.y0);
+      stats->buffer_bytes = std::max(stats->buffer_bytes,
+          tiles_buffer_bytes(opts, r.x1 - r.x0, r.y1 - r.y0,
+                             thread_count(pool)));
     }
   }
 
-  return result;
+  std::vector<std::atomic<size_t>> left(frames.size());
+  for (size_t f = 0; f < frames.size(); f++) {
+    left[f] = first[f + 1] - first[f];
+    if (left[f] == 0 && frames[f].frame_done)
+      frames[f].frame_done();
+  }
+  std::atomic<uint64_t> samples(0);
+
+  parallel_for(pool, first.back(), [&](size_t t, size_t) {
+    if (cancelled(opts)) return;
+    size_t f = std::upper_bound(first.begin(), first.end(), t) -
+               first.begin() - 1;
+    const render_frame &frame = frames[f];
+    size_t i = t - first[f];
+    size_t x0 = frame.region.x0 + (i % tiles_x[f]) * size;
+    size_t y0 = frame.region.y0 + (i / tiles_x[f]) * size;
+    render_region tile = { x0, y0, std::min(x0 + size, frame.region.x1),
+                           std::min(y0 + size, frame.region.y1) };
+    samples += render_whole_tile(contexts[f], tile, frame.tile_done);
+
+    if (--left[f] == 0 && frame.frame_done && !cancelled(opts))
+      frame.frame_done();
+  });
+
+  if (stats != nullptr)
+    stats->samples = samples;
+  for (render_context &ctx : contexts)
+    context_destroy(&ctx);
+  if (opts.pool == nullptr)
+    thread_pool_destroy(pool);
+  return !cancelled(opts);
 }
 
+void scene_render(scene *s, image_ostream *stream,
+                  const render_options &opts, render_stats *stats) {
+  size_t width = stream->width;
+  size_t height = stream->height;
+  render_region rest = { 0, stream->cur_row, width, height };
+
+  scene_render_region(s, width, height, rest,
+                      [&](size_t, const color3f *row) {
+    for (size_t x = 0; x < width; x++)
+      stream << row[x];
+  }, opts, stats);
+}
 
-void scene_render(scene *s, image_ostream *stream, int sample_freq) {
-  vec3f ll = s->camera.lower_left;
-  vec3f lr = s->camera.lower_right;
-  vec3f ul = s->camera.upper_left;
-  vec3f ur = s->camera.upper_right;
 
-  while (!done(stream)) {
-    size_t i = stream->cur_row;
-    size_t j = stream->cur_col;
+size_t render_buffer_bytes(const render_options &opts, size_t width,
+                           size_t height, size_t threads, bool tiles) {
+  if (opts.progressive)
+    return sizeof(accum_buffer) +
+           width * height * (4 * sizeof(float) + sizeof(uint32_t));
+  if (tiles)
+    return tiles_buffer_bytes(opts, width, height, threads);
+  return rows_buffer_bytes(opts, width, threads);
+}
+
 
-    size_t i0 = stream->height - 1 - i;
-    size_t j0 = j;
-    size_t i1 = i0 + 1;
-    size_t j1 = j0 + 1;
 
-    rtfloat u0 = (rtfloat) j0 / stream->width;
-    rtfloat v0 = (rtfloat) i0 / stream->height;
-    rtfloat u1 = (rtfloat) j1 / stream->width;
-    rtfloat v1 = (rtfloat) i1 / stream->height;
-  
-    vec3f pll = bilin(ll, lr, ul, ur, u0, v0);
-    vec3f plr = bilin(ll, lr, ul, ur, u1, v0);
-    vec3f pul = bilin(ll, lr, ul, ur, u0, v1);
-    vec3f pur = bilin(ll, lr, ul, ur, u1, v1);
+/* Cost measurement. The time and rays of a region are the differences of
+ * the clock and of this thread's counters over its render */
 
-    // TODO: Pick bounce constant better
-    stream << sample_color(s, pll, plr, pul, pur, s->camera.eye, 
-                            sample_freq, 5);
+static ray_counts counts_since(const ray_counts &now,
+                               const ray_counts &before) {
+  return { now.rays - before.rays, now.nodes - before.nodes,
+           now.primitives - before.primitives };
+}
+
+void scene_measure_regions(scene *s, size_t width, size_t height,
+                           std::vector<region_cost> *regions,
+                           const render_options &opts) {
+  typedef std::chrono::steady_clock clock;
+
+  render_context ctx = context_create(s, opts, width, height);
+  trace_counters &counters = thread_counters();
+  size_t count = samples_per_pixel(opts);
+  size_t batch = std::max(opts.min_samples, (size_t) 1);
+  std::vector<color3f> colors;
+
+  for (region_cost &p : *regions) {
+    render_region r = p.region;
+    size_t pixels = (r.x1 - r.x0) * (r.y1 - r.y0);
+    trace_counters before = counters;
+    clock::time_point start = clock::now();
+
+    if (opts.adaptive) {
+      p.samples = 0;
+      for (size_t y = r.y0; y < r.y1; y++) {
+        for (size_t x = r.x0; x < r.x1; x++) {
+          pixel_estimate e = { {0, 0, 0}, 0, 0, 0 };
+          do {
+            add_samples(ctx, x, y, batch, &e);
+          } while (e.count < opts.max_samples &&
+                   estimate_error(e) > opts.adaptive_threshold);
+          p.samples += e.count;
+        }
+      }
+    } else {
+      colors.resize(pixels);
+      render_tile(ctx, r.x0, r.y0, r.x1, r.y1, colors.data(), r.x1 - r.x0);
+      p.samples = pixels * count;
+    }
+
+    p.seconds = std::chrono::duration<double>(clock::now() - start).count();
+    p.primary = counts_since(counters.primary, before.primary);
+    p.shadow = counts_since(counters.shadow, before.shadow);
+    p.reflection = counts_since(counters.reflection, before.reflection);
   }
+
+  context_destroy(&ctx);
 }
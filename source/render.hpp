@@ -0,0 +1,178 @@
+#ifndef _RAYTRACER_RENDER_HPP
+#define _RAYTRACER_RENDER_HPP
+
+
+#include <atomic>
+#include <cstdint>
+#include <functional>
+#include <vector>
+
+#include "common.hpp"
+#include "framebuffer.hpp"
+#include "image.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "stats.hpp"
+#include "thread_pool.hpp"
+
+
+/* Pixels [x0, x1) x [y0, y1) of a frame */
+struct render_region {
+  size_t x0, y0, x1, y1;
+};
+
+/* Arbitrary output variables of a pixel, mostly from the first hits of its
+ * camera rays */
+struct pixel_aov {
+  rtfloat depth;      // Distance from the eye to the nearest hit, or inf
+  vec3f normal;       // Mean shading normal, facing the viewer
+  color3f albedo;     // Mean diffuse color
+  uint32_t object;    // Id of the object most samples hit, 0 for none
+  rtfloat coverage;   // Fraction of the samples that hit that object
+  rtfloat variance;   // Of the luminance of the pixel's color, estimated
+                      // from its samples, or -1 if there is only one
+  rtfloat cost;       // Mean traversal steps of a sample, over all the rays
+                      // it spawned
+};
+
+// Called with the AOVs of each finished tile, in any order and from any
+// thread
+typedef std::function<void(render_region tile, const pixel_aov *pixels)>
+    aov_callback;
+
+
+struct raster_bins;
+
+
+enum class render_engine {
+  recursive,    // Trace and shade each path depth first
+  wavefront,    // Trace tiles in stages over queues of rays
+};
+
+
+struct render_options {
+  render_engine engine = render_engine::recursive;
+  bool sort_rays = false;     // Sort secondary rays for coherence (wavefront)
+  bool raster_primary = false; // Find camera ray hits by rasterizing
+  const raster_bins *raster = nullptr; // Bins from raster_create for the
+                              // camera and the frame size, to share across
+                              // renders instead of binning per call
+
+  const scene_camera *camera = nullptr; // Instead of the scene's
+
+  int sample_freq = 0;        // NxN samples per pixel, 0 for one centered ray
+  size_t sample_count = 0;    // Samples per pixel, overrides sample_freq
+  sampler_type sampler = sampler_type::stratified;
+  uint32_t seed = 0;
+
+  int max_depth = 5;          // Maximum number of reflections
+  rtfloat min_weight = 0.001; // Cut paths whose weight falls below this
+  rtfloat roulette = 0;       // Russian roulette below this weight, 0 for off
+
+  size_t light_samples = 0;   // Point lights per shading point, 0 for all
+  rtfloat light_cutoff = 0.001; // Skip lights delivering less than this
+
+  bool adaptive = false;      // Sample until the per-pixel error is small
+  rtfloat adaptive_threshold = 0.01;
+  size_t min_samples = 4;
+  size_t max_samples = 64;
+
+  bool progressive = false;   // Accumulate whole-frame passes
+  rtfloat time_budget = 0;    // Seconds, 0 for none
+  rtfloat target_noise = 0;   // Stop once RMS pixel error is below, 0 for none
+  std::function<void(const accum_buffer *)> pass_done;
+
+  size_t num_threads = 0;     // 0 for one per core
+  thread_pool *pool = nullptr; // If null, a pool is created for the render
+
+  const std::atomic<bool> *cancel = nullptr; // Stop early once set
+
+  aov_callback aov_done;      // If set, AOVs are computed (not progressive)
+};
+
+size_t samples_per_pixel(const render_options &);
+
+
+struct render_stats {
+  size_t pixels;
+  uint64_t samples;
+  size_t passes;
+  size_t buffer_bytes;    // Most held at once in pixel buffers
+};
+
+
+// Called with each finished row of a region, from the rendering thread
+typedef std::function<void(size_t y, const color3f *row)> row_callback;
+// Called with each finished tile, in any order and from any thread
+typedef std::function<void(render_region tile, const color3f *pixels)>
+    tile_callback;
+
+
+void scene_render(scene *, image_ostream *, const render_options &,
+                  render_stats *stats = nullptr);
+
+// Renders part of a width x height frame, with the same pixels as a full
+// render. Returns false if opts.cancel stopped it, with some rows missing
+bool scene_render_region(scene *, size_t width, size_t height,
+                         render_region, const row_callback &row_done,
+                         const render_options &, render_stats *stats = nullptr);
+
+// As above, but hands out tiles as soon as they are done, so no more than
+// a tile per thread is held at once
+bool scene_render_tiles(scene *, size_t width, size_t height,
+                        render_region, const tile_callback &tile_done,
+                        const render_options &, render_stats *stats = nullptr);
+
+
+/* A frame of a batch, seen through a camera of its own */
+struct render_frame {
+  size_t width, height;
+  render_region region;
+  scene_camera camera;
+  tile_callback tile_done;
+  std::function<void()> frame_done;   // After its last tile, if set
+};
+
+// Renders each frame as scene_render_tiles would, with the tiles of all of
+// them in one queue, so threads go on to the next frame while the last
+// tiles of one are still rendering. frame_done runs on the thread that
+// finished the frame. The stats add up over the frames
+bool scene_render_frames(scene *, const std::vector<render_frame> &,
+                         const render_options &,
+                         render_stats *stats = nullptr);
+
+// Adds passes to accum, calling opts.pass_done after each one. Pixels that
+// already have samples, as in a resumed render, get the following ones
+void scene_render_progressive(scene *, accum_buffer *, const render_options &,
+                              render_stats *stats = nullptr);
+// As above for a region of a frame, the size of accum
+void scene_render_progressive(scene *, size_t width, size_t height,
+                              render_region, accum_buffer *,
+                              const render_options &,
+                              render_stats *stats = nullptr);
+
+// Most bytes the pixel buffers of a width x height render would hold, as
+// render_stats::buffer_bytes reports it afterwards. Progressive renders
+// count their accumulation buffer; others go by tiles or by rows
+size_t render_buffer_bytes(const render_options &, size_t width,
+                           size_t height, size_t threads, bool tiles);
+
+
+/* What rendering a region took, on one thread */
+struct region_cost {
+  render_region region;
+  uint64_t samples;
+  double seconds;
+  ray_counts primary, shadow, reflection;
+};
+
+// Renders each of the regions of a width x height frame on its own, on
+// this thread, with the samples a full render would give it, and fills in
+// the rest of its cost. Adaptive pixels are refined until their own error
+// is small enough, without the refinement their neighbors would add
+void scene_measure_regions(scene *, size_t width, size_t height,
+                           std::vector<region_cost> *regions,
+                           const render_options &);
+
+
+#endif
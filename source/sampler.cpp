@@ -0,0 +1,295 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include "common.hpp"
+#include "sampler.hpp"
+
+
+uint32_t hash32(uint32_t x) {
+  x ^= x >> 16;
+  x *= 0x7feb352dU;
+  x ^= x >> 15;
+  x *= 0x846ca68bU;
+  x ^= x >> 16;
+  return x;
+}
+
+uint32_t hash32(uint32_t x, uint32_t y) {
+  return hash32(x ^ hash32(y + 0x9e3779b9U));
+}
+
+uint32_t hash32(uint32_t x, uint32_t y, uint32_t z) {
+  return hash32(x ^ hash32(y ^ hash32(z + 0x9e3779b9U)));
+}
+
+uint64_t hash64(const std::string &data, uint64_t h) {
+  for (unsigned char c : data) {
+    h ^= c;
+    h *= 0x100000001b3ULL;
+  }
+  return h;
+}
+
+
+rng_state rng_create(uint64_t seed, uint64_t stream) {
+  rng_state rng = { 0, (stream << 1) | 1 };
+  rng_next(&rng);
+  rng.state += seed;
+  rng_next(&rng);
+  return rng;
+}
+
+uint32_t rng_next(rng_state *rng) {
+  uint64_t old = rng->state;
+  rng->state = old * 6364136223846793005ULL + rng->inc;
+  uint32_t xorshifted = (uint32_t) (((old >> 18) ^ old) >> 27);
+  uint32_t rot = (uint32_t) (old >> 59);
+  return (xorshifted >> rot) | (xorshifted << ((-rot) & 31));
+}
+
+rtfloat rng_float(rng_state *rng) {
+  return rng_next(rng) * (1 / 4294967296.0);
+}
+
+
+rng_state pixel_rng(uint32_t seed, size_t px, size_t py, size_t index) {
+  uint32_t pixel = hash32((uint32_t) px, (uint32_t) py, seed);
+  uint64_t state = ((uint64_t) pixel << 32) | (uint32_t) index;
+  return rng_create(state, hash32((uint32_t) index, pixel));
+}
+
+
+
+static inline rtfloat frac(rtfloat x) {
+  return x - std::floor(x);
+}
+
+static inline rtfloat to_unit(uint32_t x) {
+  return x * (1 / 4294967296.0);
+}
+
+
+struct random_pattern : pixel_sampler {
+  uint32_t seed;
+
+  random_pattern(uint32_t seed) : seed(seed) {}
+
+  sample2f sample(size_t px, size_t py, size_t index, size_t) const {
+    rng_state rng = pixel_rng(seed, px, py, index);
+    rtfloat u = rng_float(&rng);
+    rtfloat v = rng_float(&rng);
+    return { u, v };
+  }
+};
+
+
+/* Permutation of [0, n) picked by p (Kensler 2013), by cycle walking over
+ * the next power of two */
+static uint32_t permute(uint32_t i, uint32_t n, uint32_t p) {
+  uint32_t w = n - 1;
+  w |= w >> 1;
+  w |= w >> 2;
+  w |= w >> 4;
+  w |= w >> 8;
+  w |= w >> 16;
+  do {
+    i ^= p;             i *= 0xe170893dU;
+    i ^= p >> 16;       i ^= (i & w) >> 4;
+    i ^= p >> 8;        i *= 0x0929eb3fU;
+    i ^= p >> 23;       i ^= (i & w) >> 1;
+    i *= 1 | p >> 27;   i *= 0x6935fa69U;
+    i ^= (i & w) >> 11; i *= 0x74dcb303U;
+    i ^= (i & w) >> 2;  i *= 0x9e501cc3U;
+    i ^= (i & w) >> 2;  i *= 0xc860a3dfU;
+    i &= w;
+    i ^= i >> 5;
+  } while (i >= n);
+  return (i + p) % n;
+}
+
+
+/* Cells are visited in a random order of their own in each pixel, so the
+ * first samples of a pixel, as adaptive sampling takes them, are spread
+ * over all of it rather than its first rows of cells */
+
+struct stratified_pattern : pixel_sampler {
+  uint32_t seed;
+
+  stratified_pattern(uint32_t seed) : seed(seed) {}
+
+  sample2f sample(size_t px, size_t py, size_t index, size_t count) const {
+    // Past the given count, as with no count at all, the grid grows
+    count = std::max(count, index + 1);
+    size_t k = (size_t) std::ceil(std::sqrt((rtfloat) count));
+    while (k*k < count) k++;
+
+    // Spread the samples over the grid when count is not a perfect square
+    uint32_t pixel = hash32((uint32_t) px, (uint32_t) py, seed);
+    size_t order = permute((uint32_t) index, (uint32_t) count, pixel);
+    size_t cell = count < k*k ? order * k*k / count : order;
+
+    rng_state rng = pixel_rng(seed, px, py, index);
+    rtfloat u = ((cell % k) + rng_float(&rng)) / k;
+    rtfloat v = ((cell / k) + rng_float(&rng)) / k;
+    return { u, v };
+  }
+};
+
+
+/* R2 sequence (Roberts 2018), based on the plastic number */
+
+static const rtfloat r2_a1 = 1 / 1.32471795724474602596;
+static const rtfloat r2_a2 = r2_a1 * r2_a1;
+
+static sample2f r2_point(size_t index, rtfloat du, rtfloat dv) {
+  return { frac(0.5 + du + r2_a1 * index), frac(0.5 + dv + r2_a2 * index) };
+}
+
+
+struct r2_pattern : pixel_sampler {
+  uint32_t seed;
+
+  r2_pattern(uint32_t seed) : seed(seed) {}
+
+  sample2f sample(size_t px, size_t py, size_t index, size_t) const {
+    rng_state rng = pixel_rng(seed, px, py, 0);
+    rtfloat du = rng_float(&rng);
+    rtfloat dv = rng_float(&rng);
+    return r2_point(index, du, dv);
+  }
+};
+
+
+/* Per-pixel shifts come from a dither mask with blue noise spectrum, so the
+ * error of neighboring pixels is anticorrelated. Interleaved gradient noise
+ * (Jimenez 2014) drives one axis and the R2 dither mask the other */
+
+struct blue_noise_pattern : pixel_sampler {
+  rtfloat du, dv;
+
+  blue_noise_pattern(uint32_t seed) {
+    rng_state rng = rng_create(seed, 0);
+    du = rng_float(&rng);
+    dv = rng_float(&rng);
+  }
+
+  sample2f sample(size_t px, size_t py, size_t index, size_t) const {
+    rtfloat x = (rtfloat) px, y = (rtfloat) py;
+    rtfloat ign = frac(52.9829189 * frac(0.06711056*x + 0.00583715*y));
+    rtfloat r2d = frac(r2_a1*x + r2_a2*y);
+    return r2_point(index, du + ign, dv + r2d);
+  }
+};
+
+
+/* Sobol points in two dimensions with hash-based Owen scrambling and index
+ * shuffling (Burley 2020) */
+
+static inline uint32_t reverse_bits(uint32_t x) {
+  x = ((x >> 1) & 0x55555555U) | ((x & 0x55555555U) << 1);
+  x = ((x >> 2) & 0x33333333U) | ((x & 0x33333333U) << 2);
+  x = ((x >> 4) & 0x0f0f0f0fU) | ((x & 0x0f0f0f0fU) << 4);
+  x = ((x >> 8) & 0x00ff00ffU) | ((x & 0x00ff00ffU) << 8);
+  return (x >> 16) | (x << 16);
+}
+
+static inline uint32_t sobol(uint32_t index, int dim) {
+  if (dim == 0) return reverse_bits(index);
+
+  // Direction numbers for the primitive polynomial x + 1
+  uint32_t result = 0;
+  for (uint32_t v = 1U << 31; index != 0; index >>= 1, v ^= v >> 1)
+    if (index & 1) result ^= v;
+  return result;
+}
+
+static inline uint32_t laine_karras(uint32_t x, uint32_t seed) {
+  x += seed;
+  x ^= x * 0x6c50b47cU;
+  x ^= x * 0xb82f1e52U;
+  x ^= x * 0xc7afe638U;
+  x ^= x * 0x8d22f6e6U;
+  return x;
+}
+
+static inline uint32_t owen_scramble(uint32_t x, uint32_t seed) {
+  return reverse_bits(laine_karras(reverse_bits(x), seed));
+}
+
+
+struct sobol_pattern : pixel_sampler {
+  uint32_t seed;
+
+  sobol_pattern(uint32_t seed) : seed(seed) {}
+
+  sample2f sample(size_t px, size_t py, size_t index, size_t) const {
+    uint32_t pixel = hash32((uint32_t) px, (uint32_t) py, seed);
+    uint32_t i = owen_scramble((uint32_t) index, pixel);
+    uint32_t u = owen_scramble(sobol(i, 0), hash32(pixel, 1));
+    uint32_t v = owen_scramble(sobol(i, 1), hash32(pixel, 2));
+    return { to_unit(u), to_unit(v) };
+  }
+};
+
+
+
+pixel_sampler *random_sampler(uint32_t seed) {
+  return new random_pattern(seed);
+}
+
+pixel_sampler *stratified_sampler(uint32_t seed) {
+  return new stratified_pattern(seed);
+}
+
+pixel_sampler *r2_sampler(uint32_t seed) {
+  return new r2_pattern(seed);
+}
+
+pixel_sampler *sobol_sampler(uint32_t seed) {
+  return new sobol_pattern(seed);
+}
+
+pixel_sampler *blue_noise_sampler(uint32_t seed) {
+  return new blue_noise_pattern(seed);
+}
+
+
+pixel_sampler *sampler_create(sampler_type type, uint32_t seed) {
+  switch (type) {
+  case sampler_type::random:      return random_sampler(seed);
+  case sampler_type::stratified:  return stratified_sampler(seed);
+  case sampler_type::r2:          return r2_sampler(seed);
+  case sampler_type::sobol:       return sobol_sampler(seed);
+  case sampler_type::blue_noise:  return blue_noise_sampler(seed);
+  }
+  return nullptr;
+}
+
+
+static const struct {
+  sampler_type type;
+  const char *name;
+} sampler_names[] = {
+  { sampler_type::random,     "random" },
+  { sampler_type::stratified, "stratified" },
+  { sampler_type::r2,         "r2" },
+  { sampler_type::sobol,      "sobol" },
+  { sampler_type::blue_noise, "bluenoise" },
+};
+
+bool parse_sampler_type(std::string name, sampler_type *type) {
+  for (auto &entry : sampler_names) {
+    if (name == entry.name) {
+      *type = entry.type;
+      return true;
+    }
+  }
+  return false;
+}
+
+const char *sampler_name(sampler_type type) {
+  for (auto &entry : sampler_names)
+    if (entry.type == type) return entry.name;
+  return "unknown";
+}
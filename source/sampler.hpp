@@ -0,0 +1,71 @@
+#ifndef _RAYTRACER_SAMPLER_HPP
+#define _RAYTRACER_SAMPLER_HPP
+
+
+#include <cstdint>
+#include <string>
+
+#include "common.hpp"
+
+
+
+/* Counter-based pseudorandom number generator (PCG32). A stream is fully
+ * determined by its seed and stream id, so there is no hidden global state */
+
+struct rng_state {
+  uint64_t state;
+  uint64_t inc;
+};
+
+uint32_t hash32(uint32_t x);
+uint32_t hash32(uint32_t x, uint32_t y);
+uint32_t hash32(uint32_t x, uint32_t y, uint32_t z);
+// FNV-1a, for fingerprinting files and options
+uint64_t hash64(const std::string &data,
+                uint64_t h = 0xcbf29ce484222325ULL);
+
+rng_state rng_create(uint64_t seed, uint64_t stream);
+uint32_t rng_next(rng_state *);
+rtfloat rng_float(rng_state *);  // Uniform in [0, 1)
+
+// Generator for one (pixel, sample) pair. Independent of render order
+rng_state pixel_rng(uint32_t seed, size_t px, size_t py, size_t index);
+
+
+
+/* Per-pixel sample patterns over the unit square. A sampler is stateless
+ * and may be shared between threads */
+
+struct sample2f {
+  rtfloat u, v;
+};
+
+enum class sampler_type {
+  random,       // Independent uniform samples
+  stratified,   // Jittered grid, the classic --freq behavior
+  r2,           // R2 sequence with a random per-pixel shift
+  sobol,        // Owen-scrambled, shuffled Sobol (0,2)-sequence
+  blue_noise,   // R2 sequence shifted by a blue noise dither mask
+};
+
+struct pixel_sampler {
+  virtual ~pixel_sampler() {}
+
+  // Sample index out of count samples in pixel (px, py), in [0, 1)^2
+  virtual sample2f sample(size_t px, size_t py,
+                          size_t index, size_t count) const = 0;
+};
+
+pixel_sampler *random_sampler(uint32_t seed);
+pixel_sampler *stratified_sampler(uint32_t seed);
+pixel_sampler *r2_sampler(uint32_t seed);
+pixel_sampler *sobol_sampler(uint32_t seed);
+pixel_sampler *blue_noise_sampler(uint32_t seed);
+
+pixel_sampler *sampler_create(sampler_type type, uint32_t seed);
+
+bool parse_sampler_type(std::string name, sampler_type *type);
+const char *sampler_name(sampler_type type);
+
+
+#endif
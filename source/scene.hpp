@@ -2,14 +2,17 @@
 #define _RAYTRACER_SCENE_HPP
 
 
+#include <cstdint>
+#include <cstdio>
+#include <string>
 #include <vector>
 
 #include "common.hpp"
-#include "image.hpp"
 #include "object_structure.hpp"
 
 
 struct scene_object;
+struct light_tree;
 
 
 struct object_material {
@@ -32,12 +35,14 @@ ray_intersection no_intersection(scene_object *obj);
 
 struct scene_object {
   object_material material;
+  uint32_t id = 0;    // From 1 in file order, shared by an OBJ's triangles
 
   transform3f transform_ow;
 
   virtual ~scene_object() {}
   virtual ray_intersection ray_test(ray3f ray) = 0;
   virtual aa_box3f bounding_box() = 0;
+  virtual size_t memory_size() = 0;   // Bytes, with the material
 
   virtual bool apply_affine(const transform3f &) { return false; }
 };
@@ -83,6 +88,9 @@ struct scene {
   std::vector<scene_object *> objects;
 
   object_structure *obj_structure;
+  light_tree *light_structure;  // Optional, for scenes with many lights
+
+  size_t obj_staging_bytes;     // Most held at once while reading OBJ files
 };
 
 
@@ -90,8 +98,6 @@ struct scene {
 scene *scene_create(FILE *input, std::string filename);
 void scene_destroy(scene *);
 
-void scene_render(scene *, image_ostream *, int sample_freq = 0);
-
 
 
 #endif
@@ -1,13 +1,16 @@
+#include <algorithm>
 #include <cstdio>
 #include <cstdlib>
 #include <string>
 #include <vector>
 
 #include "common.hpp"
+#include "light_tree.hpp"
 #include "obj_geometry.hpp"
 #include "parse.hpp"
 #include "scene.hpp"
 #include "shapes.hpp"
+#include "timeline.hpp"
 
 
 using std::string;
@@ -26,14 +29,18 @@ struct input_env {
                                 vec(0,0,0), 1, vec(0,0,0) };
 
   transform3f transform_ow;
+
+  uint32_t object_count = 0;
 };
 
 
-static void add_scene_object(input_env *env, scene_object *obj) {
+static void add_scene_object(input_env *env, scene_object *obj,
+                             uint32_t id) {
   if (env->default_mat)
     parse_warning(&env->penv, "Using default material for object");
 
   obj->material = env->material;
+  obj->id = id;
 
   if (obj->apply_affine(env->transform_ow))
     obj->transform_ow = trans3_identity();
@@ -120,7 +127,7 @@ static void exec_command(input_env *env, string line) {
     sphere_object *sphere = new sphere_object;
     sphere->center = parse_vec3f(&env->penv, &line);
     sphere->radius = (rtfloat) parse_float(&env->penv, &line);
-    add_scene_object(env, sphere);
+    add_scene_object(env, sphere, ++env->object_count);
   
   } else if (cmd == "tri") {
     triangle_object *triangle = new triangle_object;
@@ -128,12 +135,13 @@ static void exec_command(input_env *env, string line) {
     triangle->vertices[1] = parse_vec3f(&env->penv, &line);
     triangle->vertices[2] = parse_vec3f(&env->penv, &line);
     triangle->default_normals();
-    add_scene_object(env, triangle);
+    add_scene_object(env, triangle, ++env->object_count);
 
   } else if (cmd == "obj") {
     std::string filename = parse_string(&env->penv, &line);
     filename = env->penv.directory + filename;
     obj_geometry *obj = obj_read(filename.c_str());
+    uint32_t id = ++env->object_count;
 
     for (obj_triangle tri : obj->triangles) {
       triangle_object *triangle = new triangle_object;
@@ -142,8 +150,12 @@ static void exec_command(input_env *env, string line) {
         triangle->vertices[i] = obj->vertices[index];
         triangle->normals[i] = tri.vertices[i].normal;
       }
-      add_scene_object(env, triangle);
+      add_scene_object(env, triangle, id);
     }
+
+    size_t staging = obj->vertices.capacity() * sizeof(vec3f) +
+                     obj->triangles.capacity() * sizeof(obj_triangle);
+    env->s->obj_staging_bytes = std::max(env->s->obj_staging_bytes, staging);
     obj_destroy(obj);
 
   } else {
@@ -158,11 +170,15 @@ static void exec_command(input_env *env, string line) {
 
 
 scene *scene_create(FILE *input, std::string filename) {
+  timeline_scope scope("parse scene", "load");
   input_env env;
   env.penv = parse_env_create(filename);
   env.transform_ow = trans3_identity();
 
   env.s = new scene;
+  env.s->obj_structure = nullptr;
+  env.s->light_structure = nullptr;
+  env.s->obj_staging_bytes = 0;
   env.s->camera = { {0,0,0}, {-0.5,-0.5,-1}, {0.5,-0.5,-1}, 
                    {-0.5,0.5,-1}, {0.5,0.5,-1} };
 
@@ -185,6 +201,7 @@ void scene_destroy(scene *s) {
   if (s == nullptr) return;
 
   delete s->obj_structure;
+  light_tree_destroy(s->light_structure);
 
   for (scene_object *obj : s->objects)
     delete obj;
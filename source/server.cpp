@@ -0,0 +1,423 @@
+#include <chrono>
+#include <condition_variable>
+#include <cstdint>
+#include <cstdio>
+#include <deque>
+#include <map>
+#include <memory>
+#include <mutex>
+#include <sstream>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <poll.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+#include "common.hpp"
+#include "image.hpp"
+#include "net.hpp"
+#include "raytracer.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "server.hpp"
+#include "thread_pool.hpp"
+
+
+/* A loaded scene. Jobs hold a reference, so unloading a scene that is
+ * still queued for rendering only drops it from the cache */
+struct cached_scene {
+  scene *s;
+  ~cached_scene() { scene_destroy(s); }
+};
+
+enum class job_state {
+  queued,
+  running,
+  done,
+  failed,
+};
+
+struct server_job {
+  std::shared_ptr<cached_scene> scene_ref;
+  size_t width, height;
+  size_t samples;             // 0 for the server's default
+  std::string output;
+  bool camera_override;
+  scene_camera camera;
+
+  job_state state;
+  std::string error;
+  double seconds;
+  uint64_t samples_traced;
+};
+
+struct server {
+  server_options opts;
+  thread_pool *pool;
+
+  std::mutex mutex;
+  std::condition_variable job_queued;
+  std::condition_variable job_finished;
+
+  std::map<uint64_t, std::shared_ptr<cached_scene>> scenes;
+  std::map<uint64_t, server_job> jobs;
+  std::deque<uint64_t> queue;
+  uint64_t next_job = 1;
+  bool stopping = false;
+
+  std::vector<int> closed;    // Connections whose threads are done, by fd
+};
+
+
+
+/* Scene cache */
+
+static std::string scene_name(uint64_t key) {
+  char name[17];
+  snprintf(name, sizeof(name), "%016llx", (unsigned long long) key);
+  return name;
+}
+
+static std::string load_scene(server *srv, const std::string &path) {
+  std::string contents;
+  if (!read_file(path, &contents))
+    return "error Failed to open " + path;
+
+  /* OBJ files are found relative to the scene file, so the same contents
+   * in another directory may be a different scene */
+  uint64_t key = hash64(contents, hash64(get_directory(path)));
+
+  {
+    std::lock_guard<std::mutex> lock(srv->mutex);
+    if (srv->scenes.count(key) != 0)
+      return "ok " + scene_name(key);
+  }
+
+  scene *s = scene_load_memory(contents, path, srv->opts.load);
+  if (s == nullptr)
+    return "error Failed to load " + path;
+
+  std::shared_ptr<cached_scene> entry(new cached_scene{s});
+  std::lock_guard<std::mutex> lock(srv->mutex);
+  if (srv->scenes.count(key) == 0)
+    srv->scenes[key] = entry;
+  return "ok " + scene_name(key);
+}
+
+static bool parse_scene_name(const std::string &name, uint64_t *key) {
+  if (name.empty() || name.size() > 16) return false;
+  char *end;
+  *key = strtoull(name.c_str(), &end, 16);
+  return *end == '\0';
+}
+
+
+
+/* Job queue */
+
+/* What running a job came to, kept in the job under the server's lock */
+struct job_result {
+  job_state state;
+  std::string error;
+  double seconds;
+  uint64_t samples_traced;
+};
+
+static job_result run_job(server *srv, const server_job &job) {
+  scene *s = job.scene_ref->s;
+
+  render_options opts = srv->opts.render;
+  opts.pool = srv->pool;
+  if (job.samples > 0) {
+    opts.sample_count = job.samples;
+    opts.adaptive = false;
+  }
+  if (job.camera_override)
+    opts.camera = &job.camera;
+
+  FILE *file = fopen(job.output.c_str(), "w");
+  if (file == nullptr)
+    return { job_state::failed, "Failed to open " + job.output, 0, 0 };
+
+  auto start = std::chrono::steady_clock::now();
+  render_stats stats;
+  image_ostream *stream = open_image_stream(file, job.width, job.height,
+                                            image_format_for(job.output));
+  scene_render(s, stream, opts, &stats);
+  close(stream);
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+
+  if (fclose(file) != 0)
+    return { job_state::failed, "Failed to write " + job.output,
+             elapsed.count(), stats.samples };
+  return { job_state::done, "", elapsed.count(), stats.samples };
+}
+
+static void scheduler_main(server *srv) {
+  std::unique_lock<std::mutex> lock(srv->mutex);
+
+  while (true) {
+    srv->job_queued.wait(lock, [&] {
+      return srv->stopping || !srv->queue.empty();
+    });
+    if (srv->queue.empty()) return;
+
+    uint64_t id = srv->queue.front();
+    srv->queue.pop_front();
+    server_job *job = &srv->jobs[id];
+    job->state = job_state::running;
+
+    // Only this thread changes the job while it runs, and the map keeps
+    // its address, so it can be read without the lock
+    lock.unlock();
+    job_result result = run_job(srv, *job);
+    lock.lock();
+
+    job->state = result.state;
+    job->error = result.error;
+    job->seconds = result.seconds;
+    job->samples_traced = result.samples_traced;
+    job->scene_ref.reset();
+    srv->job_finished.notify_all();
+  }
+}
+
+
+static std::string submit_job(server *srv, std::istringstream &args) {
+  std::string name, output;
+  long width, height;
+  if (!(args >> name >> width >> height >> output) ||
+      width < 0 || height < 0)
+    return "error Expected render SCENE WIDTH HEIGHT OUTPUT";
+
+  server_job job;
+  job.width = (size_t) width;
+  job.height = (size_t) height;
+  job.samples = 0;
+  job.output = output;
+  job.camera_override = false;
+  job.state = job_state::queued;
+  job.seconds = 0;
+  job.samples_traced = 0;
+
+  std::string option;
+  while (args >> option) {
+    if (option == "samples") {
+      long samples;
+      if (!(args >> samples) || samples < 1)
+        return "error Invalid sample count";
+      job.samples = (size_t) samples;
+
+    } else if (option == "camera") {
+      scene_camera &c = job.camera;
+      vec3f *points[] = { &c.eye, &c.lower_left, &c.lower_right,
+                          &c.upper_left, &c.upper_right };
+      for (vec3f *p : points) {
+        if (!(args >> p->x >> p->y >> p->z))
+          return "error Expected 15 numbers after camera";
+      }
+      job.camera_override = true;
+
+    } else {
+      return "error Unknown render option: " + option;
+    }
+  }
+
+  uint64_t key;
+  std::lock_guard<std::mutex> lock(srv->mutex);
+  if (srv->stopping)
+    return "error Server is shutting down";
+  if (!parse_scene_name(name, &key) || srv->scenes.count(key) == 0)
+    return "error Unknown scene: " + name;
+
+  job.scene_ref = srv->scenes[key];
+  uint64_t id = srv->next_job++;
+  srv->jobs[id] = job;
+  srv->queue.push_back(id);
+  srv->job_queued.notify_one();
+  return "ok " + std::to_string(id);
+}
+
+
+static const char *state_name(job_state state) {
+  switch (state) {
+  case job_state::queued:   return "queued";
+  case job_state::running:  return "running";
+  case job_state::done:     return "done";
+  case job_state::failed:   return "failed";
+  }
+  return "unknown";
+}
+
+static std::string job_status(server *srv, std::istringstream &args,
+                              bool wait) {
+  uint64_t id;
+  if (!(args >> id))
+    return "error Expected job number";
+
+  std::unique_lock<std::mutex> lock(srv->mutex);
+  auto it = srv->jobs.find(id);
+  if (it == srv->jobs.end())
+    return "error Unknown job: " + std::to_string(id);
+  server_job &job = it->second;
+
+  if (!wait)
+    return std::string("ok ") + state_name(job.state);
+
+  srv->job_finished.wait(lock, [&] {
+    return job.state == job_state::done || job.state == job_state::failed;
+  });
+  if (job.state == job_state::failed)
+    return "error " + job.error;
+
+  char reply[64];
+  snprintf(reply, sizeof(reply), "ok %.3f %llu", job.seconds,
+           (unsigned long long) job.samples_traced);
+  return reply;
+}
+
+
+
+/* Connections */
+
+static std::string run_command(server *srv, const std::string &line) {
+  std::istringstream args(line);
+  std::string command;
+  if (!(args >> command))
+    return "";
+
+  if (command == "load") {
+    std::string path;
+    if (!std::getline(args >> std::ws, path) || path.empty())
+      return "error Expected load PATH";
+    return load_scene(srv, path);
+
+  } else if (command == "unload") {
+    std::string name;
+    uint64_t key;
+    if (!(args >> name) || !parse_scene_name(name, &key))
+      return "error Expected unload SCENE";
+    std::lock_guard<std::mutex> lock(srv->mutex);
+    if (srv->scenes.erase(key) == 0)
+      return "error Unknown scene: " + name;
+    return "ok";
+
+  } else if (command == "render") {
+    return submit_job(srv, args);
+
+  } else if (command == "status") {
+    return job_status(srv, args, false);
+
+  } else if (command == "wait") {
+    return job_status(srv, args, true);
+
+  } else if (command == "shutdown") {
+    std::lock_guard<std::mutex> lock(srv->mutex);
+    srv->stopping = true;
+    srv->job_queued.notify_one();
+    return "ok";
+  }
+
+  return "error Unknown command: " + command;
+}
+
+static bool send_line(int fd, std::string line) {
+  line += '\n';
+  return send_all(fd, line.data(), line.size());
+}
+
+static void serve_connection(server *srv, int fd) {
+  std::string pending;
+  char buffer[4096];
+  ssize_t n;
+
+  while ((n = recv(fd, buffer, sizeof(buffer), 0)) > 0) {
+    pending.append(buffer, (size_t) n);
+
+    size_t end;
+    while ((end = pending.find('\n')) != std::string::npos) {
+      std::string line = pending.substr(0, end);
+      pending.erase(0, end + 1);
+      if (!line.empty() && line.back() == '\r')
+        line.pop_back();
+
+      std::string reply = run_command(srv, line);
+      if (!reply.empty() && !send_line(fd, reply))
+        return;
+    }
+  }
+}
+
+static void connection_main(server *srv, int fd) {
+  serve_connection(srv, fd);
+  std::lock_guard<std::mutex> lock(srv->mutex);
+  srv->closed.push_back(fd);
+}
+
+// Joins the threads of closed connections and closes their sockets
+static void reap_connections(server *srv,
+                             std::map<int, std::thread> *connections) {
+  std::vector<int> closed;
+  {
+    std::lock_guard<std::mutex> lock(srv->mutex);
+    closed.swap(srv->closed);
+  }
+  for (int fd : closed) {
+    (*connections)[fd].join();
+    connections->erase(fd);
+    close(fd);
+  }
+}
+
+
+
+int server_run(const std::string &socket_path, const server_options &opts) {
+  int listen_fd = socket_listen(socket_path);
+  if (listen_fd < 0) return 1;
+  fprintf(stderr, "Listening on %s\n", socket_path.c_str());
+
+  server *srv = new server;
+  srv->opts = opts;
+  srv->pool = thread_pool_create(opts.render.num_threads);
+  std::thread scheduler(scheduler_main, srv);
+
+  // Sockets stay open until their threads are joined, so a socket number
+  // is not reused while its thread is still listed
+  std::map<int, std::thread> connections;
+
+  while (true) {
+    {
+      std::lock_guard<std::mutex> lock(srv->mutex);
+      if (srv->stopping) break;
+    }
+    reap_connections(srv, &connections);
+
+    // Wake up now and then to notice a shutdown command
+    pollfd pfd = { listen_fd, POLLIN, 0 };
+    if (poll(&pfd, 1, 200) <= 0) continue;
+
+    int fd = accept(listen_fd, nullptr, nullptr);
+    if (fd < 0) continue;
+    connections[fd] = std::thread(connection_main, srv, fd);
+  }
+
+  socket_unlisten(listen_fd, socket_path);
+
+  // Let the queued jobs finish before hanging up on the clients, who may
+  // be waiting for them
+  scheduler.join();
+  for (auto &connection : connections)
+    shutdown(connection.first, SHUT_RDWR);
+  for (auto &connection : connections) {
+    connection.second.join();
+    close(connection.first);
+  }
+
+  thread_pool_destroy(srv->pool);
+  delete srv;
+  return 0;
+}
@@ -0,0 +1,38 @@
+#ifndef _RAYTRACER_SERVER_HPP
+#define _RAYTRACER_SERVER_HPP
+
+
+#include <string>
+
+#include "raytracer.hpp"
+#include "render.hpp"
+
+
+/* Render server. Clients connect to a Unix domain socket and send one
+ * command per line. Loaded scenes stay resident, keyed by a hash of their
+ * contents, so rendering many views of a scene parses it and builds its
+ * object structure once. Render jobs are queued and run one after another,
+ * each spread over the server's thread pool
+ *
+ *   load PATH                  ok SCENE
+ *   unload SCENE               ok
+ *   render SCENE W H OUTPUT [samples N] [camera X Y Z ...]
+ *                              ok JOB
+ *   status JOB                 ok queued|running|done|failed
+ *   wait JOB                   ok SECONDS SAMPLES, once the job is done
+ *   shutdown                   ok, then stops after the queued jobs
+ *
+ * A camera override gives the eye and the lower left, lower right, upper
+ * left and upper right corners, 15 numbers in all. Failed commands answer
+ * with "error MESSAGE" */
+
+struct server_options {
+  render_options render;  // Used for every job
+  load_options load;      // Used for every scene
+};
+
+// Returns the process exit status
+int server_run(const std::string &socket_path, const server_options &);
+
+
+#endif
@@ -0,0 +1,255 @@
+#include <algorithm>
+#include <cmath>
+
+#include "common.hpp"
+#include "raster.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "shading.hpp"
+#include "stats.hpp"
+
+
+static const rtfloat bounce_delt = 0.001;
+
+
+ray_intersection intersection(scene_object *obj, rtfloat dist, vec3f normal) {
+  return {dist, normal, obj};
+}
+
+ray_intersection no_intersection(scene_object *obj) {
+  return {rtfloat_inf, vec(0,0,0), obj};
+}
+
+
+
+template <typename T, typename S>
+static inline T bilin(T ll, T lr, T ul, T ur, S u, S v) {
+  T p0 = (1 - u)*ll + u*lr;
+  T p1 = (1 - u)*ul + u*ur;
+  return (1 - v)*p0 + v*p1;
+}
+
+
+ray3f camera_ray(const render_context &ctx, const camera_sample &cs) {
+  const render_options &opts = *ctx.opts;
+  const scene_camera &cam = *ctx.camera;
+  bool jitter = opts.adaptive || opts.progressive || opts.sample_freq > 0 ||
+                opts.sample_count > 0;
+
+  sample2f p = {0.5, 0.5};
+  if (jitter)
+    p = ctx.sampler->sample(cs.px, cs.py, cs.index, cs.count);
+
+  // Image rows go top to bottom, the image plane goes bottom to top
+  rtfloat u = (cs.px + p.u) / ctx.width;
+  rtfloat v = (ctx.height - 1 - cs.py + p.v) / ctx.height;
+
+  vec3f target = bilin(cam.lower_left, cam.lower_right,
+                       cam.upper_left, cam.upper_right, u, v);
+  return { cam.eye, target - cam.eye };
+}
+
+path_state initial_path(const render_options &opts, const camera_sample &cs) {
+  path_state path;
+  path.bounces = opts.max_depth;
+  path.weight = {1, 1, 1};
+  path.rng = pixel_rng(hash32(opts.seed, 0x5eed), cs.px, cs.py, cs.index);
+  return path;
+}
+
+
+
+ray_intersection object_test(scene_object *obj, ray3f ray, rtfloat invmagdir,
+                             rtfloat max_dist) {
+  if (obj->transform_ow.identity)
+    return obj->ray_test(ray);
+
+  ray_intersection inter = no_intersection(obj);
+  ray3f oray = inv(obj->transform_ow) * ray;
+  ray_intersection ointer = obj->ray_test(oray);
+  vec3f nodir = ointer.dist * oray.dir;
+  vec3f nwdir = project(obj->transform_ow * hvec(nodir));
+  inter.dist = magnitude(nwdir) * invmagdir;
+
+  if (inter.dist < max_dist)
+    inter.normal = trans_normal(obj->transform_ow, ointer.normal);
+  return inter;
+}
+
+
+ray_intersection trace_ray(scene *s, ray3f ray) {
+  rtfloat invmagdir = 1 / magnitude(ray.dir);
+  ray_intersection result = no_intersection(nullptr);
+
+  trace_counters &counters = thread_counters();
+
+  flat_list<scene_object *> cands = s->obj_structure->candidates(ray);
+  for (scene_object *obj : cands) {
+    counters.primitives_tested += 1;
+    ray_intersection inter = object_test(obj, ray, invmagdir, result.dist);
+    if (inter.dist < result.dist)
+      result = inter;
+  }
+
+  return result;
+}
+
+
+bool occluded(scene *s, ray3f ray, rtfloat max_dist,
+              scene_object **cache) {
+  rtfloat invmagdir = 1 / magnitude(ray.dir);
+  trace_counters &counters = thread_counters();
+
+  /* Neighboring shadow rays are often blocked by the same object */
+  if (cache != nullptr && *cache != nullptr) {
+    counters.primitives_tested += 1;
+    if (object_test(*cache, ray, invmagdir, 0).dist < max_dist) {
+      counters.occluder_cache_hits += 1;
+      return true;
+    }
+  }
+
+  flat_list<scene_object *> cands = s->obj_structure->candidates(ray);
+  for (scene_object *obj : cands) {
+    counters.primitives_tested += 1;
+    if (object_test(obj, ray, invmagdir, 0).dist < max_dist) {
+      if (cache != nullptr) *cache = obj;
+      return true;
+    }
+  }
+
+  return false;
+}
+
+
+
+void trace_primary(const render_context &ctx, const camera_sample *samples,
+                   size_t count, ray3f *rays, ray_intersection *hits,
+                   uint64_t *cost) {
+  trace_counters &counters = thread_counters();
+  if (cost != nullptr) {
+    for (size_t i = 0; i < count; i++) {
+      uint64_t steps = traversal_steps(counters);
+      trace_primary(ctx, &samples[i], 1, &rays[i], &hits[i]);
+      cost[i] = traversal_steps(counters) - steps;
+    }
+    return;
+  }
+
+  traversal_mark mark = mark_traversal(counters);
+  for (size_t i = 0; i < count; i++)
+    rays[i] = camera_ray(ctx, samples[i]);
+
+  if (ctx.raster != nullptr) {
+    raster_primary(ctx.raster, ctx.s, samples, rays, count, hits);
+  } else {
+    for (size_t i = 0; i < count; i++)
+      hits[i] = trace_ray(ctx.s, rays[i]);
+  }
+  count_rays(&counters.primary, counters, mark, count);
+}
+
+
+
+void primary_aovs(const ray3f *rays, const ray_intersection *hits,
+                  size_t count, pixel_aov *aovs) {
+  for (size_t i = 0; i < count; i++) {
+    const ray_intersection &hit = hits[i];
+    if (hit.dist < rtfloat_inf) {
+      shading_point sp = make_shading_point(rays[i], hit);
+      aovs[i] = { hit.dist * magnitude(rays[i].dir), sp.normal,
+                  sp.mat->diffuse, hit.obj->id, 1, -1, 0 };
+    } else {
+      aovs[i] = { rtfloat_inf, {0, 0, 0}, {0, 0, 0}, 0, 1, -1, 0 };
+    }
+  }
+}
+
+
+shading_point make_shading_point(ray3f ray, const ray_intersection &hit) {
+  shading_point sp;
+  sp.mat = &hit.obj->material;
+  sp.point = ray.start + hit.dist * ray.dir;
+  sp.normal = hit.normal;
+  sp.eye_dir = normalize(ray.start - sp.point);
+  if (dot(sp.normal, sp.eye_dir) < 0) sp.normal = -sp.normal;
+  return sp;
+}
+
+
+light_eval evaluate_light(const light_source &light, const shading_point &sp,
+                          rtfloat weight) {
+  color3f ka = sp.mat->ambient;
+  color3f kd = sp.mat->diffuse;
+  color3f ks = sp.mat->specular;
+  rtfloat sp_pow = sp.mat->specular_power;
+
+  light_eval e;
+  e.diffuse = e.specular = {0, 0, 0};
+  e.direct = light.type != light_type::ambient;
+
+  vec3f light_dir;
+  rtfloat light_dist = 0;
+  rtfloat falloff_factor = weight;
+  if (light.type == light_type::directional) {
+    light_dir = -light.dir;
+    light_dist = rtfloat_inf;
+  } else if (light.type == light_type::point) {
+    light_dir = normalize(light.pos - sp.point);
+    light_dist = magnitude(light.pos - sp.point);
+    falloff_factor = weight/std::pow(light_dist, light.falloff);
+  }
+
+  /* Ambient shading */
+  e.ambient = falloff_factor * ka * light.color;
+
+  if (!e.direct)
+    return e;
+
+  /* Shadow ray */
+  e.shadow_ray = { sp.point + bounce_delt * light_dir, light_dir };
+  e.light_dist = light_dist;
+
+  /* Diffuse shading */
+  rtfloat diff_factor = std::max(dot(light_dir, sp.normal), (rtfloat) 0);
+  e.diffuse = falloff_factor * diff_factor * kd * light.color;
+
+  /* Specular shading */
+  vec3f light_refl = -light_dir + 2*dot(sp.normal, light_dir) * sp.normal;
+  rtfloat spec_factor = std::max(dot(light_refl, sp.eye_dir), (rtfloat) 0);
+  spec_factor = std::pow(spec_factor, sp_pow);
+  e.specular = falloff_factor * spec_factor * ks * light.color;
+
+  return e;
+}
+
+
+/* Paths that can no longer contribute visibly are cut, or with Russian
+ * roulette, continued with reweighting */
+bool reflect_path(const render_options &opts, const shading_point &sp,
+                  path_state *path, ray3f *ray, rtfloat *scale) {
+  color3f kr = sp.mat->reflective;
+  if (path->bounces <= 0 || (kr.r == 0 && kr.g == 0 && kr.b == 0))
+    return false;
+
+  path->bounces -= 1;
+  path->weight = path->weight * kr;
+  rtfloat contribution = max_component(path->weight);
+  *scale = 1;
+
+  if (opts.roulette > 0 && contribution < opts.roulette) {
+    rtfloat survive = contribution / opts.roulette;
+    if (rng_float(&path->rng) >= survive)
+      return false;
+    *scale = 1 / survive;
+    path->weight = path->weight * *scale;
+
+  } else if (contribution < opts.min_weight) {
+    return false;
+  }
+
+  vec3f refl_dir = -sp.eye_dir + 2*dot(sp.normal, sp.eye_dir) * sp.normal;
+  *ray = { sp.point + bounce_delt * refl_dir, refl_dir };
+  return true;
+}
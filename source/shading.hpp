@@ -0,0 +1,157 @@
+#ifndef _RAYTRACER_SHADING_HPP
+#define _RAYTRACER_SHADING_HPP
+
+
+#include <algorithm>
+#include <cstdint>
+#include <vector>
+
+#include "common.hpp"
+#include "light_tree.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+
+
+/* Building blocks shared by the render engines. An engine traces camera
+ * rays, shades each hit with the lights from for_each_light and follows
+ * the reflection ray from reflect_path */
+
+
+struct raster_bins;
+
+
+/* The frame being rendered */
+struct render_context {
+  scene *s;
+  const render_options *opts;
+  const pixel_sampler *sampler;
+  size_t width, height;         // Full frame size
+  const scene_camera *camera;   // The scene's, unless a frame has its own
+  const raster_bins *raster;    // Primary visibility, or null to trace it
+};
+
+
+struct camera_sample {
+  size_t px, py;        // Pixel, counting rows from the top
+  size_t index, count;  // Sample index out of count in the pixel
+};
+
+/* State carried along a path of reflections */
+struct path_state {
+  int bounces;      // Reflections left
+  color3f weight;   // Product of the reflectivities along the path
+  rng_state rng;    // For light selection and Russian roulette
+};
+
+ray3f camera_ray(const render_context &, const camera_sample &);
+path_state initial_path(const render_options &, const camera_sample &);
+
+
+// Distance along ray to obj in units of the ray direction's length, with
+// the normal filled in only if the hit is closer than max_dist
+ray_intersection object_test(scene_object *obj, ray3f ray, rtfloat invmagdir,
+                             rtfloat max_dist);
+
+ray_intersection trace_ray(scene *, ray3f);
+// If cache is given, the object in it is tested first, and it is updated
+// with the blocking object
+bool occluded(scene *, ray3f, rtfloat max_dist,
+              scene_object **cache = nullptr);
+
+// Camera rays for the samples and their closest hits, from the raster pass
+// if there is one. If cost is not null, it gets the traversal steps of
+// each ray
+void trace_primary(const render_context &, const camera_sample *samples,
+                   size_t count, ray3f *rays, ray_intersection *hits,
+                   uint64_t *cost = nullptr);
+
+// AOVs of single samples, from their camera rays and first hits
+void primary_aovs(const ray3f *rays, const ray_intersection *hits,
+                  size_t count, pixel_aov *aovs);
+
+
+struct shading_point {
+  const object_material *mat;
+  vec3f point;
+  vec3f normal;     // Facing the viewer
+  vec3f eye_dir;
+};
+
+shading_point make_shading_point(ray3f ray, const ray_intersection &hit);
+
+
+/* Contribution of one light at a shading point, scaled by the light's
+ * selection weight. The diffuse and specular parts only count if the
+ * shadow ray reaches the light */
+struct light_eval {
+  color3f ambient;
+  color3f diffuse;
+  color3f specular;
+  bool direct;        // False for ambient lights, which cast no shadows
+  ray3f shadow_ray;
+  rtfloat light_dist;
+};
+
+light_eval evaluate_light(const light_source &, const shading_point &,
+                          rtfloat weight);
+
+
+static inline rtfloat max_component(color3f c) {
+  return std::max(c.r, std::max(c.g, c.b));
+}
+
+// Calls f(light_eval) for every light that shades the point
+template <typename F>
+void for_each_light(const render_context &ctx, const shading_point &sp,
+                    path_state *path, F f) {
+  scene *s = ctx.s;
+  const render_options &opts = *ctx.opts;
+
+  if (s->light_structure == nullptr || opts.light_samples == 0) {
+    for (const light_source &light : s->lights)
+      f(evaluate_light(light, sp, 1));
+    return;
+  }
+
+  /* Ambient and directional lights are cheap and exact. Point lights come
+   * from the light tree */
+  for (const light_source &light : s->lights) {
+    if (light.type != light_type::point)
+      f(evaluate_light(light, sp, 1));
+  }
+
+  const object_material &mat = *sp.mat;
+  rtfloat scale = max_component(path->weight) *
+                  (max_component(mat.ambient) + max_component(mat.diffuse) +
+                   max_component(mat.specular));
+  std::vector<light_sample> samples;
+  select_lights(s->light_structure, sp.point, scale, opts.light_cutoff,
+                opts.light_samples, &path->rng, &samples);
+
+  for (light_sample &ls : samples)
+    f(evaluate_light(*ls.light, sp, ls.weight));
+}
+
+
+// Advances the path to its reflection ray. Returns false if the path ends
+// here, otherwise the reflected light should be scaled by scale * kr
+bool reflect_path(const render_options &, const shading_point &,
+                  path_state *path, ray3f *ray, rtfloat *scale);
+
+
+
+/* Render engines. Each traces a batch of camera samples and writes the
+ * color of samples[i] to results[i], and its AOVs to aovs[i] if aovs is not
+ * null */
+
+// Depth first, shading each hit as soon as it is found
+void trace_recursive(const render_context &, const camera_sample *samples,
+                     size_t count, color3f *results, pixel_aov *aovs);
+
+// Breadth first, in stages over queues of rays (wavefront.cpp)
+void trace_wavefront(const render_context &, const camera_sample *samples,
+                     size_t count, color3f *results, pixel_aov *aovs);
+
+
+#endif
@@ -39,6 +39,10 @@ aa_box3f sphere_object::bounding_box() {
   return { center - r, center + r };
 }
 
+size_t sphere_object::memory_size() {
+  return sizeof(sphere_object);
+}
+
 
 
 void triangle_object::default_normals() {
@@ -103,6 +107,10 @@ aa_box3f triangle_object::bounding_box() {
   return box;
 }
 
+size_t triangle_object::memory_size() {
+  return sizeof(triangle_object);
+}
+
 
 bool triangle_object::apply_affine(const transform3f &trans) {
   for (int i = 0; i < 3; i++)
@@ -12,6 +12,7 @@ struct sphere_object : scene_object {
 
   virtual ray_intersection ray_test(ray3f ray);
   virtual aa_box3f bounding_box();
+  virtual size_t memory_size();
 };
 
 
@@ -23,6 +24,7 @@ struct triangle_object : scene_object {
 
   virtual ray_intersection ray_test(ray3f ray);
   virtual aa_box3f bounding_box();
+  virtual size_t memory_size();
   
   virtual bool apply_affine(const transform3f &);
 };
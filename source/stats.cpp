@@ -0,0 +1,51 @@
+#include <mutex>
+#include <vector>
+
+#include "stats.hpp"
+
+
+static std::mutex registry_mutex;
+static std::vector<trace_counters *> registry;
+
+
+static trace_counters *register_counters() {
+  trace_counters *counters = new trace_counters();
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  registry.push_back(counters);
+  return counters;
+}
+
+trace_counters &thread_counters() {
+  // Blocks outlive their threads so their counts can still be summed
+  thread_local trace_counters *counters = register_counters();
+  return *counters;
+}
+
+
+static void add(ray_counts *total, const ray_counts &counts) {
+  total->rays += counts.rays;
+  total->nodes += counts.nodes;
+  total->primitives += counts.primitives;
+}
+
+trace_counters sum_counters() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  trace_counters total = trace_counters();
+  for (trace_counters *c : registry) {
+    total.nodes_visited += c->nodes_visited;
+    total.primitives_tested += c->primitives_tested;
+    total.occluder_cache_hits += c->occluder_cache_hits;
+    for (int b = 0; b < leaf_buckets; b++)
+      total.leaf_visits[b] += c->leaf_visits[b];
+    add(&total.primary, c->primary);
+    add(&total.shadow, c->shadow);
+    add(&total.reflection, c->reflection);
+  }
+  return total;
+}
+
+void reset_counters() {
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  for (trace_counters *c : registry)
+    *c = trace_counters();
+}
@@ -0,0 +1,76 @@
+#ifndef _RAYTRACER_STATS_HPP
+#define _RAYTRACER_STATS_HPP
+
+
+#include <cstddef>
+#include <cstdint>
+
+
+/* Cheap event counters. Each thread counts into its own block, and the
+ * blocks are summed when a render is done */
+
+// Rays of one kind, with the nodes visited and primitives tested while
+// tracing them
+struct ray_counts {
+  uint64_t rays;
+  uint64_t nodes;
+  uint64_t primitives;
+};
+
+// Leaf sizes are counted in buckets of 1, 2-3, 4-7, ... and 128 or more
+// objects
+static const int leaf_buckets = 8;
+
+struct trace_counters {
+  uint64_t nodes_visited;         // Spatial structure nodes
+  uint64_t primitives_tested;
+  uint64_t occluder_cache_hits;   // Shadow rays resolved without traversal
+  uint64_t leaf_visits[leaf_buckets];   // Leaves whose box a ray entered
+
+  ray_counts primary;
+  ray_counts shadow;
+  ray_counts reflection;
+};
+
+trace_counters &thread_counters();
+
+static inline uint64_t traversal_steps(const trace_counters &c) {
+  return c.nodes_visited + c.primitives_tested;
+}
+
+static inline int leaf_bucket(size_t objects) {
+  int bucket = 0;
+  while (objects > 1 && bucket < leaf_buckets - 1) {
+    objects >>= 1;
+    bucket++;
+  }
+  return bucket;
+}
+
+
+/* Traversal done between a mark and a count_rays call is charged to the
+ * rays counted */
+
+struct traversal_mark {
+  uint64_t nodes;
+  uint64_t primitives;
+};
+
+static inline traversal_mark mark_traversal(const trace_counters &c) {
+  return { c.nodes_visited, c.primitives_tested };
+}
+
+static inline void count_rays(ray_counts *counts, const trace_counters &c,
+                              traversal_mark since, uint64_t rays = 1) {
+  counts->rays += rays;
+  counts->nodes += c.nodes_visited - since.nodes;
+  counts->primitives += c.primitives_tested - since.primitives;
+}
+
+
+// Not safe while a render is running
+trace_counters sum_counters();
+void reset_counters();
+
+
+#endif
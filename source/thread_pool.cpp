@@ -0,0 +1,110 @@
+#include <algorithm>
+#include <atomic>
+#include <condition_variable>
+#include <functional>
+#include <mutex>
+#include <thread>
+#include <vector>
+
+#include "thread_pool.hpp"
+
+
+struct thread_pool {
+  std::vector<std::thread> threads;
+
+  std::mutex submit_mutex;
+  std::mutex mutex;
+  std::condition_variable wake;
+  std::condition_variable finished;
+
+  std::function<void(size_t, size_t)> task;
+  size_t count = 0;
+  std::atomic<size_t> next;
+  size_t active = 0;
+  unsigned long generation = 0;
+  bool quit = false;
+};
+
+
+static void run_tasks(thread_pool *pool, size_t thread) {
+  size_t index;
+  while ((index = pool->next++) < pool->count)
+    pool->task(index, thread);
+}
+
+static void worker_main(thread_pool *pool, size_t thread) {
+  unsigned long seen = 0;
+  std::unique_lock<std::mutex> lock(pool->mutex);
+
+  while (true) {
+    pool->wake.wait(lock, [&] {
+      return pool->quit || pool->generation != seen;
+    });
+    if (pool->quit) return;
+    seen = pool->generation;
+
+    lock.unlock();
+    run_tasks(pool, thread);
+    lock.lock();
+
+    if (--pool->active == 0)
+      pool->finished.notify_all();
+  }
+}
+
+
+thread_pool *thread_pool_create(size_t num_threads) {
+  if (num_threads == 0)
+    num_threads = std::max(std::thread::hardware_concurrency(), 1U);
+
+  thread_pool *pool = new thread_pool;
+  pool->next = 0;
+  for (size_t t = 1; t < num_threads; t++)
+    pool->threads.push_back(std::thread(worker_main, pool, t));
+  return pool;
+}
+
+void thread_pool_destroy(thread_pool *pool) {
+  if (pool == nullptr) return;
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->quit = true;
+  }
+  pool->wake.notify_all();
+  for (std::thread &thread : pool->threads)
+    thread.join();
+  delete pool;
+}
+
+
+size_t thread_count(thread_pool *pool) {
+  return pool->threads.size() + 1;
+}
+
+
+void parallel_for(thread_pool *pool, size_t count,
+                  std::function<void(size_t, size_t)> task) {
+  std::lock_guard<std::mutex> submit(pool->submit_mutex);
+
+  if (pool->threads.empty()) {
+    for (size_t i = 0; i < count; i++)
+      task(i, 0);
+    return;
+  }
+
+  {
+    std::lock_guard<std::mutex> lock(pool->mutex);
+    pool->task = task;
+    pool->count = count;
+    pool->next = 0;
+    pool->active = pool->threads.size();
+    pool->generation += 1;
+  }
+  pool->wake.notify_all();
+
+  run_tasks(pool, 0);
+
+  std::unique_lock<std::mutex> lock(pool->mutex);
+  pool->finished.wait(lock, [&] { return pool->active == 0; });
+  pool->task = nullptr;
+}
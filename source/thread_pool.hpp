@@ -0,0 +1,24 @@
+#ifndef _RAYTRACER_THREAD_POOL_HPP
+#define _RAYTRACER_THREAD_POOL_HPP
+
+
+#include <functional>
+
+
+/* Fixed set of worker threads. The calling thread takes part in the work as
+ * thread 0, so a pool of size 1 runs everything inline */
+
+struct thread_pool;
+
+thread_pool *thread_pool_create(size_t num_threads);  // 0 for one per core
+void thread_pool_destroy(thread_pool *);
+
+size_t thread_count(thread_pool *);
+
+// Calls task(index, thread) for every index in [0, count) and waits for
+// all of them to finish. Calls from different threads are serialized
+void parallel_for(thread_pool *, size_t count,
+                  std::function<void(size_t, size_t)> task);
+
+
+#endif
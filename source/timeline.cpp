@@ -0,0 +1,96 @@
+#include <cstdio>
+#include <mutex>
+#include <vector>
+
+#include "timeline.hpp"
+
+
+std::atomic<bool> timeline_on(false);
+
+static std::chrono::steady_clock::time_point epoch;
+
+
+struct timeline_event {
+  const char *name;
+  const char *category;
+  std::chrono::steady_clock::time_point start, end;
+  int64_t x, y;
+};
+
+struct timeline_buffer {
+  size_t thread;      // In order of first event
+  std::vector<timeline_event> events;
+};
+
+static std::mutex registry_mutex;
+static std::vector<timeline_buffer *> registry;
+
+
+static timeline_buffer *register_buffer() {
+  timeline_buffer *buffer = new timeline_buffer;
+  buffer->events.reserve(1024);
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  buffer->thread = registry.size();
+  registry.push_back(buffer);
+  return buffer;
+}
+
+static timeline_buffer &thread_buffer() {
+  // Buffers outlive their threads so they can still be written
+  thread_local timeline_buffer *buffer = register_buffer();
+  return *buffer;
+}
+
+
+void timeline_enable() {
+  epoch = std::chrono::steady_clock::now();
+  timeline_on = true;
+}
+
+void timeline_record(const char *name, const char *category,
+                     std::chrono::steady_clock::time_point start,
+                     int64_t x, int64_t y) {
+  thread_buffer().events.push_back({ name, category, start,
+                                     std::chrono::steady_clock::now(),
+                                     x, y });
+}
+
+
+
+/* Complete ("X") events with times in microseconds, plus the names of the
+ * threads */
+
+static double micros(std::chrono::steady_clock::duration d) {
+  return std::chrono::duration<double, std::micro>(d).count();
+}
+
+bool timeline_write(const std::string &path) {
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) return false;
+
+  std::lock_guard<std::mutex> lock(registry_mutex);
+  fprintf(file, "{\"traceEvents\": [\n");
+  bool first = true;
+
+  for (timeline_buffer *buffer : registry) {
+    fprintf(file, "%s{\"name\": \"thread_name\", \"ph\": \"M\", "
+                  "\"pid\": 1, \"tid\": %zu, "
+                  "\"args\": {\"name\": \"thread %zu\"}}",
+            first ? "" : ",\n", buffer->thread, buffer->thread);
+    first = false;
+
+    for (const timeline_event &e : buffer->events) {
+      fprintf(file, ",\n{\"name\": \"%s\", \"cat\": \"%s\", \"ph\": \"X\", "
+                    "\"pid\": 1, \"tid\": %zu, \"ts\": %.3f, \"dur\": %.3f",
+              e.name, e.category, buffer->thread, micros(e.start - epoch),
+              micros(e.end - e.start));
+      if (e.x >= 0)
+        fprintf(file, ", \"args\": {\"x\": %lld, \"y\": %lld}",
+                (long long) e.x, (long long) e.y);
+      fprintf(file, "}");
+    }
+  }
+
+  fprintf(file, "\n], \"displayTimeUnit\": \"ms\"}\n");
+  return fclose(file) == 0;
+}
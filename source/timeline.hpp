@@ -0,0 +1,56 @@
+#ifndef _RAYTRACER_TIMELINE_HPP
+#define _RAYTRACER_TIMELINE_HPP
+
+
+#include <atomic>
+#include <chrono>
+#include <cstdint>
+#include <string>
+
+
+/* Timeline of what each thread was doing, for the Chrome trace viewer
+ * (chrome://tracing or ui.perfetto.dev). Each thread appends its events to
+ * a buffer of its own, so recording takes no locks. Until the timeline is
+ * enabled, an event costs a load and a branch */
+
+extern std::atomic<bool> timeline_on;
+
+// Call before the threads to be recorded start work
+void timeline_enable();
+
+static inline bool timeline_enabled() {
+  return timeline_on.load(std::memory_order_relaxed);
+}
+
+// Names and categories must be string literals, as only the pointers are
+// kept. x and y are shown as arguments of the event if x is not negative
+void timeline_record(const char *name, const char *category,
+                     std::chrono::steady_clock::time_point start,
+                     int64_t x = -1, int64_t y = -1);
+
+// Records the lifetime of the scope as an event
+struct timeline_scope {
+  const char *name;
+  const char *category;
+  int64_t x, y;
+  bool active;
+  std::chrono::steady_clock::time_point start;
+
+  timeline_scope(const char *name, const char *category,
+                 int64_t x = -1, int64_t y = -1)
+      : name(name), category(category), x(x), y(y),
+        active(timeline_enabled()) {
+    if (active) start = std::chrono::steady_clock::now();
+  }
+
+  ~timeline_scope() {
+    if (active) timeline_record(name, category, start, x, y);
+  }
+};
+
+// Not safe while threads are recording. Returns false if the file cannot
+// be written
+bool timeline_write(const std::string &path);
+
+
+#endif
@@ -0,0 +1,68 @@
+#include <algorithm>
+#include <cmath>
+#include <string>
+
+#include "common.hpp"
+#include "framebuffer.hpp"
+#include "sampler.hpp"
+#include "tonemap.hpp"
+
+
+bool parse_tonemap_operator(std::string name, tonemap_operator *op) {
+  if (name == "clamp") *op = tonemap_operator::clamp;
+  else if (name == "reinhard") *op = tonemap_operator::reinhard;
+  else if (name == "aces") *op = tonemap_operator::aces;
+  else return false;
+  return true;
+}
+
+
+static rtfloat aces_curve(rtfloat x) {
+  x = std::max(x, (rtfloat) 0);
+  return clamp((x * (2.51*x + 0.03)) / (x * (2.43*x + 0.59) + 0.14),
+               (rtfloat) 0, (rtfloat) 1);
+}
+
+color3f tonemap(color3f c, const tonemap_options &opts) {
+  if (opts.exposure != 0)
+    c = c * std::pow((rtfloat) 2, opts.exposure);
+
+  switch (opts.op) {
+  case tonemap_operator::clamp:
+    break;
+  case tonemap_operator::reinhard: {
+    rtfloat lum = luminance(c);
+    if (lum > 0)
+      c = c / (1 + lum);
+    break;
+  }
+  case tonemap_operator::aces:
+    c = { aces_curve(c.r), aces_curve(c.g), aces_curve(c.b) };
+    break;
+  }
+
+  if (opts.gamma != 1) {
+    rtfloat e = 1 / opts.gamma;
+    c = { std::pow(std::max(c.r, (rtfloat) 0), e),
+          std::pow(std::max(c.g, (rtfloat) 0), e),
+          std::pow(std::max(c.b, (rtfloat) 0), e) };
+  }
+  return c;
+}
+
+
+void quantize(color3f display, size_t x, size_t y,
+              const tonemap_options &opts, unsigned char *rgb) {
+  for (int k = 0; k < 3; k++) {
+    rtfloat v = clamp(display.data[k] * 255, (rtfloat) -1, (rtfloat) 256);
+    int q;
+    if (opts.dither) {
+      // Adding uniform noise before flooring makes the rounding unbiased
+      uint32_t h = hash32((uint32_t) x, (uint32_t) y, (uint32_t) k);
+      q = (int) std::floor(v + h * (1 / 4294967296.0));
+    } else {
+      q = (int) v;
+    }
+    rgb[k] = (unsigned char) clamp(q, 0, 255);
+  }
+}
@@ -0,0 +1,38 @@
+#ifndef _RAYTRACER_TONEMAP_HPP
+#define _RAYTRACER_TONEMAP_HPP
+
+
+#include <string>
+
+#include "common.hpp"
+
+
+/* Display transform from rendered radiance to 8-bit values. The defaults
+ * (no exposure change, gamma 1, clamping, no dithering) give the classic
+ * output of color * 255 truncated */
+
+enum class tonemap_operator {
+  clamp,        // Values above 1 saturate
+  reinhard,     // L / (1 + L) on luminance, keeping hue
+  aces,         // Filmic curve (Narkowicz's ACES fit), per channel
+};
+
+struct tonemap_options {
+  rtfloat exposure = 0;   // In stops
+  rtfloat gamma = 1;      // Output is raised to 1 / gamma
+  tonemap_operator op = tonemap_operator::clamp;
+  bool dither = false;    // Randomize rounding to hide banding
+};
+
+bool parse_tonemap_operator(std::string name, tonemap_operator *op);
+
+// Display color, in [0, 1] except for clamp, which leaves clamping to
+// quantize
+color3f tonemap(color3f, const tonemap_options &);
+
+// 8-bit value of each channel of a display color for pixel (x, y)
+void quantize(color3f display, size_t x, size_t y, const tonemap_options &,
+              unsigned char *rgb);
+
+
+#endif
@@ -32,4 +32,20 @@ inline std::string get_directory(std::string filename) {
 }
 
 
+inline bool read_file(const std::string &filename, std::string *contents) {
+  FILE *file = fopen(filename.c_str(), "rb");
+  if (file == nullptr) return false;
+
+  char buffer[65536];
+  size_t n;
+  contents->clear();
+  while ((n = fread(buffer, 1, sizeof(buffer), file)) > 0)
+    contents->append(buffer, n);
+
+  bool ok = !ferror(file);
+  fclose(file);
+  return ok;
+}
+
+
 #endif
@@ -0,0 +1,210 @@
+#include <algorithm>
+#include <cstdint>
+#include <utility>
+#include <vector>
+
+#include "common.hpp"
+#include "render.hpp"
+#include "sampler.hpp"
+#include "scene.hpp"
+#include "shading.hpp"
+#include "stats.hpp"
+
+
+/* Wavefront engine. Instead of following each path to the end, all rays of
+ * a batch go through one stage at a time: intersection, then shading, which
+ * queues shadow and reflection rays, then occlusion of the shadow rays.
+ * Reflection rays form the next wavefront. Contributions are added to
+ * their sample in queue order, so results are deterministic */
+
+struct wavefront_ray {
+  ray3f ray;
+  path_state path;
+  size_t sample;
+};
+
+struct shadow_ray {
+  ray3f ray;
+  rtfloat light_dist;
+  color3f contribution;   // Added to the sample if the light is visible
+  size_t sample;
+};
+
+struct wavefront_queues {
+  std::vector<wavefront_ray> rays;
+  std::vector<ray_intersection> hits;
+  std::vector<shadow_ray> shadows;
+  std::vector<wavefront_ray> next;
+  std::vector<uint64_t> cost;   // Traversal steps of each sample, only
+                                // counted for AOVs
+};
+
+
+/* Coherence sorting. Secondary rays start at scattered points and head in
+ * scattered directions. Ordering them by direction octant and then by the
+ * Morton code of their origin makes consecutive rays traverse similar
+ * parts of the scene */
+
+static inline uint32_t spread_bits(uint32_t x) {
+  x &= 0x3ff;
+  x = (x | (x << 16)) & 0x030000ff;
+  x = (x | (x << 8)) & 0x0300f00f;
+  x = (x | (x << 4)) & 0x030c30c3;
+  x = (x | (x << 2)) & 0x09249249;
+  return x;
+}
+
+// The Morton code takes bits 0-29, so the octant goes above them
+static inline uint64_t coherence_key(ray3f ray, const aa_box3f &bounds) {
+  uint32_t code = 0;
+  for (int k = 0; k < 3; k++) {
+    rtfloat extent = bounds.high_v.data[k] - bounds.low_v.data[k];
+    rtfloat t = extent > 0 ? (ray.start.data[k] - bounds.low_v.data[k]) /
+                              extent : 0;
+    uint32_t q = (uint32_t) clamp(t * 1024, (rtfloat) 0, (rtfloat) 1023);
+    code |= spread_bits(q) << k;
+  }
+
+  uint32_t octant = (ray.dir.x < 0 ? 1 : 0) | (ray.dir.y < 0 ? 2 : 0) |
+                    (ray.dir.z < 0 ? 4 : 0);
+  return (uint64_t) octant << 30 | code;
+}
+
+template <typename T>
+static void sort_coherent(std::vector<T> *queue) {
+  if (queue->size() < 2) return;
+
+  aa_box3f bounds = {
+    rtfloat_inf, rtfloat_inf, rtfloat_inf,
+    -rtfloat_inf, -rtfloat_inf, -rtfloat_inf
+  };
+  for (const T &r : *queue)
+    expand(&bounds, { r.ray.start, r.ray.start });
+
+  std::vector<std::pair<uint64_t, size_t>> keys(queue->size());
+  for (size_t i = 0; i < queue->size(); i++)
+    keys[i] = { coherence_key((*queue)[i].ray, bounds), i };
+  std::stable_sort(keys.begin(), keys.end(),
+                   [](const std::pair<uint64_t, size_t> &a,
+                      const std::pair<uint64_t, size_t> &b) {
+                     return a.first < b.first;
+                   });
+
+  std::vector<T> sorted;
+  sorted.reserve(queue->size());
+  for (auto &key : keys)
+    sorted.push_back((*queue)[key.second]);
+  queue->swap(sorted);
+}
+
+
+static void intersect_stage(scene *s, wavefront_queues *q) {
+  q->hits.resize(q->rays.size());
+  if (q->cost.empty()) {
+    for (size_t i = 0; i < q->rays.size(); i++)
+      q->hits[i] = trace_ray(s, q->rays[i].ray);
+    return;
+  }
+
+  trace_counters &counters = thread_counters();
+  for (size_t i = 0; i < q->rays.size(); i++) {
+    uint64_t steps = traversal_steps(counters);
+    q->hits[i] = trace_ray(s, q->rays[i].ray);
+    q->cost[q->rays[i].sample] += traversal_steps(counters) - steps;
+  }
+}
+
+
+static void shade_stage(const render_context &ctx, wavefront_queues *q,
+                        color3f *results) {
+  q->shadows.clear();
+  q->next.clear();
+
+  for (size_t i = 0; i < q->rays.size(); i++) {
+    if (q->hits[i].dist == rtfloat_inf) continue;
+
+    wavefront_ray &r = q->rays[i];
+    shading_point sp = make_shading_point(r.ray, q->hits[i]);
+    color3f weight = r.path.weight;
+
+    for_each_light(ctx, sp, &r.path, [&](const light_eval &e) {
+      results[r.sample] = results[r.sample] + weight * e.ambient;
+      if (e.direct) {
+        color3f direct = weight * (e.diffuse + e.specular);
+        q->shadows.push_back({e.shadow_ray, e.light_dist, direct, r.sample});
+      }
+    });
+
+    wavefront_ray refl = r;
+    rtfloat scale;
+    if (reflect_path(*ctx.opts, sp, &refl.path, &refl.ray, &scale))
+      q->next.push_back(refl);
+  }
+}
+
+
+static void occlusion_stage(scene *s, wavefront_queues *q,
+                            color3f *results) {
+  trace_counters &counters = thread_counters();
+  scene_object *cache = nullptr;
+  for (shadow_ray &sr : q->shadows) {
+    uint64_t steps = traversal_steps(counters);
+    if (!occluded(s, sr.ray, sr.light_dist, &cache))
+      results[sr.sample] = results[sr.sample] + sr.contribution;
+    if (!q->cost.empty())
+      q->cost[sr.sample] += traversal_steps(counters) - steps;
+  }
+}
+
+
+void trace_wavefront(const render_context &ctx, const camera_sample *samples,
+                     size_t count, color3f *results, pixel_aov *aovs) {
+  scene *s = ctx.s;
+  const render_options &opts = *ctx.opts;
+  wavefront_queues q;
+
+  /* Primary rays, which may come with their hits from the raster pass */
+  std::vector<ray3f> rays(count);
+  q.hits.resize(count);
+  if (aovs != nullptr)
+    q.cost.resize(count);
+  trace_primary(ctx, samples, count, rays.data(), q.hits.data(),
+                aovs != nullptr ? q.cost.data() : nullptr);
+  if (aovs != nullptr)
+    primary_aovs(rays.data(), q.hits.data(), count, aovs);
+
+  q.rays.reserve(count);
+  for (size_t i = 0; i < count; i++) {
+    results[i] = {0, 0, 0};
+    q.rays.push_back({rays[i], initial_path(opts, samples[i]), i});
+  }
+
+  trace_counters &counters = thread_counters();
+  bool primary = true;
+
+  while (!q.rays.empty()) {
+    if (!primary && opts.sort_rays)
+      sort_coherent(&q.rays);
+
+    if (!primary) {
+      traversal_mark mark = mark_traversal(counters);
+      intersect_stage(s, &q);
+      count_rays(&counters.reflection, counters, mark, q.rays.size());
+    }
+
+    shade_stage(ctx, &q, results);
+
+    if (opts.sort_rays)
+      sort_coherent(&q.shadows);
+
+    traversal_mark mark = mark_traversal(counters);
+    occlusion_stage(s, &q, results);
+    count_rays(&counters.shadow, counters, mark, q.shadows.size());
+
+    std::swap(q.rays, q.next);
+    primary = false;
+  }
+
+  for (size_t i = 0; i < q.cost.size(); i++)
+    aovs[i].cost = (rtfloat) q.cost[i];
+}
@@ -0,0 +1,459 @@
+/* Benchmark driver. Renders the examples and a few larger generated scenes
+ * with each acceleration structure and thread count, and writes wall time,
+ * ray rates and peak memory as JSON. Given a baseline from an earlier run,
+ * fails if any case got slower or bigger by more than the threshold. A case
+ * that fails, or a case of the baseline that no longer runs, fails too.
+ *
+ * Each case runs in a child process, so its peak RSS is its own */
+
+#include <algorithm>
+#include <chrono>
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <map>
+#include <string>
+#include <thread>
+#include <vector>
+
+#include <sys/resource.h>
+#include <sys/wait.h>
+#include <unistd.h>
+
+#include "raytracer.hpp"
+#include "sampler.hpp"
+#include "stats.hpp"
+
+
+struct bench_scene {
+  std::string name;
+  std::string path;       // Scene file, or empty for generated contents
+  std::string contents;
+  bool light_samples;     // Render with the light tree
+};
+
+struct bench_case {
+  const bench_scene *scene;
+  structure_type structure;
+  size_t threads;
+  std::string name;
+};
+
+struct bench_result {
+  double load_seconds;
+  double seconds;         // Best render time over the repeats
+  uint64_t primary_rays;
+  uint64_t shadow_rays;
+  uint64_t reflection_rays;
+  double rays_per_second;
+  long peak_rss_kb;
+  bool ok;
+  bool skipped;           // Left out on purpose, not failed
+};
+
+
+static size_t image_size = 256;
+static size_t repeats = 3;
+static double threshold = 10;     // Percent
+static size_t max_list_objects = 2000;
+
+
+/* Generated scenes. They only depend on fixed seeds, so every run renders
+ * the same thing. Random values are drawn into variables in order, never
+ * as several arguments of one call, whose order the compiler picks */
+
+static std::string sphere_grid(int n) {
+  std::string s = "cam  0 0 0  -0.5 -0.5 -1  0.5 -0.5 -1  -0.5 0.5 -1  "
+                  "0.5 0.5 -1\n"
+                  "ltp  4 6 0  0.8 0.8 0.8  0\n"
+                  "ltd  -1 -1 -1  0.3 0.3 0.3\n"
+                  "lta  0.1 0.1 0.1\n";
+  rng_state rng = rng_create(1, 0);
+  for (int i = 0; i < n; i++) {
+    for (int j = 0; j < n; j++) {
+      rtfloat r = rng_float(&rng), g = rng_float(&rng), b = rng_float(&rng);
+      s += stringf("mat  %.3f %.3f %.3f  %.3f %.3f %.3f  0.5 0.5 0.5  20  "
+                   "0.3 0.3 0.3\n", r * 0.2, g * 0.2, b * 0.2, r, g, b);
+      s += stringf("sph  %.3f %.3f %.3f  %.3f\n",
+                   (i - n / 2.0) * 0.25, (j - n / 2.0) * 0.25,
+                   -8 - 4 * rng_float(&rng), 0.1);
+    }
+  }
+  return s;
+}
+
+static std::string triangle_soup(int n) {
+  std::string s = "cam  0 0 0  -0.5 -0.5 -1  0.5 -0.5 -1  -0.5 0.5 -1  "
+                  "0.5 0.5 -1\n"
+                  "ltp  0 0 0  1 1 1  0\n"
+                  "lta  0.1 0.1 0.1\n"
+                  "mat  0.1 0.1 0.1  0.6 0.6 0.6  0.3 0.3 0.3  10  "
+                  "0.2 0.2 0.2\n";
+  rng_state rng = rng_create(2, 0);
+  for (int i = 0; i < n; i++) {
+    rtfloat cx = rng_float(&rng) * 8 - 4;
+    rtfloat cy = rng_float(&rng) * 8 - 4;
+    rtfloat cz = -6 - rng_float(&rng) * 8;
+    s += "tri";
+    for (int k = 0; k < 3; k++) {
+      rtfloat x = cx + rng_float(&rng) * 0.4 - 0.2;
+      rtfloat y = cy + rng_float(&rng) * 0.4 - 0.2;
+      rtfloat z = cz + rng_float(&rng) * 0.4 - 0.2;
+      s += stringf("  %.3f %.3f %.3f", x, y, z);
+    }
+    s += "\n";
+  }
+  return s;
+}
+
+static std::string many_lights(int n) {
+  std::string s = "cam  0 1 4  -0.5 0.5 3  0.5 0.5 3  -0.5 1.5 3  "
+                  "0.5 1.5 3\n"
+                  "mat  0 0 0  0.8 0.8 0.8  0 0 0  1  0 0 0\n"
+                  "tri  -50 -1 50  50 -1 50  50 -1 -50\n"
+                  "tri  -50 -1 50  50 -1 -50  -50 -1 -50\n"
+                  "mat  0 0 0  0.6 0.6 0.6  0.5 0.5 0.5  50  0.2 0.2 0.2\n";
+  for (int i = -2; i <= 2; i++)
+    s += stringf("sph  %d 0 -6  0.8\n", i * 2);
+
+  rng_state rng = rng_create(3, 0);
+  for (int i = 0; i < n; i++) {
+    rtfloat x = rng_float(&rng) * 40 - 20;
+    rtfloat y = 0.5 + rng_float(&rng) * 3;
+    rtfloat z = -rng_float(&rng) * 30;
+    rtfloat r = rng_float(&rng) * 0.3;
+    rtfloat g = rng_float(&rng) * 0.3;
+    rtfloat b = rng_float(&rng) * 0.3;
+    s += stringf("ltp  %.3f %.3f %.3f  %.3f %.3f %.3f  2\n", x, y, z, r, g,
+                 b);
+  }
+  return s;
+}
+
+
+static std::vector<bench_scene> bench_scenes(const std::string &examples) {
+  std::vector<bench_scene> scenes;
+  for (int i = 1; i <= 15; i++) {
+    std::string name = stringf("input-%02d", i);
+    scenes.push_back({ name, examples + "/" + name, "", false });
+  }
+  scenes.push_back({ "spheres-10k", "", sphere_grid(100), false });
+  scenes.push_back({ "triangles-20k", "", triangle_soup(20000), false });
+  scenes.push_back({ "lights-1k", "", many_lights(1000), true });
+  return scenes;
+}
+
+
+
+/* Running a case */
+
+static double seconds_since(std::chrono::steady_clock::time_point start) {
+  std::chrono::duration<double> elapsed =
+      std::chrono::steady_clock::now() - start;
+  return elapsed.count();
+}
+
+// In the child process. Returns false if the scene fails to load or the
+// case is skipped
+static bool run_case(const bench_case &c, bench_result *result) {
+  load_options load;
+  load.structure = c.structure;
+  load.light_tree = c.scene->light_samples;
+
+  auto start = std::chrono::steady_clock::now();
+  scene *s = c.scene->path.empty() ?
+      scene_load_memory(c.scene->contents, c.scene->name, load) :
+      scene_load_file(c.scene->path, load);
+  result->load_seconds = seconds_since(start);
+  if (s == nullptr) return false;
+
+  // Linear scenes with many objects would take hours
+  if (c.structure == structure_type::list &&
+      s->objects.size() > max_list_objects) {
+    scene_destroy(s);
+    result->skipped = true;
+    return false;
+  }
+
+  std::vector<float> pixels(3 * image_size * image_size);
+  render_job job;
+  job.width = job.height = image_size;
+  job.region = { 0, 0, image_size, image_size };
+  job.pixels = pixels.data();
+  job.stride = 0;
+  job.options.num_threads = c.threads;
+  job.options.light_samples = c.scene->light_samples ? 4 : 0;
+  job.options.pool = thread_pool_create(c.threads);
+
+  result->seconds = 0;
+  for (size_t r = 0; r < repeats; r++) {
+    reset_counters();
+    render_stats stats;
+    start = std::chrono::steady_clock::now();
+    render_job_run(s, job, &stats);
+    double seconds = seconds_since(start);
+
+    if (r == 0 || seconds < result->seconds) {
+      trace_counters counters = sum_counters();
+      result->seconds = seconds;
+      result->primary_rays = stats.samples;
+      result->shadow_rays = counters.shadow.rays;
+      result->reflection_rays = counters.reflection.rays;
+    }
+  }
+
+  uint64_t rays = result->primary_rays + result->shadow_rays +
+                  result->reflection_rays;
+  result->rays_per_second = rays / std::max(result->seconds, 1e-9);
+
+  thread_pool_destroy(job.options.pool);
+  scene_destroy(s);
+  return true;
+}
+
+static bench_result run_child(const bench_case &c) {
+  bench_result result = bench_result();
+  int fds[2];
+  if (pipe(fds) != 0) return result;
+
+  fflush(stdout);
+  fflush(stderr);
+  pid_t pid = fork();
+  if (pid == 0) {
+    close(fds[0]);
+    result.ok = run_case(c, &result);
+    ssize_t n = write(fds[1], &result, sizeof(result));
+    _exit(n == (ssize_t) sizeof(result) ? 0 : 1);
+  }
+  close(fds[1]);
+  if (pid < 0) {
+    close(fds[0]);
+    return result;
+  }
+
+  bench_result child = bench_result();
+  bool received = read(fds[0], &child, sizeof(child)) ==
+                  (ssize_t) sizeof(child);
+  close(fds[0]);
+
+  int status;
+  struct rusage usage;
+  if (wait4(pid, &status, 0, &usage) < 0 || !received) return result;
+  child.peak_rss_kb = usage.ru_maxrss;
+  return child;
+}
+
+
+
+/* JSON. The baseline is read back with a line scanner, so the output keeps
+ * one case per line */
+
+static std::string case_json(const bench_case &c, const bench_result &r) {
+  return stringf("{\"name\": \"%s\", \"scene\": \"%s\", "
+                 "\"structure\": \"%s\", \"threads\": %zu, "
+                 "\"width\": %zu, \"height\": %zu, "
+                 "\"load_seconds\": %.4f, \"seconds\": %.4f, "
+                 "\"primary_rays\": %llu, \"shadow_rays\": %llu, "
+                 "\"reflection_rays\": %llu, \"rays_per_second\": %.0f, "
+                 "\"peak_rss_kb\": %ld}",
+                 c.name.c_str(), c.scene->name.c_str(),
+                 c.structure == structure_type::bvh ? "bvh" : "linear",
+                 c.threads, image_size, image_size, r.load_seconds,
+                 r.seconds, (unsigned long long) r.primary_rays,
+                 (unsigned long long) r.shadow_rays,
+                 (unsigned long long) r.reflection_rays,
+                 r.rays_per_second, r.peak_rss_kb);
+}
+
+static bool json_string(const std::string &line, const std::string &key,
+                        std::string *value) {
+  size_t at = line.find("\"" + key + "\": \"");
+  if (at == std::string::npos) return false;
+  at += key.size() + 5;
+  size_t end = line.find('"', at);
+  if (end == std::string::npos) return false;
+  *value = line.substr(at, end - at);
+  return true;
+}
+
+static bool json_number(const std::string &line, const std::string &key,
+                        double *value) {
+  size_t at = line.find("\"" + key + "\": ");
+  if (at == std::string::npos) return false;
+  *value = strtod(line.c_str() + at + key.size() + 4, nullptr);
+  return true;
+}
+
+struct baseline_entry {
+  double rays_per_second;
+  double peak_rss_kb;
+};
+
+static bool read_baseline(const std::string &path,
+                          std::map<std::string, baseline_entry> *entries) {
+  std::string contents;
+  if (!read_file(path, &contents)) return false;
+
+  size_t start = 0;
+  while (start < contents.size()) {
+    size_t end = contents.find('\n', start);
+    if (end == std::string::npos) end = contents.size();
+    std::string line = contents.substr(start, end - start);
+    start = end + 1;
+
+    std::string name;
+    baseline_entry e;
+    if (json_string(line, "name", &name) &&
+        json_number(line, "rays_per_second", &e.rays_per_second) &&
+        json_number(line, "peak_rss_kb", &e.peak_rss_kb))
+      (*entries)[name] = e;
+  }
+  return true;
+}
+
+
+
+static std::vector<size_t> parse_list(const char *arg) {
+  std::vector<size_t> list;
+  for (const char *p = arg; *p != '\0';) {
+    char *end;
+    long n = strtol(p, &end, 10);
+    if (end == p || n < 1) return {};
+    list.push_back((size_t) n);
+    p = *end == ',' ? end + 1 : end;
+    if (*end != ',' && *end != '\0') return {};
+  }
+  return list;
+}
+
+static void usage() {
+  fprintf(stderr,
+      "Usage: bench [--output file] [--baseline file] [--threshold percent]\n"
+      "             [--threads n,...] [--scenes filter] [--size n]\n"
+      "             [--repeat n] [--examples dir]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  std::string output = "bench.json";
+  std::string baseline;
+  std::string filter;
+  std::string examples = "examples";
+  std::vector<size_t> threads;
+
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) usage();
+    const char *value = argv[++i];
+
+    if (arg == "--output") output = value;
+    else if (arg == "--baseline") baseline = value;
+    else if (arg == "--threshold") threshold = atof(value);
+    else if (arg == "--threads") threads = parse_list(value);
+    else if (arg == "--scenes") filter = value;
+    else if (arg == "--size") image_size = (size_t) atol(value);
+    else if (arg == "--repeat") repeats = (size_t) atol(value);
+    else if (arg == "--examples") examples = value;
+    else usage();
+
+    if ((arg == "--threads" && threads.empty()) || image_size == 0 ||
+        repeats == 0 || threshold < 0)
+      usage();
+  }
+
+  // One thread and every core, by default
+  if (threads.empty()) {
+    threads.push_back(1);
+    size_t cores = std::max(std::thread::hardware_concurrency(), 1U);
+    if (cores > 1) threads.push_back(cores);
+  }
+
+  std::map<std::string, baseline_entry> base;
+  if (!baseline.empty() && !read_baseline(baseline, &base)) {
+    fprintf(stderr, "Error: Failed to read %s\n", baseline.c_str());
+    return 1;
+  }
+
+  FILE *out = fopen(output.c_str(), "w");
+  if (out == nullptr) {
+    fprintf(stderr, "Error: Failed to open %s\n", output.c_str());
+    return 1;
+  }
+
+  std::vector<bench_scene> scenes = bench_scenes(examples);
+  structure_type structures[] = { structure_type::list, structure_type::bvh };
+
+  fprintf(stderr, "%-28s %9s %12s %10s\n", "case", "seconds", "rays/s",
+          "peak RSS");
+  fprintf(out, "{\"size\": %zu, \"cases\": [\n", image_size);
+  bool first = true;
+  size_t regressions = 0;
+  size_t failures = 0;
+  std::map<std::string, bool> ran;   // Cases run or skipped, by name
+
+  for (const bench_scene &scene : scenes) {
+    if (scene.name.find(filter) == std::string::npos) continue;
+    for (structure_type structure : structures) {
+      for (size_t n : threads) {
+        bench_case c;
+        c.scene = &scene;
+        c.structure = structure;
+        c.threads = n;
+        c.name = stringf("%s/%s/%zu", scene.name.c_str(),
+                         structure == structure_type::bvh ? "bvh" : "linear",
+                         n);
+
+        bench_result r = run_child(c);
+        ran[c.name] = true;
+        if (r.skipped) {
+          fprintf(stderr, "%-28s skipped\n", c.name.c_str());
+          continue;
+        }
+        // A crash or a failed load counts against the change
+        if (!r.ok) {
+          fprintf(stderr, "%-28s FAILED\n", c.name.c_str());
+          failures += 1;
+          continue;
+        }
+
+        fprintf(stderr, "%-28s %9.3f %12.0f %8ld kB", c.name.c_str(),
+                r.seconds, r.rays_per_second, r.peak_rss_kb);
+        auto it = base.find(c.name);
+        if (it != base.end()) {
+          double speed = 100 * (r.rays_per_second /
+                                it->second.rays_per_second - 1);
+          double memory = 100 * (r.peak_rss_kb / it->second.peak_rss_kb - 1);
+          fprintf(stderr, "  %+6.1f%% speed %+6.1f%% memory", speed, memory);
+          if (speed < -threshold || memory > threshold) {
+            fprintf(stderr, "  REGRESSION");
+            regressions += 1;
+          }
+        }
+        fprintf(stderr, "\n");
+
+        fprintf(out, "%s  %s", first ? "" : ",\n", case_json(c, r).c_str());
+        first = false;
+      }
+    }
+  }
+
+  // So does a case of the baseline that no longer runs at all
+  for (const auto &entry : base) {
+    const std::string &name = entry.first;
+    std::string scene = name.substr(0, name.find('/'));
+    if (scene.find(filter) == std::string::npos || ran.count(name) != 0)
+      continue;
+    fprintf(stderr, "%-28s missing from this run\n", name.c_str());
+    failures += 1;
+  }
+
+  fprintf(out, "\n]}\n");
+  fclose(out);
+
+  if (failures > 0)
+    fprintf(stderr, "%zu cases failed or went missing\n", failures);
+  if (regressions > 0)
+    fprintf(stderr, "%zu regressions past %.1f%% against %s\n", regressions,
+            threshold, baseline.c_str());
+  return failures > 0 || regressions > 0 ? 1 : 0;
+}
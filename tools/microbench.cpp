@@ -0,0 +1,413 @@
+/* Microbenchmarks for the intersection and traversal kernels, and for BVH
+ * builds and updates. Each kernel runs over a fixed batch of inputs drawn
+ * from a seeded generator, so runs are comparable, with rays aimed to
+ * mostly hit or mostly miss. Timings are per operation: after a warmup,
+ * batches are timed repeatedly, samples further than 3 median absolute
+ * deviations from the median are dropped, and the median and spread of the
+ * rest are reported */
+
+#include <algorithm>
+#include <chrono>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <functional>
+#include <string>
+#include <vector>
+
+#include "raytracer.hpp"
+#include "sampler.hpp"
+#include "shading.hpp"
+#include "shapes.hpp"
+
+
+static size_t num_samples = 31;
+static double min_batch_seconds = 0.002;
+static double warmup_seconds = 0.05;
+static std::string filter;
+
+static const size_t batch_inputs = 4096;
+
+
+/* Timing */
+
+struct timing {
+  double median;      // ns/op
+  double stddev;      // Of the samples kept
+  size_t kept;
+};
+
+typedef std::chrono::steady_clock bench_clock;
+
+static double seconds_since(bench_clock::time_point start) {
+  std::chrono::duration<double> elapsed = bench_clock::now() - start;
+  return elapsed.count();
+}
+
+static double median(std::vector<double> v) {
+  std::sort(v.begin(), v.end());
+  size_t n = v.size();
+  return n % 2 ? v[n/2] : (v[n/2 - 1] + v[n/2]) / 2;
+}
+
+// Results are summed here so the kernels cannot be optimized away
+static volatile double sink;
+
+/* batch() runs ops operations and returns a value depending on all of
+ * them */
+static timing measure(size_t ops, const std::function<double()> &batch) {
+  // Repeat the batch enough that a sample is long compared to the clock
+  size_t repeat = 1;
+  while (true) {
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t r = 0; r < repeat; r++) sink = sink + batch();
+    if (seconds_since(start) >= min_batch_seconds) break;
+    repeat *= 2;
+  }
+
+  bench_clock::time_point warmup = bench_clock::now();
+  while (seconds_since(warmup) < warmup_seconds)
+    sink = sink + batch();
+
+  std::vector<double> samples;
+  for (size_t i = 0; i < num_samples; i++) {
+    bench_clock::time_point start = bench_clock::now();
+    for (size_t r = 0; r < repeat; r++) sink = sink + batch();
+    samples.push_back(seconds_since(start) * 1e9 / (ops * repeat));
+  }
+
+  double med = median(samples);
+  std::vector<double> deviations;
+  for (double s : samples) deviations.push_back(std::abs(s - med));
+  double mad = median(deviations);
+
+  std::vector<double> kept;
+  for (double s : samples)
+    if (std::abs(s - med) <= 3 * 1.4826 * mad) kept.push_back(s);
+
+  double mean = 0, var = 0;
+  for (double s : kept) mean += s / kept.size();
+  for (double s : kept) var += (s - mean) * (s - mean) / kept.size();
+  return { median(kept), std::sqrt(var), kept.size() };
+}
+
+
+static void report(const std::string &kernel, const std::string &variant,
+                   const std::string &dist, double hit_rate, size_t ops,
+                   const std::function<double()> &batch) {
+  std::string name = kernel + "/" + variant + "/" + dist;
+  if (name.find(filter) == std::string::npos) return;
+
+  timing t = measure(ops, batch);
+  printf("%-22s %-8s %-6s %5.1f%% %10.2f %8.2f %6zu/%zu\n", kernel.c_str(),
+         variant.c_str(), dist.c_str(), 100 * hit_rate, t.median, t.stddev,
+         t.kept, num_samples);
+  fflush(stdout);
+}
+
+
+
+/* Inputs */
+
+static rtfloat uniform(rng_state *rng, rtfloat lo, rtfloat hi) {
+  return lo + (hi - lo) * rng_float(rng);
+}
+
+static vec3f random_point(rng_state *rng, rtfloat lo, rtfloat hi) {
+  return { uniform(rng, lo, hi), uniform(rng, lo, hi), uniform(rng, lo, hi) };
+}
+
+static vec3f random_direction(rng_state *rng) {
+  while (true) {
+    vec3f v = random_point(rng, -1, 1);
+    rtfloat m = magnitude(v);
+    if (m > 0.01 && m <= 1) return v / m;
+  }
+}
+
+// From far away toward target
+static ray3f ray_toward(rng_state *rng, vec3f target, rtfloat dist) {
+  vec3f start = target + dist * random_direction(rng);
+  return { start, target - start };
+}
+
+
+enum class distribution { hit, miss };
+
+static const char *dist_name(distribution d) {
+  return d == distribution::hit ? "hit" : "miss";
+}
+
+
+
+/* Kernels */
+
+static void bench_spheres(distribution d) {
+  rng_state rng = rng_create(1, (uint64_t) d);
+  std::vector<sphere_object> spheres(batch_inputs);
+  std::vector<ray3f> rays(batch_inputs);
+
+  for (size_t i = 0; i < batch_inputs; i++) {
+    sphere_object &s = spheres[i];
+    s.center = random_point(&rng, -1, 1);
+    s.radius = uniform(&rng, 0.2, 1);
+    vec3f target = d == distribution::hit ?
+        s.center + uniform(&rng, 0, 0.9) * s.radius * random_direction(&rng) :
+        s.center + uniform(&rng, 1.5, 4) * s.radius * random_direction(&rng);
+    rays[i] = ray_toward(&rng, target, 10);
+  }
+
+  size_t hits = 0;
+  for (size_t i = 0; i < batch_inputs; i++)
+    hits += spheres[i].ray_test(rays[i]).dist < rtfloat_inf;
+
+  report("sphere.ray_test", "scalar", dist_name(d),
+         (double) hits / batch_inputs, batch_inputs, [&] {
+    double sum = 0;
+    for (size_t i = 0; i < batch_inputs; i++) {
+      rtfloat dist = spheres[i].ray_test(rays[i]).dist;
+      if (dist < rtfloat_inf) sum += dist;
+    }
+    return sum;
+  });
+}
+
+static void bench_triangles(distribution d) {
+  rng_state rng = rng_create(2, (uint64_t) d);
+  std::vector<triangle_object> triangles(batch_inputs);
+  std::vector<ray3f> rays(batch_inputs);
+
+  for (size_t i = 0; i < batch_inputs; i++) {
+    triangle_object &t = triangles[i];
+    for (int k = 0; k < 3; k++)
+      t.vertices[k] = random_point(&rng, -1, 1);
+    t.default_normals();
+
+    // Barycentric coordinates inside the triangle, or outside it
+    rtfloat u, v;
+    do {
+      u = d == distribution::hit ? rng_float(&rng) : uniform(&rng, -1, 2);
+      v = d == distribution::hit ? rng_float(&rng) : uniform(&rng, -1, 2);
+    } while ((d == distribution::hit) != (u + v <= 1 && u >= 0 && v >= 0));
+
+    vec3f target = t.vertices[0] + u * (t.vertices[1] - t.vertices[0]) +
+                   v * (t.vertices[2] - t.vertices[0]);
+    rays[i] = ray_toward(&rng, target, 10);
+  }
+
+  size_t hits = 0;
+  for (size_t i = 0; i < batch_inputs; i++)
+    hits += triangles[i].ray_test(rays[i]).dist < rtfloat_inf;
+
+  report("triangle.ray_test", "scalar", dist_name(d),
+         (double) hits / batch_inputs, batch_inputs, [&] {
+    double sum = 0;
+    for (size_t i = 0; i < batch_inputs; i++) {
+      rtfloat dist = triangles[i].ray_test(rays[i]).dist;
+      if (dist < rtfloat_inf) sum += dist;
+    }
+    return sum;
+  });
+}
+
+static aa_box3f random_box(rng_state *rng) {
+  vec3f a = random_point(rng, -1, 1), b = random_point(rng, -1, 1);
+  return { std::min(a.x, b.x), std::min(a.y, b.y), std::min(a.z, b.z),
+           std::max(a.x, b.x), std::max(a.y, b.y), std::max(a.z, b.z) };
+}
+
+static void bench_boxes(distribution d) {
+  rng_state rng = rng_create(3, (uint64_t) d);
+  std::vector<aa_box3f> boxes(batch_inputs);
+  std::vector<ray3f> rays(batch_inputs);
+
+  for (size_t i = 0; i < batch_inputs; i++) {
+    aa_box3f &box = boxes[i];
+    box = random_box(&rng);
+    vec3f size = box.high_v - box.low_v;
+    vec3f center = box.low_v + 0.5 * size;
+
+    vec3f target;
+    if (d == distribution::hit) {
+      target = { uniform(&rng, box.low_x, box.high_x),
+                 uniform(&rng, box.low_y, box.high_y),
+                 uniform(&rng, box.low_z, box.high_z) };
+    } else {
+      target = center + (magnitude(size) * uniform(&rng, 1, 3)) *
+                        random_direction(&rng);
+    }
+    rays[i] = ray_toward(&rng, target, 10);
+  }
+
+  size_t hits = 0;
+  for (size_t i = 0; i < batch_inputs; i++)
+    hits += intersect(rays[i], boxes[i]);
+
+  report("intersect(ray,box)", "scalar", dist_name(d),
+         (double) hits / batch_inputs, batch_inputs, [&] {
+    double sum = 0;
+    for (size_t i = 0; i < batch_inputs; i++)
+      sum += intersect(rays[i], boxes[i]);
+    return sum;
+  });
+}
+
+static void bench_bound_transform() {
+  rng_state rng = rng_create(4, 0);
+  std::vector<aa_box3f> boxes(batch_inputs);
+  std::vector<transform3f> transforms(batch_inputs);
+
+  for (size_t i = 0; i < batch_inputs; i++) {
+    boxes[i] = random_box(&rng);
+    transforms[i] = trans3_translate(random_point(&rng, -5, 5)) *
+                    trans3_rotate(random_direction(&rng),
+                                  uniform(&rng, 0, 6.28)) *
+                    trans3_scale(uniform(&rng, 0.5, 2), uniform(&rng, 0.5, 2),
+                                 uniform(&rng, 0.5, 2));
+  }
+
+  report("bound_transform", "scalar", "affine", 1, batch_inputs, [&] {
+    double sum = 0;
+    for (size_t i = 0; i < batch_inputs; i++)
+      sum += bound_transform(boxes[i], transforms[i].matrix).high_x;
+    return sum;
+  });
+}
+
+
+/* Traversal of a scene of small spheres scattered through a cube, with
+ * rays aimed at sphere centers or at random points between them */
+
+static const int traversal_objects = 2000;
+
+static std::string scattered_spheres() {
+  std::string s = "cam  0 0 20  -1 -1 19  1 -1 19  -1 1 19  1 1 19\n"
+                  "mat  0 0 0  1 1 1  0 0 0  1  0 0 0\n";
+  rng_state rng = rng_create(5, 0);
+  for (int i = 0; i < traversal_objects; i++) {
+    vec3f c = random_point(&rng, -5, 5);
+    s += stringf("sph  %.4f %.4f %.4f  0.05\n", c.x, c.y, c.z);
+  }
+  return s;
+}
+
+static void bench_traversal(structure_type structure, distribution d) {
+  load_options load;
+  load.structure = structure;
+  scene *s = scene_load_memory(scattered_spheres(), "scattered", load);
+  if (s == nullptr) exit(1);
+
+  // Fewer rays for the linear structure, which tests every object
+  size_t count = structure == structure_type::list ? batch_inputs / 16
+                                                   : batch_inputs;
+  rng_state rng = rng_create(6, (uint64_t) d);
+  std::vector<ray3f> rays(count);
+  for (size_t i = 0; i < count; i++) {
+    vec3f target = d == distribution::hit ?
+        ((sphere_object *) s->objects[rng_next(&rng) % s->objects.size()])
+            ->center :
+        random_point(&rng, -5, 5);
+    rays[i] = ray_toward(&rng, target, 20);
+  }
+
+  size_t hits = 0;
+  for (size_t i = 0; i < count; i++)
+    hits += trace_ray(s, rays[i]).dist < rtfloat_inf;
+
+  const char *variant = structure == structure_type::bvh ? "bvh" : "linear";
+  report("trace_ray", variant, dist_name(d), (double) hits / count, count,
+         [&] {
+    double sum = 0;
+    for (size_t i = 0; i < count; i++) {
+      rtfloat dist = trace_ray(s, rays[i]).dist;
+      if (dist < rtfloat_inf) sum += dist;
+    }
+    return sum;
+  });
+
+  // Shadow rays that stop at the first blocker
+  report("occluded", variant, dist_name(d), (double) hits / count, count,
+         [&] {
+    double sum = 0;
+    for (size_t i = 0; i < count; i++)
+      sum += occluded(s, rays[i], rtfloat_inf);
+    return sum;
+  });
+
+  scene_destroy(s);
+}
+
+
+/* BVH maintenance over the same scene: building it from scratch against
+ * refitting it after some of the spheres move, back and forth so the tree
+ * does not drift. The hits column is the fraction of spheres moved */
+
+static void bench_bvh_update() {
+  load_options load;
+  load.structure = structure_type::bvh;
+  scene *s = scene_load_memory(scattered_spheres(), "scattered", load);
+  if (s == nullptr) exit(1);
+
+  report("bvh_build", "bvh", "all", 1, 1, [&] {
+    object_structure *tree = object_bound_tree(s);
+    double size = (double) tree->memory_size();
+    delete tree;
+    return size;
+  });
+
+  const size_t fractions[] = { 100, 10 };
+  for (size_t fraction : fractions) {
+    rng_state rng = rng_create(7, fraction);
+    std::vector<scene_object *> moved;
+    for (scene_object *obj : s->objects)
+      if (rng_next(&rng) % fraction == 0)
+        moved.push_back(obj);
+
+    vec3f step = { 0.1, 0.05, 0 };
+    transform3f there = trans3_translate(step);
+    transform3f back = trans3_translate(-1 * step);
+    report("bvh_update", "bvh", stringf("1/%zu", fraction),
+           (double) moved.size() / s->objects.size(), 2, [&] {
+      double sum = 0;
+      sum += scene_transform_objects(s, moved, there).nodes_refit;
+      sum += scene_transform_objects(s, moved, back).nodes_refit;
+      return sum;
+    });
+  }
+
+  scene_destroy(s);
+}
+
+
+
+static void usage() {
+  fprintf(stderr, "Usage: microbench [--filter text] [--samples n]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (i + 1 >= argc) usage();
+    if (arg == "--filter") filter = argv[++i];
+    else if (arg == "--samples") num_samples = (size_t) atol(argv[++i]);
+    else usage();
+  }
+  if (num_samples == 0) usage();
+
+  printf("%-22s %-8s %-6s %6s %10s %8s %8s\n", "kernel", "variant", "rays",
+         "hits", "ns/op", "stddev", "kept");
+
+  distribution dists[] = { distribution::hit, distribution::miss };
+  for (distribution d : dists) bench_spheres(d);
+  for (distribution d : dists) bench_triangles(d);
+  for (distribution d : dists) bench_boxes(d);
+  bench_bound_transform();
+
+  structure_type structures[] = { structure_type::list, structure_type::bvh };
+  for (distribution d : dists)
+    for (structure_type structure : structures)
+      bench_traversal(structure, d);
+  bench_bvh_update();
+  return 0;
+}
@@ -0,0 +1,358 @@
+/* Scene generator for scaling tests. Writes scene files, and the OBJ files
+ * they refer to, for a few layouts of any size. Output only depends on the
+ * layout, count and seed, so random numbers are always drawn into
+ * variables in order, never as several arguments of one call.
+ *
+ * Triangle meshes are split into OBJ files of --chunk triangles, since
+ * normals are smoothed over each file as a whole */
+
+#include <algorithm>
+#include <cmath>
+#include <cstdio>
+#include <cstdlib>
+#include <string>
+
+#include "common.hpp"
+#include "sampler.hpp"
+
+
+static const double pi = 3.14159265358979;
+
+static std::string layout;
+static std::string out_filename;
+static FILE *out = stdout;
+static long count = 1000;
+static uint32_t seed = 1;
+static long chunk = 4096;
+
+
+static double uniform(rng_state *rng, double lo, double hi) {
+  return lo + (hi - lo) * rng_float(rng);
+}
+
+static vec3f uniform3(rng_state *rng, double lo, double hi) {
+  vec3f v;
+  v.x = uniform(rng, lo, hi);
+  v.y = uniform(rng, lo, hi);
+  v.z = uniform(rng, lo, hi);
+  return v;
+}
+
+static void write_camera(double ex, double ey, double ez,
+                         double tx, double ty, double tz) {
+  // Unit image plane one unit from the eye toward the target, with y up
+  vec3f eye = { ex, ey, ez };
+  vec3f fwd = normalize(vec3f{ tx - ex, ty - ey, tz - ez });
+  vec3f right = normalize(cross(fwd, vec3f{ 0, 1, 0 }));
+  vec3f up = cross(right, fwd);
+  vec3f center = eye + fwd;
+  vec3f corners[] = { center - 0.5 * right - 0.5 * up,
+                      center + 0.5 * right - 0.5 * up,
+                      center - 0.5 * right + 0.5 * up,
+                      center + 0.5 * right + 0.5 * up };
+  fprintf(out, "cam  %.4f %.4f %.4f", eye.x, eye.y, eye.z);
+  for (vec3f c : corners)
+    fprintf(out, "  %.4f %.4f %.4f", c.x, c.y, c.z);
+  fprintf(out, "\n");
+}
+
+static void write_material(rng_state *rng, double reflective) {
+  double r = uniform(rng, 0.2, 1), g = uniform(rng, 0.2, 1),
+         b = uniform(rng, 0.2, 1);
+  fprintf(out, "mat  %.3f %.3f %.3f  %.3f %.3f %.3f  0.4 0.4 0.4  30  "
+               "%.3f %.3f %.3f\n", 0.1 * r, 0.1 * g, 0.1 * b, r, g, b,
+          reflective, reflective, reflective);
+}
+
+
+
+/* OBJ files go next to the scene file, named after it */
+
+static std::string obj_name(const std::string &part) {
+  std::string base = out_filename;
+  size_t slash = base.find_last_of('/');
+  if (slash != std::string::npos) base = base.substr(slash + 1);
+  size_t dot = base.find_last_of('.');
+  if (dot != std::string::npos && dot > 0) base = base.substr(0, dot);
+  return base + "." + part + ".obj";
+}
+
+static FILE *open_obj(const std::string &name) {
+  std::string path = get_directory(out_filename) + name;
+  FILE *file = fopen(path.c_str(), "w");
+  if (file == nullptr) {
+    fprintf(stderr, "Error: Failed to open %s\n", path.c_str());
+    exit(1);
+  }
+  return file;
+}
+
+static void close_obj(FILE *file, const std::string &name) {
+  if (fclose(file) != 0) {
+    fprintf(stderr, "Error: Failed to write %s\n", name.c_str());
+    exit(1);
+  }
+}
+
+
+
+/* Layouts */
+
+// Random spheres in a cube that grows with the count, so the density and
+// the look stay the same
+static void gen_spheres() {
+  rng_state rng = rng_create(seed, 1);
+  double half = std::cbrt((double) count);
+
+  write_camera(0, 0.6 * half, 2.5 * half, 0, 0, 0);
+  fprintf(out, "ltd  -1 -2 -1  0.7 0.7 0.7\n"
+               "ltp  0 %.3f %.3f  0.5 0.5 0.5  0\n"
+               "lta  0.1 0.1 0.1\n", 2 * half, 2 * half);
+
+  for (long i = 0; i < count; i++) {
+    if (i % 16 == 0) write_material(&rng, 0.1);
+    vec3f c = uniform3(&rng, -half, half);
+    double r = uniform(&rng, 0.15, 0.4);
+    fprintf(out, "sph  %.4f %.4f %.4f  %.4f\n", c.x, c.y, c.z, r);
+  }
+}
+
+
+// A heightfield of about count triangles made of a few random waves, cut
+// into strips of rows, one OBJ file each
+static void gen_mesh() {
+  rng_state rng = rng_create(seed, 2);
+  long k = std::max(1L, (long) std::sqrt(count / 2.0));
+  double size = 20;
+
+  double freq[4][2], phase[4], amp[4];
+  for (int w = 0; w < 4; w++) {
+    double angle = uniform(&rng, 0, 2 * pi);
+    double f = uniform(&rng, 0.2, 1.2);
+    freq[w][0] = f * std::cos(angle);
+    freq[w][1] = f * std::sin(angle);
+    phase[w] = uniform(&rng, 0, 2 * pi);
+    amp[w] = uniform(&rng, 0.2, 0.8) / (1 + f);
+  }
+  auto height = [&](double x, double z) {
+    double y = 0;
+    for (int w = 0; w < 4; w++)
+      y += amp[w] * std::sin(freq[w][0] * x + freq[w][1] * z + phase[w]);
+    return y;
+  };
+
+  write_camera(0, 0.6 * size, 0.9 * size, 0, 0, 0);
+  fprintf(out, "ltd  -1 -1.5 -0.5  0.8 0.8 0.8\n"
+               "lta  0.15 0.15 0.15\n"
+               "mat  0.05 0.08 0.05  0.4 0.6 0.4  0.2 0.2 0.2  20  0 0 0\n");
+
+  long rows_per_file = std::max(1L, chunk / (2 * k));
+  for (long r0 = 0, part = 0; r0 < k; r0 += rows_per_file, part++) {
+    long r1 = std::min(r0 + rows_per_file, k);
+    std::string name = obj_name(stringf("mesh-%ld", part));
+    FILE *file = open_obj(name);
+
+    for (long r = r0; r <= r1; r++) {
+      for (long c = 0; c <= k; c++) {
+        double x = size * ((double) c / k - 0.5);
+        double z = size * ((double) r / k - 0.5);
+        fprintf(file, "v %.5f %.5f %.5f\n", x, height(x, z), z);
+      }
+    }
+    for (long r = 0; r < r1 - r0; r++) {
+      for (long c = 0; c < k; c++) {
+        long v = r * (k + 1) + c + 1;   // OBJ indices start at 1
+        fprintf(file, "f %ld %ld %ld\n", v, v + k + 1, v + 1);
+        fprintf(file, "f %ld %ld %ld\n", v + 1, v + k + 1, v + k + 2);
+      }
+    }
+    close_obj(file, name);
+    fprintf(out, "obj  \"%s\"\n", name.c_str());
+  }
+}
+
+
+// A grid of count copies of one torus mesh, each placed with its own
+// transformation
+static void gen_instances() {
+  rng_state rng = rng_create(seed, 3);
+  long n = std::max(1L, (long) std::ceil(std::sqrt((double) count)));
+  double spacing = 3;
+
+  std::string name = obj_name("torus");
+  FILE *file = open_obj(name);
+  static const int rings = 24, sides = 12;
+  for (int i = 0; i < rings; i++) {
+    for (int j = 0; j < sides; j++) {
+      double u = 2 * pi * i / rings, v = 2 * pi * j / sides;
+      double r = 1 + 0.35 * std::cos(v);
+      fprintf(file, "v %.5f %.5f %.5f\n", r * std::cos(u),
+              0.35 * std::sin(v), r * std::sin(u));
+    }
+  }
+  for (int i = 0; i < rings; i++) {
+    for (int j = 0; j < sides; j++) {
+      int a = i * sides + j + 1;
+      int b = ((i + 1) % rings) * sides + j + 1;
+      int c = ((i + 1) % rings) * sides + (j + 1) % sides + 1;
+      int d = i * sides + (j + 1) % sides + 1;
+      fprintf(file, "f %d %d %d\nf %d %d %d\n", a, b, c, a, c, d);
+    }
+  }
+  close_obj(file, name);
+
+  double extent = spacing * n;
+  write_camera(0, 0.5 * extent, 0.8 * extent, 0, 0, 0);
+  fprintf(out, "ltd  -1 -2 -1  0.8 0.8 0.8\n"
+               "lta  0.1 0.1 0.1\n");
+
+  for (long i = 0; i < count; i++) {
+    double x = spacing * (i % n - (n - 1) / 2.0);
+    double z = spacing * (i / n - (n - 1) / 2.0);
+    write_material(&rng, 0.05);
+    vec3f rotate = uniform3(&rng, -60, 60);
+    vec3f scale = uniform3(&rng, 0.6, 1.2);
+    fprintf(out, "xfz\nxft  %.3f 0 %.3f\nxfr  %.3f %.3f %.3f\n"
+                 "xfs  %.3f %.3f %.3f\nobj  \"%s\"\n", x, z,
+            rotate.x, rotate.y, rotate.z, scale.x, scale.y, scale.z,
+            name.c_str());
+  }
+  fprintf(out, "xfz\n");
+}
+
+
+// count dim point lights over a floor with a grid of spheres. Render with
+// --light-samples, which builds a light tree
+static void gen_lights() {
+  rng_state rng = rng_create(seed, 4);
+  double half = 20;
+
+  write_camera(0, 6, 16, 0, 0, -4);
+  fprintf(out, "lta  0.05 0.05 0.05\n"
+               "mat  0 0 0  0.8 0.8 0.8  0 0 0  1  0 0 0\n"
+               "tri  %.1f -1 %.1f  %.1f -1 %.1f  %.1f -1 %.1f\n"
+               "tri  %.1f -1 %.1f  %.1f -1 %.1f  %.1f -1 %.1f\n",
+          -half, half, half, half, half, -half,
+          -half, half, half, -half, -half, -half);
+
+  for (int i = -3; i <= 3; i++) {
+    for (int j = -3; j <= 3; j++) {
+      write_material(&rng, 0.2);
+      fprintf(out, "sph  %d 0 %d  0.7\n", 3 * i, 3 * j - 4);
+    }
+  }
+
+  // Total power stays the same whatever the count
+  double power = 200.0 / count;
+  for (long i = 0; i < count; i++) {
+    vec3f p;
+    p.x = uniform(&rng, -half, half);
+    p.y = uniform(&rng, 0.5, 4);
+    p.z = uniform(&rng, -half, half);
+    vec3f c = uniform3(&rng, 0, power);
+    fprintf(out, "ltp  %.3f %.3f %.3f  %.4f %.4f %.4f  2\n",
+            p.x, p.y, p.z, c.x, c.y, c.z);
+  }
+}
+
+
+// A corridor between two nearly parallel mirrors, with count spheres in it.
+// Rays bounce between the walls until --depth stops them
+static void gen_mirrors() {
+  rng_state rng = rng_create(seed, 5);
+  double length = std::max(10.0, 2.0 * std::sqrt((double) count));
+  double width = 4;
+
+  write_camera(0, 1.5, 2, 0.6, 0, -length / 2);
+  fprintf(out, "ltp  0 %.3f -2  0.8 0.8 0.8  0\n"
+               "lta  0.1 0.1 0.1\n", 0.9 * width);
+
+  // Mirrors, tilted slightly so reflections drift rather than repeat
+  fprintf(out, "mat  0 0 0  0.05 0.05 0.05  0.3 0.3 0.3  200  0.9 0.9 0.9\n");
+  for (int side = -1; side <= 1; side += 2) {
+    double x0 = side * width, x1 = side * (width + 0.1);
+    fprintf(out, "tri  %.3f -1 0  %.3f -1 %.3f  %.3f %.3f %.3f\n"
+                 "tri  %.3f -1 0  %.3f %.3f %.3f  %.3f %.3f 0\n",
+            x0, x1, -length, x1, width, -length,
+            x0, x1, width, -length, x0, width);
+  }
+
+  // Floor
+  fprintf(out, "mat  0.02 0.02 0.02  0.5 0.5 0.5  0 0 0  1  0.1 0.1 0.1\n"
+               "tri  %.3f -1 2  %.3f -1 2  %.3f -1 %.3f\n"
+               "tri  %.3f -1 2  %.3f -1 %.3f  %.3f -1 %.3f\n",
+          -width, width, width, -length, -width, width, -length, -width,
+          -length);
+
+  for (long i = 0; i < count; i++) {
+    write_material(&rng, uniform(&rng, 0.2, 0.8));
+    double r = uniform(&rng, 0.15, 0.5);
+    double x = uniform(&rng, -width + 1, width - 1);
+    double z = uniform(&rng, -length, -1);
+    fprintf(out, "sph  %.4f %.4f %.4f  %.4f\n", x, -1 + r, z, r);
+  }
+}
+
+
+static const struct {
+  const char *name;
+  void (*generate)();
+  bool needs_file;        // Writes OBJ files next to the scene
+} layouts[] = {
+  { "spheres",    gen_spheres,    false },
+  { "mesh",       gen_mesh,       true },
+  { "instances",  gen_instances,  true },
+  { "lights",     gen_lights,     false },
+  { "mirrors",    gen_mirrors,    false },
+};
+
+
+
+static void usage() {
+  fprintf(stderr, "Usage: scenegen spheres|mesh|instances|lights|mirrors "
+                  "[--count N] [--seed N] [--chunk N] [-o file]\n");
+  exit(1);
+}
+
+int main(int argc, char *argv[]) {
+  for (int i = 1; i < argc; i++) {
+    std::string arg = argv[i];
+    if (arg[0] != '-') {
+      if (!layout.empty()) usage();
+      layout = arg;
+      continue;
+    }
+    if (i + 1 >= argc) usage();
+    if (arg == "--count" || arg == "-n") count = atol(argv[++i]);
+    else if (arg == "--seed") seed = (uint32_t) atol(argv[++i]);
+    else if (arg == "--chunk") chunk = atol(argv[++i]);
+    else if (arg == "--output" || arg == "-o") out_filename = argv[++i];
+    else usage();
+  }
+  if (count < 1 || chunk < 1) usage();
+
+  for (auto &entry : layouts) {
+    if (layout != entry.name) continue;
+
+    if (entry.needs_file && out_filename.empty()) {
+      fprintf(stderr, "Error: The %s layout needs an output file for its "
+                      "OBJ files to go next to\n", entry.name);
+      exit(1);
+    }
+    if (!out_filename.empty()) {
+      out = fopen(out_filename.c_str(), "w");
+      if (out == nullptr) {
+        fprintf(stderr, "Error: Failed to open %s\n", out_filename.c_str());
+        exit(1);
+      }
+    }
+
+    entry.generate();
+    if (fclose(out) != 0) {
+      fprintf(stderr, "Error: Failed to write %s\n", out_filename.c_str());
+      exit(1);
+    }
+    return 0;
+  }
+  usage();
+}